@@ -3,7 +3,7 @@
 in VertexData {
 	vec3 normal;
 	vec3 worldPos;
-	vec4 shadowCoord;
+	float viewDepth;
 } VertexOut;
 
 out vec4 color;
@@ -27,10 +27,25 @@ layout(binding = 3, std140) uniform LightBlock {
 	vec4 ambient;
 	vec4 diffuse;
 	vec4 specular;
-	mat4 viewProjection;
 } light;
 
-layout(binding = 0) uniform sampler2DShadow shadowMap;
+layout(binding = 4, std140) uniform CascadesBlock {
+	mat4 viewProjection[4];
+	// far view depth of each cascade
+	vec4 splits;
+	int count;
+} cascades;
+
+// one layer per cascade
+layout(binding = 0) uniform sampler2DArrayShadow shadowMap;
+
+// bias matrix to convert shadowCoord to texture space
+const mat4 biasMatrix = mat4(
+	0.5, 0.0, 0.0, 0.0,
+	0.0, 0.5, 0.0, 0.0,
+	0.0, 0.0, 0.5, 0.0,
+	0.5, 0.5, 0.5, 1.0
+);
 
 void main() {
 	// Normal of the computed fragment, in camera space
@@ -55,9 +70,13 @@ void main() {
 	float cosAlpha = clamp(dot(E,R), 0, 1);
 	
 	float bias = 0.005;		// bias to prevent shadow acne
-	vec4 shadowCoord = VertexOut.shadowCoord;
-	shadowCoord.z -= bias;
-	float visibility = texture(shadowMap, shadowCoord.xyz / shadowCoord.w);
+	// nearest cascade containing fragment, last one covers rest of view
+	int cascade = 0;
+	while (cascade < cascades.count - 1 && VertexOut.viewDepth > cascades.splits[cascade])
+		cascade++;
+	// cascade projections are orthographic so w stays 1
+	vec4 shadowCoord = biasMatrix * cascades.viewProjection[cascade] * vec4(VertexOut.worldPos, 1);
+	float visibility = texture(shadowMap, vec4(shadowCoord.xy, cascade, shadowCoord.z - bias));
 	
 	color = 
 		// Ambient : simulates indirect lighting
@@ -6,7 +6,7 @@ layout(location = 1) in vec3 normal;
 out VertexData {
 	vec3 normal;
 	vec3 worldPos;
-	vec4 shadowCoord;
+	float viewDepth;
 } VertexOut;
 
 layout(binding = 0, std140) uniform CameraBlock {
@@ -21,22 +21,6 @@ layout(binding = 1, std140) uniform NodeBlock {
 	mat4 normalMatrix;
 } node;
 
-layout(binding = 3, std140) uniform LightBlock {
-	vec4 pos;
-	vec4 ambient;
-	vec4 diffuse;
-	vec4 specular;
-	mat4 viewProjection;
-} light;
-
-// bias matrix to convert shadowCoord to texture space
-const mat4 biasMatrix = mat4(
-	0.5, 0.0, 0.0, 0.0,
-	0.0, 0.5, 0.0, 0.0,
-	0.0, 0.0, 0.5, 0.0,
-	0.5, 0.5, 0.5, 1.0
-);
-
 void main() {
 	// Normal of the the vertex, in world space
 	VertexOut.normal = normalize(node.normalMatrix * vec4(normal, 0)).xyz;
@@ -46,5 +30,6 @@ void main() {
 	
 	gl_Position = camera.viewProjection * vec4(VertexOut.worldPos, 1);
 	
-	VertexOut.shadowCoord = biasMatrix * light.viewProjection * vec4(VertexOut.worldPos, 1);
+	// Distance along view direction selects shadow cascade
+	VertexOut.viewDepth = -(camera.view * vec4(VertexOut.worldPos, 1)).z;
 }
\ No newline at end of file
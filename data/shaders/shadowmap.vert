@@ -7,14 +7,11 @@ layout(binding = 1, std140) uniform NodeBlock {
 	mat4 normalMatrix;
 } node;
 
-layout(binding = 3, std140) uniform LightBlock {
-	vec4 pos;
-	vec4 ambient;
-	vec4 diffuse;
-	vec4 specular;
+// projection of cascade being rendered
+layout(binding = 5, std140) uniform ShadowPassBlock {
 	mat4 viewProjection;
-} light;
+} shadowPass;
 
 void main() {
-	gl_Position =  light.viewProjection * node.model * vec4(pos, 1);
+	gl_Position =  shadowPass.viewProjection * node.model * vec4(pos, 1);
 }
\ No newline at end of file
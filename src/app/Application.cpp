@@ -15,6 +15,7 @@
 #include "ShaderManager.h"
 #include "FpsCamera.h"
 #include "Light.h"
+#include "TileStreamer.h"
 
 #include "CitySceneGenerator.h"
 
@@ -23,13 +24,23 @@
 #include <glm/gtc/swizzle.hpp>
 
 #include <sstream>
+#include <cstring>
 
 const char* SDLApplication::DEFAULT_WND_TITLE = "Test app";
+const char* SDLApplication::CITY_SCENE_PATH = "city.scene";
+const float SDLApplication::CITY_TILE_SIZE = 250.0f;
 
 SDLApplication::SDLApplication(int argc, char** argv) 
 	: window(nullptr), context(nullptr), done(false), fps(60.0), windowTitle(DEFAULT_WND_TITLE),
-	  renderer(new gl::Renderer())
+	  streaming(false), shadows(false), renderer(new gl::Renderer())
 {
+	for (int i = 1; i < argc; ++i) {
+		if (std::strcmp(argv[i], "--stream") == 0)
+			streaming = true;
+		else if (std::strcmp(argv[i], "--shadows") == 0)
+			shadows = true;
+	}
+
 	if (SDL_Init(SDL_INIT_VIDEO) != 0)
 		throw SDLException("SDL_Init failed");
 
@@ -106,8 +117,24 @@ void SDLApplication::init() {
 	scene = std::unique_ptr<Scene>(new Scene(renderer.get()));
 	renderer->setScene(scene.get());
 
-	CitySceneGenerator generator;
-	generator.generate(scene.get());
+	// boxes of rotated buildings overlap a lot so split space too to get tighter nodes
+	BVH::BuildParams bvhParams;
+	bvhParams.method = BVH::SplitMethod::Spatial;
+	bvhParams.numThreads = 0;
+	// city does not move so nodes can stay compact and be used straight from scene file,
+	// compact nodes cannot be rotated so there is no optimization budget
+	bvhParams.layout = BVH::NodeLayout::Compact;
+	scene->setBvhBuildParams(bvhParams);
+
+	CitySceneGenerator generator(shadows);
+	if (streaming) {
+		streamer = generator.stream(scene.get(), CITY_TILE_SIZE);
+		streamer->setRadius(3.0f * CITY_TILE_SIZE, 4.0f * CITY_TILE_SIZE);
+	// generated city is cached so next launch just maps it from disk
+	} else if (!generator.load(scene.get(), CITY_SCENE_PATH)) {
+		generator.generate(scene.get());
+		scene->saveStaticGeometry(CITY_SCENE_PATH);
+	}
 
 	camera = std::unique_ptr<FpsCamera>(new FpsCamera(renderer.get()));
 	camera->setProjectionMatrix(glm::perspective(60.0f, (float)width / height, 0.1f, 1000.0f));
@@ -122,13 +149,8 @@ void SDLApplication::init() {
 	light->setDiffuse(glm::vec4(1.0f, 1.0f, 1.0f, 1.0f));
 	light->setSpecular(glm::vec4(1.0f, 1.0f, 1.0f, 1.0f));
 
-	/*light->toggleShadowSource(true);
-	// axis aligned box that containing scene TODO: make it something move clever than hard coded values :D
-	glm::mat4 lightProjection = glm::ortho(-5.0f, 5.0f, -5.0f, 5.0f, -5.0f, 5.0f);
-	// rotate so that light direction in camera space is -z
-	glm::mat4 lightView = glm::lookAt(glm::swizzle<glm::X, glm::Y, glm::Z>(-light->position()), 
-		glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
-	light->setViewProjection(lightProjection * lightView);*/
+	// renderer fits projections of shadow cascades to camera every frame
+	light->toggleShadowSource(shadows);
 
 	light->flushChanges();
 
@@ -143,6 +165,9 @@ void SDLApplication::update() {
 	handleKeyboard();
 
 	camera->update();
+	if (streamer)
+		streamer->update(camera->position());
+	scene->update();
 }
 
 void SDLApplication::draw() {
@@ -196,6 +221,9 @@ void SDLApplication::handleKeyboard() {
 	if (keyboardHandler.isPressedOnce(SDLK_b))
 		renderer->toggleBboxVisibility();
 
+	if (keyboardHandler.isPressedOnce(SDLK_c))
+		renderer->toggleOcclusionCulling();
+
 	static const float rollSpeed = 45.0f;
 	if (keyboardHandler.isPressed(SDLK_q))
 		camera->roll(-rollSpeed / fps);
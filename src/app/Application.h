@@ -22,6 +22,7 @@ namespace gl {
 class Scene;
 class FpsCamera;
 class Light;
+class TileStreamer;
 
 /**
  * Class representing SDL gui application.
@@ -49,6 +50,10 @@ public:
 	}
 private:
 	static const char* DEFAULT_WND_TITLE;
+	/// Cached generated city
+	static const char* CITY_SCENE_PATH;
+	/// Edge length of tiles of streamed city
+	static const float CITY_TILE_SIZE;
 
 	SDLApplication(const SDLApplication&);
 	SDLApplication& operator=(SDLApplication);
@@ -93,9 +98,15 @@ private:
 	size_t height;
 
 	bool mouseGrabbed;
+	/// endless city is streamed instead of loading fixed one, enabled by --stream argument
+	bool streaming;
+	/// city is drawn with cascaded shadow maps, enabled by --shadows argument
+	bool shadows;
 
 	std::unique_ptr<gl::Renderer> renderer;
 	std::unique_ptr<Scene> scene;
+	/// destroyed before scene because it removes its tiles from it
+	std::unique_ptr<TileStreamer> streamer;
 	std::unique_ptr<FpsCamera> camera;
 	std::unique_ptr<Light> light;
 
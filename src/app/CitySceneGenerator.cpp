@@ -48,6 +48,37 @@ static const uint32_t buildingIndices[] = {
 	4, 6, 5
 };
 
+/**
+ * Distant level of building, two quads crossing along diagonals of building. 
+ * Seen from side they have the same outline as walls, only roof is missing.
+ */
+static const uint32_t buildingLodIndices[] = {
+	0, 5, 6,
+	0, 6, 3,
+	1, 4, 7,
+	1, 7, 2
+};
+
+/// Fraction of viewport height under which building is drawn by crossed quads
+static const float BUILDING_LOD_SCREEN_SIZE = 0.05f;
+
+/// Creates building mesh from shared vertices and given triangles
+static std::shared_ptr<Mesh> createBuildingMesh(const uint32_t* indices, size_t count) {
+	auto mesh = std::make_shared<Mesh>();
+	mesh->setPrimitiveType(PrimitiveType::TriangleList);
+
+	size_t buildingVerticesCount = sizeof(buildingVertices) / sizeof(*buildingVertices);
+	std::vector<char> vertices(reinterpret_cast<const char*>(buildingVertices), 
+		reinterpret_cast<const char*>(buildingVertices) + sizeof(buildingVertices));
+	std::vector<VertexElement> layout = {
+		VertexElement(3, VertexElementType::Float),
+		VertexElement(3, VertexElementType::Float)
+	};
+	mesh->loadVertices(vertices, buildingVerticesCount, layout);
+	mesh->loadIndices(std::vector<uint32_t>(indices, indices + count));
+	return mesh;
+}
+
 class Building : public BaseSceneObject
 {
 public:
@@ -90,19 +121,29 @@ public:
 	virtual glm::vec3 centroid() const {
 		return m_bbox.center();
 	}
+protected:
+	virtual void modelMatrixChanged() {
+		calculateBBox();
+	}
 private:
 	BoundingBox m_bbox;
 };
 
-CitySceneGenerator::CitySceneGenerator() {
+const float CitySceneGenerator::BUILDINGS_PER_SQUARE_UNIT = 0.001f;
+
+CitySceneGenerator::CitySceneGenerator(bool shadowed) : m_shadowed(shadowed) {
 	std::random_device rd;
 	m_rng.seed(rd());
 }
 
-void CitySceneGenerator::generate(Scene* scene) {
+void CitySceneGenerator::createResources(Scene* scene) {
+	// generating city after failed load must not create everything again
+	if (m_material)
+		return;
+
 	auto renderer = scene->renderer();
 	auto material = std::make_shared<PhongMaterial>(renderer);
-	material->setShader(renderer->shaderManager()->getGlslProgram("phong"));
+	material->setShader(renderer->shaderManager()->getGlslProgram(m_shadowed ? "shadowedphong" : "phong"));
 
 	PhongMaterialData materialData = { glm::vec4(0.0f, 0.1f, 0.0f, 1.0f), 
 		glm::vec4(0.8f, 0.3f, 0.1f, 1.0f), glm::vec4(0.3f, 0.3f, 0.3f, 1.0f), 5.0f };
@@ -110,60 +151,98 @@ void CitySceneGenerator::generate(Scene* scene) {
 	material->properties()->setData(materialData);
 	material->properties()->flushData();
 
-	auto mesh = std::make_shared<Mesh>();
-	mesh->setPrimitiveType(PrimitiveType::TriangleList);
-
-	size_t buildingVerticesCount = sizeof(buildingVertices) / sizeof(*buildingVertices);
-	std::vector<char> vertices(reinterpret_cast<const char*>(buildingVertices), 
-		reinterpret_cast<const char*>(buildingVertices) + sizeof(buildingVertices));
-	std::vector<VertexElement> layout = {
-		VertexElement(3, VertexElementType::Float),
-		VertexElement(3, VertexElementType::Float)
+	m_mesh = createBuildingMesh(buildingIndices, sizeof(buildingIndices) / sizeof(*buildingIndices));
+	BaseSceneObject::Lod crossed = { 
+		createBuildingMesh(buildingLodIndices, sizeof(buildingLodIndices) / sizeof(*buildingLodIndices)), 
+		BUILDING_LOD_SCREEN_SIZE 
 	};
-	mesh->loadVertices(vertices, buildingVerticesCount, layout);
+	m_lods.assign(1, crossed);
+	m_material = std::move(material);
+}
 
-	size_t buildingIndicesCount = sizeof(buildingIndices) / sizeof(*buildingIndices);
-	std::vector<uint32_t> indices(reinterpret_cast<const unsigned*>(buildingIndices), 
-		reinterpret_cast<const unsigned*>(buildingIndices) + buildingIndicesCount);
-	mesh->loadIndices(indices);
+bool CitySceneGenerator::load(Scene* scene, const std::string& path) {
+	createResources(scene);
 
-	size_t numBuildings = 1000;
-	float citySize = 500.0f;
+	auto mesh = m_mesh;
+	auto lods = m_lods;
+	auto material = m_material;
+	return scene->loadStaticGeometry(path, [&](const Scene::StoredObject&) {
+		auto building = std::make_shared<Building>(mesh, material);
+		building->setLods(lods);
+		return building;
+	});
+}
+
+/// Creates building with random size and rotation placed randomly inside of rectangle
+static std::shared_ptr<BaseSceneObject> createBuilding(std::mt19937& rng, const std::shared_ptr<Mesh>& mesh, 
+		const std::vector<BaseSceneObject::Lod>& lods, const std::shared_ptr<IMaterial>& material, 
+		const glm::vec2& min, const glm::vec2& max) {
 	float minBuildingSize = 10.0f;
 	float maxBuildingSize = 60.0f;
 	float minHeightToWidthRatio = 8.0f;
 	float maxHeightToWidthRatio = 16.0f;
 
 	std::uniform_real_distribution<float> angleDist(0.0f, 360.0f);
-	std::uniform_real_distribution<float> positionDist(-citySize, citySize);
+	std::uniform_real_distribution<float> xDist(min.x, max.x);
+	std::uniform_real_distribution<float> yDist(min.y, max.y);
 	std::uniform_real_distribution<float> canonicalDist;
 
-	std::vector<std::shared_ptr<BaseSceneObject>> buildings;
-	for (size_t i = 0; i < numBuildings; i++) {
-		auto building = std::make_shared<Building>(mesh, material);
+	auto building = std::make_shared<Building>(mesh, material);
+	building->setLods(lods);
 
-		// set random position
-		glm::mat4 model = glm::translate(glm::mat4(1.0f),
-			glm::vec3(positionDist(m_rng), positionDist(m_rng), 0.0f)
-		);
+	// set random position
+	glm::mat4 model = glm::translate(glm::mat4(1.0f),
+		glm::vec3(xDist(rng), yDist(rng), 0.0f)
+	);
 
-		// rotate around z with random angle
-		model = glm::rotate(model, angleDist(m_rng), glm::vec3(0.0f, 0.0f, 1.0f));
+	// rotate around z with random angle
+	model = glm::rotate(model, angleDist(rng), glm::vec3(0.0f, 0.0f, 1.0f));
 
-		glm::vec3 scale;
-		// multiplying uniform distribution will generate beta distribution
-		scale.x = canonicalDist(m_rng) * canonicalDist(m_rng) * canonicalDist(m_rng) * canonicalDist(m_rng)
-			* (maxBuildingSize - minBuildingSize) + minBuildingSize;
-		scale.y = scale.x;
-		scale.z = canonicalDist(m_rng) * canonicalDist(m_rng) * canonicalDist(m_rng) * scale.x
-			* (maxHeightToWidthRatio - minHeightToWidthRatio) + minHeightToWidthRatio;
-		model = glm::scale(model, scale);
+	glm::vec3 scale;
+	// multiplying uniform distribution will generate beta distribution
+	scale.x = canonicalDist(rng) * canonicalDist(rng) * canonicalDist(rng) * canonicalDist(rng)
+		* (maxBuildingSize - minBuildingSize) + minBuildingSize;
+	scale.y = scale.x;
+	scale.z = canonicalDist(rng) * canonicalDist(rng) * canonicalDist(rng) * scale.x
+		* (maxHeightToWidthRatio - minHeightToWidthRatio) + minHeightToWidthRatio;
+	model = glm::scale(model, scale);
 
-		building->setModelMatrix(model);
-		building->calculateBBox();
+	building->setModelMatrix(model);
+	return building;
+}
 
-		buildings.push_back(building);
-	}
+void CitySceneGenerator::generate(Scene* scene) {
+	createResources(scene);
+
+	size_t numBuildings = 1000;
+	float citySize = 500.0f;
+
+	std::vector<std::shared_ptr<BaseSceneObject>> buildings;
+	for (size_t i = 0; i < numBuildings; i++)
+		buildings.push_back(createBuilding(m_rng, m_mesh, m_lods, m_material, glm::vec2(-citySize), glm::vec2(citySize)));
 
 	scene->setStaticGeometry(std::move(buildings));
 }
+
+std::unique_ptr<TileStreamer> CitySceneGenerator::stream(Scene* scene, float tileSize) {
+	createResources(scene);
+
+	// same density as generated city, tile seed depends only on its position so revisited tile looks the same
+	size_t buildingsPerTile = static_cast<size_t>(tileSize * tileSize * BUILDINGS_PER_SQUARE_UNIT + 0.5f);
+	uint32_t seed = m_rng();
+	auto mesh = m_mesh;
+	auto lods = m_lods;
+	auto material = m_material;
+	auto loader = [=] (int x, int y) {
+		std::mt19937 rng(seed ^ (static_cast<uint32_t>(x) * 73856093u) ^ (static_cast<uint32_t>(y) * 19349663u));
+		glm::vec2 min(x * tileSize, y * tileSize);
+		glm::vec2 max((x + 1) * tileSize, (y + 1) * tileSize);
+
+		std::vector<std::shared_ptr<BaseSceneObject>> buildings;
+		for (size_t i = 0; i < buildingsPerTile; ++i)
+			buildings.push_back(createBuilding(rng, mesh, lods, material, min, max));
+		return buildings;
+	};
+
+	return std::unique_ptr<TileStreamer>(new TileStreamer(scene, tileSize, loader));
+}
@@ -8,17 +8,47 @@
 #ifndef CITY_SCENE_GENERATOR_H
 #define CITY_SCENE_GENERATOR_H
 
+#include "TileStreamer.h"
+#include "BaseSceneObject.h"
+
 #include <random>
+#include <memory>
+#include <string>
 
 class Scene;
+class Mesh;
+class IMaterial;
 class CitySceneGenerator
 {
 public:
-	CitySceneGenerator();
+	/// @param shadowed buildings use material receiving shadows of shadow source light
+	explicit CitySceneGenerator(bool shadowed = false);
 
 	void generate(Scene* scene);
+
+	/**
+	 * Loads city saved by Scene::saveStaticGeometry.
+	 * @return false when there is no valid saved city
+	 */
+	bool load(Scene* scene, const std::string& path);
+
+	/**
+	 * Creates streamer generating endless city tile by tile on background thread.
+	 * Caller has to update streamer every frame and destroy it before scene.
+	 */
+	std::unique_ptr<TileStreamer> stream(Scene* scene, float tileSize);
 private:
+	/// Density of generated buildings, 1000 buildings on 1000 x 1000 square
+	static const float BUILDINGS_PER_SQUARE_UNIT;
+
+	/// Creates meshes and material shared by all buildings, only first call creates them
+	void createResources(Scene* scene);
+
+	bool m_shadowed;
 	std::mt19937 m_rng;
+	std::shared_ptr<Mesh> m_mesh;
+	std::vector<BaseSceneObject::Lod> m_lods;
+	std::shared_ptr<IMaterial> m_material;
 };
 
 #endif // !CITY_SCENE_GENERATOR_H
@@ -0,0 +1,261 @@
+/**
+ * @file BVHBenchmark.cpp
+ *
+ * @author Jan Duek <xdusek17@stud.fit.vutbr.cz>
+ * @date 2013
+ */
+
+#include "BVH.h"
+#include "WideBVH.h"
+#include "DynamicBVH.h"
+#include "Frustum.h"
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <iostream>
+#include <random>
+#include <chrono>
+#include <cstdlib>
+
+/// Object with bounding box only, BVH does not need anything more
+class BenchObject : public ISceneObject
+{
+public:
+	explicit BenchObject(const BoundingBox& bbox) : m_bbox(bbox) { }
+
+	virtual BoundingBox boundingBox() const override {
+		return m_bbox;
+	}
+
+	virtual glm::vec3 centroid() const override {
+		return m_bbox.center();
+	}
+
+	virtual Mesh* mesh() override {
+		return nullptr;
+	}
+
+	virtual IMaterial* material() override {
+		return nullptr;
+	}
+
+	virtual gl::IndexedBuffer* uniformBuffer() override {
+		return nullptr;
+	}
+private:
+	BoundingBox m_bbox;
+};
+
+typedef std::vector<std::shared_ptr<BenchObject>> ObjectArray;
+
+static double getTime() {
+	using namespace std::chrono;
+	return duration_cast<duration<double>>(high_resolution_clock::now().time_since_epoch()).count();
+}
+
+/// Generates city like scene of buildings placed on square grid
+static ObjectArray generateObjects(size_t count, std::mt19937& rng) {
+	float size = std::sqrt(static_cast<float>(count)) * 20.0f;
+	std::uniform_real_distribution<float> position(-size / 2.0f, size / 2.0f);
+	std::uniform_real_distribution<float> width(2.0f, 8.0f);
+	std::uniform_real_distribution<float> height(5.0f, 100.0f);
+
+	ObjectArray objects;
+	objects.reserve(count);
+	for (size_t i = 0; i < count; ++i) {
+		glm::vec3 pos(position(rng), 0.0f, position(rng));
+		glm::vec3 halfSize(width(rng), 0.0f, width(rng));
+		objects.push_back(std::make_shared<BenchObject>(
+			BoundingBox(pos - halfSize, pos + halfSize + glm::vec3(0.0f, height(rng), 0.0f))));
+	}
+	return objects;
+}
+
+static std::vector<Frustum> generateFrusta(size_t count, float sceneSize, std::mt19937& rng) {
+	std::uniform_real_distribution<float> position(-sceneSize / 2.0f, sceneSize / 2.0f);
+	std::uniform_real_distribution<float> direction(-1.0f, 1.0f);
+
+	glm::mat4 projection = glm::perspective(45.0f, 4.0f / 3.0f, 0.1f, sceneSize / 4.0f);
+
+	std::vector<Frustum> frusta;
+	frusta.reserve(count);
+	for (size_t i = 0; i < count; ++i) {
+		glm::vec3 eye(position(rng), 50.0f, position(rng));
+		glm::vec3 dir(direction(rng), -0.2f, direction(rng));
+		frusta.push_back(Frustum(projection * glm::lookAt(eye, eye + dir, glm::vec3(0.0f, 1.0f, 0.0f))));
+	}
+	return frusta;
+}
+
+/**
+ * Frustum culling traversal, works on both node layouts.
+ * @param stack traversal stack reused between calls, degenerate trees can be arbitrarily deep
+ * @return number of visible objects
+ */
+template <class NodeType>
+static size_t cullFrustum(const NodeType* nodes, const Frustum& frustum, std::vector<size_t>& stack) {
+	size_t visible = 0;
+
+	stack.clear();
+	stack.push_back(0);
+	while (!stack.empty()) {
+		size_t i = stack.back();
+		stack.pop_back();
+		const NodeType& node = nodes[i];
+
+		auto intersection = frustum.boundingBoxIntersetion(node.boundingBox());
+		if (intersection == Frustum::Intersection::None)
+			continue;
+
+		if (node.isLeaf()) {
+			visible++;
+		} else {
+			stack.push_back(i + node.rightChildOffset());
+			stack.push_back(i + 1);
+		}
+	}
+
+	return visible;
+}
+
+template <class NodeType>
+static double benchmarkTraversal(const NodeType* nodes, const std::vector<Frustum>& frusta, size_t& visible) {
+	visible = 0;
+	std::vector<size_t> stack;
+	stack.reserve(64);
+	double t1 = getTime();
+	for (auto& frustum : frusta)
+		visible += cullFrustum(nodes, frustum, stack);
+	double t2 = getTime();
+	return (t2 - t1) * 1000.0;
+}
+
+template <int Width>
+static void benchmarkWide(const BVH& bvh, const std::vector<Frustum>& frusta) {
+	double t1 = getTime();
+	WideBVH<Width> wideBvh(bvh);
+	double t2 = getTime();
+
+	size_t visible = 0;
+	auto countLeafs = [&visible] (size_t, size_t) { visible++; };
+	double t3 = getTime();
+	for (auto& frustum : frusta)
+		wideBvh.cullFrustum(frustum, countLeafs);
+	double t4 = getTime();
+
+	std::cout << Width << "-wide: " << wideBvh.nodes().size() << " nodes, " << sizeof(typename WideBVH<Width>::Node) 
+		<< " B/node, " << wideBvh.memorySize() / (1024.0 * 1024.0) << " MiB, collapsed in " << (t2 - t1) * 1000.0 
+		<< " ms, " << frusta.size() << " frusta in " << (t4 - t3) * 1000.0 << " ms (" << visible << " visible leafs)" 
+		<< std::endl;
+}
+
+/// Prints build time of BVH built with given parameters against its quality
+static void benchmarkBuild(const char* name, ObjectArray& objects, const BVH::BuildParams& params, 
+		const std::vector<Frustum>& frusta) {
+	double t1 = getTime();
+	std::unique_ptr<BVH> bvh(BVH::build(objects.begin(), objects.end(), params));
+	double t2 = getTime();
+
+	size_t visible;
+	BVH::Statistics stats = bvh->statistics(params.traversalCost, params.intersectionCost);
+	double time = benchmarkTraversal(bvh->nodes().data(), frusta, visible);
+	std::cout << name << ": built in " << (t2 - t1) * 1000.0 << " ms, SAH cost " << stats.sahCost << ", " 
+		<< stats.numObjects << " object references, " << frusta.size() << " frusta in " << time << " ms (" 
+		<< visible << " visible leafs)" << std::endl;
+}
+
+/// Measures incremental insertion, small movements and removal of half of objects
+static void benchmarkDynamic(const ObjectArray& objects, const std::vector<Frustum>& frusta, std::mt19937& rng) {
+	DynamicBVH bvh;
+	std::vector<uint32_t> proxies(objects.size());
+
+	double t1 = getTime();
+	for (size_t i = 0; i < objects.size(); ++i)
+		proxies[i] = bvh.insert(objects[i]->boundingBox(), i);
+	double t2 = getTime();
+
+	std::uniform_real_distribution<float> offset(-1.0f, 1.0f);
+	size_t reinserted = 0;
+	for (size_t i = 0; i < objects.size(); ++i) {
+		BoundingBox bbox = objects[i]->boundingBox();
+		glm::vec3 d(offset(rng), offset(rng), 0.0f);
+		reinserted += bvh.move(proxies[i], BoundingBox(bbox.min() + d, bbox.max() + d));
+	}
+	double t3 = getTime();
+
+	size_t visible = 0;
+	auto countObjects = [&visible] (size_t) { visible++; };
+	for (auto& frustum : frusta)
+		bvh.cullFrustum(frustum, countObjects);
+	double t4 = getTime();
+
+	for (size_t i = 0; i < objects.size(); i += 2)
+		bvh.remove(proxies[i]);
+	double t5 = getTime();
+
+	std::cout << "Dynamic: inserted in " << (t2 - t1) * 1000.0 << " ms (height " << bvh.height() << "), moved in " 
+		<< (t3 - t2) * 1000.0 << " ms (" << reinserted << " reinserted), " << frusta.size() << " frusta in " 
+		<< (t4 - t3) * 1000.0 << " ms (" << visible << " visible objects), half removed in " << (t5 - t4) * 1000.0 
+		<< " ms" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+	size_t numObjects = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1000000;
+	size_t numFrusta = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 1000;
+
+	std::mt19937 rng(42);
+	ObjectArray objects = generateObjects(numObjects, rng);
+	float sceneSize = std::sqrt(static_cast<float>(numObjects)) * 20.0f;
+	std::vector<Frustum> frusta = generateFrusta(numFrusta, sceneSize, rng);
+
+	BVH::BuildParams params;
+	params.method = BVH::SplitMethod::BinnedSAH;
+	params.numThreads = 0;
+
+	double t1 = getTime();
+	std::unique_ptr<BVH> bvh(BVH::build(objects.begin(), objects.end(), params));
+	double t2 = getTime();
+	std::cout << "Built BVH over " << numObjects << " objects in " << (t2 - t1) * 1000.0 << " ms" << std::endl;
+	std::cout << "Statistics: " << bvh->statistics(params.traversalCost, params.intersectionCost) << std::endl;
+
+	size_t visible;
+	size_t standardMemory = bvh->nodesMemorySize();
+	double standardTime = benchmarkTraversal(bvh->nodes().data(), frusta, visible);
+	std::cout << "Standard: " << bvh->numNodes() << " nodes, " << sizeof(BVH::Node) << " B/node, " 
+		<< standardMemory / (1024.0 * 1024.0) << " MiB, " << numFrusta << " frusta in " << standardTime 
+		<< " ms (" << visible << " visible leafs)" << std::endl;
+
+	bvh->setLayout(BVH::NodeLayout::Compact);
+	size_t compactMemory = bvh->nodesMemorySize();
+	double compactTime = benchmarkTraversal(bvh->compactNodes(), frusta, visible);
+	std::cout << "Compact: " << bvh->numNodes() << " nodes, " << sizeof(BVH::CompactNode) << " B/node, " 
+		<< compactMemory / (1024.0 * 1024.0) << " MiB, " << numFrusta << " frusta in " << compactTime 
+		<< " ms (" << visible << " visible leafs)" << std::endl;
+
+	std::cout << "Compact layout uses " << 100.0 * compactMemory / standardMemory << " % of memory and " 
+		<< 100.0 * compactTime / standardTime << " % of time" << std::endl;
+
+	benchmarkWide<4>(*bvh, frusta);
+	benchmarkWide<8>(*bvh, frusta);
+
+	// faster builders give worse trees, treelet restructuring buys part of the quality back
+	BVH::BuildParams morton = params;
+	morton.method = BVH::SplitMethod::Morton;
+	benchmarkBuild("Morton", objects, morton, frusta);
+	morton.treeletSize = 7;
+	benchmarkBuild("Morton + treelets", objects, morton, frusta);
+
+	BVH::BuildParams sah = params;
+	benchmarkBuild("Binned SAH", objects, sah, frusta);
+	sah.treeletSize = 7;
+	benchmarkBuild("Binned SAH + treelets", objects, sah, frusta);
+
+	// spatial splits trade object references for less overlapping nodes
+	BVH::BuildParams spatial = params;
+	spatial.method = BVH::SplitMethod::Spatial;
+	benchmarkBuild("Spatial splits", objects, spatial, frusta);
+
+	benchmarkDynamic(objects, frusta, rng);
+
+	return 0;
+}
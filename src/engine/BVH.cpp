@@ -6,3 +6,1063 @@
  */
 
 #include "BVH.h"
+
+#include <atomic>
+
+const float BVH::ROTATION_EPSILON = 1e-5f;
+const size_t BVH::MIN_PARALLEL_GRAIN;
+
+BVH::CompactNodeArray BVH::toCompactNodes() const {
+	if (m_layout == NodeLayout::Compact)
+		return CompactNodeArray(m_compactNodes, m_compactNodes + m_numCompactNodes);
+
+	if (m_nodes.size() > std::numeric_limits<uint32_t>::max() 
+			|| m_nodes[0].numObjects > std::numeric_limits<uint32_t>::max())
+		throw std::runtime_error("BVH::toCompactNodes BVH is too big for compact layout");
+
+	CompactNodeArray result(m_nodes.size());
+	for (size_t i = 0; i < m_nodes.size(); ++i) {
+		const Node& node = m_nodes[i];
+		CompactNode& compact = result[i];
+		compact.min = node.bbox.min();
+		compact.max = node.bbox.max();
+		if (node.rightOffset == 0) {
+			compact.offset = static_cast<uint32_t>(node.start);
+			compact.count = static_cast<uint32_t>(node.numObjects);
+		} else {
+			compact.offset = static_cast<uint32_t>(node.rightOffset);
+			compact.count = 0;
+		}
+	}
+	return result;
+}
+
+BVH* BVH::fromCompactNodes(CompactNode* nodes, size_t numNodes, size_t leafSize, 
+		std::shared_ptr<void> storage, std::vector<size_t> references) {
+	if (numNodes == 0)
+		throw std::runtime_error("BVH::fromCompactNodes BVH has no nodes");
+
+	BVH* result = new BVH;
+	result->m_leafSize = leafSize;
+	result->m_layout = NodeLayout::Compact;
+	result->m_compactNodes = nodes;
+	result->m_numCompactNodes = numNodes;
+	result->m_externalStorage = std::move(storage);
+	result->m_references = std::move(references);
+	for (size_t i = 0; i < numNodes; ++i) {
+		if (nodes[i].isLeaf())
+			result->m_numLeafs++;
+	}
+	return result;
+}
+
+bool BVH::isValidCompactTree(const CompactNode* nodes, size_t numNodes, size_t numItems) {
+	if (numNodes == 0)
+		return false;
+
+	// every subtree has to fill exactly range of nodes given by its parent
+	struct Range { size_t node, end; };
+	std::vector<Range> stack;
+	Range root = { 0, numNodes };
+	stack.push_back(root);
+	while (!stack.empty()) {
+		Range range = stack.back();
+		stack.pop_back();
+		const CompactNode& node = nodes[range.node];
+
+		if (node.isLeaf()) {
+			if (range.end != range.node + 1 || static_cast<uint64_t>(node.offset) + node.count > numItems)
+				return false;
+		} else {
+			size_t right = range.node + node.offset;
+			if (node.offset < 2 || right >= range.end)
+				return false;
+			Range left = { range.node + 1, right };
+			Range rightRange = { right, range.end };
+			stack.push_back(rightRange);
+			stack.push_back(left);
+		}
+	}
+	return true;
+}
+
+void BVH::setLayout(NodeLayout layout) {
+	if (layout == m_layout)
+		return;
+
+	if (layout == NodeLayout::Compact) {
+		m_compactStorage = toCompactNodes();
+		m_compactNodes = m_compactStorage.data();
+		m_numCompactNodes = m_compactStorage.size();
+		std::vector<Node>().swap(m_nodes);
+	} else {
+		m_nodes.resize(m_numCompactNodes);
+
+		// object ranges of interior nodes are computed from their children
+		for (size_t i = m_numCompactNodes; i-- > 0; ) {
+			const CompactNode& compact = m_compactNodes[i];
+			Node& node = m_nodes[i];
+			node.bbox = compact.boundingBox();
+			if (compact.isLeaf()) {
+				node.start = compact.offset;
+				node.numObjects = compact.count;
+				node.rightOffset = 0;
+			} else {
+				const Node& left = m_nodes[i + 1];
+				const Node& right = m_nodes[i + compact.offset];
+				node.start = left.start;
+				node.numObjects = left.numObjects + right.numObjects;
+				node.rightOffset = compact.offset;
+			}
+		}
+		CompactNodeArray().swap(m_compactStorage);
+		m_externalStorage.reset();
+		m_compactNodes = nullptr;
+		m_numCompactNodes = 0;
+	}
+
+	m_layout = layout;
+}
+
+BVH::Statistics BVH::statistics(float traversalCost, float intersectionCost) const {
+	Statistics stats;
+	stats.numNodes = numNodes();
+	stats.numLeafs = 0;
+	stats.numObjects = 0;
+	stats.maxDepth = 0;
+	stats.averageDepth = 0.0;
+	stats.sahCost = 0.0;
+	stats.overlapVolume = 0.0;
+	stats.relativeOverlap = 0.0;
+	stats.nodesMemory = nodesMemorySize();
+	stats.auxiliaryMemory = m_parents.capacity() * sizeof(size_t) + m_objectLeafs.capacity() * sizeof(size_t)
+		+ m_refitStamps.capacity() * sizeof(uint32_t) + m_refitNodes.capacity() * sizeof(size_t)
+		+ (m_objectSlotsStart.capacity() + m_objectSlots.capacity()) * sizeof(size_t)
+		+ m_rotatedNodes.capacity() * sizeof(Node) + m_references.capacity() * sizeof(size_t);
+
+	if (stats.numNodes == 0)
+		return stats;
+
+	// children are always stored after their parent, so depth can be propagated forward
+	std::vector<size_t> depths(stats.numNodes, 0);
+	BoundingBox root = boundingBox(0);
+	double rootArea = root.surfaceArea();
+	size_t depthSum = 0;
+	for (size_t i = 0; i < stats.numNodes; ++i) {
+		BoundingBox bbox = boundingBox(i);
+		double area = rootArea > 0.0 ? bbox.surfaceArea() / rootArea : 1.0;
+
+		if (isLeaf(i)) {
+			size_t count = numObjects(i);
+			stats.numLeafs++;
+			stats.numObjects += count;
+			stats.sahCost += intersectionCost * area * count;
+			stats.maxDepth = std::max(stats.maxDepth, depths[i]);
+			depthSum += depths[i];
+
+			if (stats.leafHistogram.size() <= count)
+				stats.leafHistogram.resize(count + 1, 0);
+			stats.leafHistogram[count]++;
+		} else {
+			size_t right = rightChild(i);
+			depths[i + 1] = depths[i] + 1;
+			depths[right] = depths[i] + 1;
+			stats.sahCost += traversalCost * area;
+			stats.overlapVolume += boundingBox(i + 1).overlapVolume(boundingBox(right));
+		}
+	}
+
+	stats.averageDepth = static_cast<double>(depthSum) / stats.numLeafs;
+	if (root.volume() > 0.0f)
+		stats.relativeOverlap = stats.overlapVolume / root.volume();
+	return stats;
+}
+
+std::ostream& operator<<(std::ostream& out, const BVH::Statistics& stats) {
+	out << "nodes: " << stats.numNodes << ", leafs: " << stats.numLeafs << ", objects: " << stats.numObjects
+		<< ", SAH cost: " << stats.sahCost << ", max depth: " << stats.maxDepth 
+		<< ", average depth: " << stats.averageDepth << ", overlap volume: " << stats.overlapVolume 
+		<< " (" << stats.relativeOverlap * 100.0 << " % of root), memory: " << stats.nodesMemory 
+		<< " B nodes + " << stats.auxiliaryMemory << " B auxiliary, leaf histogram:";
+	for (size_t i = 0; i < stats.leafHistogram.size(); ++i) {
+		if (stats.leafHistogram[i] > 0)
+			out << " " << i << ": " << stats.leafHistogram[i];
+	}
+	return out;
+}
+
+void BVH::setBoundingBox(size_t i, const BoundingBox& bbox) {
+	if (m_layout == NodeLayout::Compact) {
+		m_compactNodes[i].min = bbox.min();
+		m_compactNodes[i].max = bbox.max();
+	} else {
+		m_nodes[i].bbox = bbox;
+	}
+}
+
+void BVH::buildRefitData() {
+	size_t n = numNodes();
+	m_parents.assign(n, static_cast<size_t>(ROOT_PARENT));
+	m_refitStamps.assign(n, 0);
+	m_refitStamp = 0;
+
+	// objects are covered by leafs, so count them
+	size_t numObjects = 0;
+	for (size_t i = 0; i < n; ++i) {
+		if (isLeaf(i))
+			numObjects += this->numObjects(i);
+	}
+	m_objectLeafs.resize(numObjects);
+
+	for (size_t i = 0; i < n; ++i) {
+		if (isLeaf(i)) {
+			size_t start = firstObject(i);
+			for (size_t j = start; j < start + this->numObjects(i); ++j)
+				m_objectLeafs[j] = i;
+		} else {
+			m_parents[i + 1] = i;
+			m_parents[rightChild(i)] = i;
+		}
+	}
+
+	// with spatial splits object can be referenced from several leafs, so list reference slots of each object
+	m_objectSlotsStart.clear();
+	m_objectSlots.clear();
+	if (hasReferences()) {
+		size_t numReferenced = *std::max_element(m_references.begin(), m_references.end()) + 1;
+		m_objectSlotsStart.assign(numReferenced + 1, 0);
+		for (size_t object : m_references)
+			m_objectSlotsStart[object + 1]++;
+		for (size_t i = 1; i <= numReferenced; ++i)
+			m_objectSlotsStart[i] += m_objectSlotsStart[i - 1];
+
+		m_objectSlots.resize(m_references.size());
+		std::vector<size_t> next(m_objectSlotsStart.begin(), m_objectSlotsStart.end() - 1);
+		for (size_t j = 0; j < m_references.size(); ++j)
+			m_objectSlots[next[m_references[j]]++] = j;
+	}
+}
+
+size_t BVH::subtreeSize(size_t index) const {
+	// last node of subtree is the rightmost leaf
+	size_t i = index;
+	while (m_nodes[i].rightOffset != 0)
+		i += m_nodes[i].rightOffset;
+	return i + 1 - index;
+}
+
+void BVH::copySubtree(size_t index, size_t size, size_t newStart) {
+	size_t offset = m_rotatedNodes.size();
+	m_rotatedNodes.insert(m_rotatedNodes.end(), m_nodes.begin() + index, m_nodes.begin() + index + size);
+
+	size_t oldStart = m_nodes[index].start;
+	for (size_t i = offset; i < m_rotatedNodes.size(); ++i)
+		m_rotatedNodes[i].start = m_rotatedNodes[i].start - oldStart + newStart;
+}
+
+size_t BVH::assembleParallelBuild(std::deque<ParallelBuildTask>& tasks, size_t index, std::vector<Node>& nodes) {
+	auto& task = tasks[index];
+
+	// task built whole subtree
+	if (task.left == 0) {
+		nodes.insert(nodes.end(), task.nodes.begin(), task.nodes.end());
+		return task.numLeafs;
+	}
+
+	size_t i = nodes.size();
+	nodes.push_back(task.node);
+	size_t numLeafs = assembleParallelBuild(tasks, task.left, nodes);
+	nodes[i].rightOffset = nodes.size() - i;
+	return numLeafs + assembleParallelBuild(tasks, task.right, nodes);
+}
+
+/// Inserts two zero bits between each of lower 10 bits
+static uint64_t expandBits10(uint64_t v) {
+	v = (v * 0x00010001u) & 0xFF0000FFu;
+	v = (v * 0x00000101u) & 0x0F00F00Fu;
+	v = (v * 0x00000011u) & 0xC30C30C3u;
+	v = (v * 0x00000005u) & 0x49249249u;
+	return v;
+}
+
+/// Inserts two zero bits between each of lower 21 bits
+static uint64_t expandBits21(uint64_t v) {
+	v &= 0x1FFFFF;
+	v = (v | v << 32) & 0x1F00000000FFFFull;
+	v = (v | v << 16) & 0x1F0000FF0000FFull;
+	v = (v | v << 8) & 0x100F00F00F00F00Full;
+	v = (v | v << 4) & 0x10C30C30C30C30C3ull;
+	v = (v | v << 2) & 0x1249249249249249ull;
+	return v;
+}
+
+uint64_t BVH::mortonCode(const glm::vec3& p, int bits) {
+	// quantize point from unit cube to grid with 2^(bits/3) cells per axis
+	int axisBits = bits / 3;
+	float cells = static_cast<float>(1u << axisBits);
+	uint64_t maxCell = (1u << axisBits) - 1;
+
+	uint64_t q[3];
+	for (int dim = 0; dim < 3; ++dim)
+		q[dim] = std::min(static_cast<uint64_t>(std::max(p[dim] * cells, 0.0f)), maxCell);
+
+	if (bits == 30)
+		return (expandBits10(q[0]) << 2) | (expandBits10(q[1]) << 1) | expandBits10(q[2]);
+	else
+		return (expandBits21(q[0]) << 2) | (expandBits21(q[1]) << 1) | expandBits21(q[2]);
+}
+
+void BVH::sortMortonPrimitives(std::vector<MortonPrimitive>& primitives, int bits) {
+	// LSD radix sort with 8 bit digits
+	static const int DIGIT_BITS = 8;
+	static const size_t NUM_BUCKETS = 1 << DIGIT_BITS;
+
+	std::vector<MortonPrimitive> temp(primitives.size());
+	for (int shift = 0; shift < bits; shift += DIGIT_BITS) {
+		size_t offsets[NUM_BUCKETS] = { 0 };
+		for (auto& primitive : primitives)
+			offsets[(primitive.code >> shift) & (NUM_BUCKETS - 1)]++;
+
+		// exclusive prefix sum gives start of each bucket
+		size_t sum = 0;
+		for (size_t i = 0; i < NUM_BUCKETS; ++i) {
+			size_t count = offsets[i];
+			offsets[i] = sum;
+			sum += count;
+		}
+
+		for (auto& primitive : primitives)
+			temp[offsets[(primitive.code >> shift) & (NUM_BUCKETS - 1)]++] = primitive;
+
+		primitives.swap(temp);
+	}
+}
+
+size_t BVH::emitMortonSubtree(const std::vector<MortonPrimitive>& primitives, size_t start, size_t end,
+		int bits, size_t leafSize, std::vector<Node>& nodes) {
+	size_t numLeafs = 0;
+
+	std::vector<BuildEntry> stack;
+	stack.reserve(128);
+
+	BuildEntry be = { ROOT_PARENT, start, end };
+	stack.push_back(be);
+
+	while (!stack.empty()) {
+		BuildEntry stackNode = stack.back();
+		stack.pop_back();
+		size_t start = stackNode.start;
+		size_t end = stackNode.end;
+
+		// bounding boxes are computed after whole hierarchy is emitted
+		Node node = { start, end - start, UNTOUCHED, BoundingBox() };
+
+		size_t mid = start;
+		if (end - start > leafSize) {
+			uint64_t firstCode = primitives[start].code;
+			uint64_t lastCode = primitives[end - 1].code;
+			if (firstCode == lastCode) {
+				// same codes, split in the middle
+				mid = start + (end - start) / 2;
+			} else {
+				// find highest differing bit, codes in range have all higher bits same
+				int bit = bits - 1;
+				while (((firstCode ^ lastCode) >> bit) == 0)
+					--bit;
+				uint64_t mask = static_cast<uint64_t>(1) << bit;
+
+				// binary search for first code with this bit set
+				size_t lo = start, hi = end - 1;
+				while (lo < hi) {
+					size_t m = lo + (hi - lo) / 2;
+					if (primitives[m].code & mask)
+						hi = m;
+					else
+						lo = m + 1;
+				}
+				mid = lo;
+			}
+		}
+
+		if (mid == start) {
+			node.rightOffset = 0;
+			numLeafs++;
+		}
+
+		nodes.push_back(node);
+
+		if (stackNode.parent != ROOT_PARENT) {
+			nodes[stackNode.parent].rightOffset--;
+
+			if (nodes[stackNode.parent].rightOffset == TOUCHED_TWICE)
+				nodes[stackNode.parent].rightOffset = nodes.size() - 1 - stackNode.parent;
+		}
+
+		if (node.rightOffset == 0)
+			continue;
+
+		BuildEntry left = { nodes.size() - 1, mid, end };
+		stack.push_back(left);
+
+		BuildEntry right = { nodes.size() - 1, start, mid };
+		stack.push_back(right);
+	}
+
+	return numLeafs;
+}
+
+size_t BVH::emitClusteredSubtree(const std::vector<Node>& topNodes, size_t index, 
+		const std::vector<MortonPrimitive>& primitives, const std::vector<size_t>& clusterSizes, 
+		size_t& cluster, size_t& offset, int bits, size_t leafSize, std::vector<Node>& nodes) {
+	const Node& topNode = topNodes[index];
+
+	// top level leaf holds one cluster which is expanded by LBVH, clusters
+	// are stored in the same order as top level leafs
+	if (topNode.rightOffset == 0) {
+		size_t start = offset;
+		offset += clusterSizes[cluster++];
+		return emitMortonSubtree(primitives, start, offset, bits, leafSize, nodes);
+	}
+
+	size_t i = nodes.size();
+	nodes.push_back(topNode);
+	size_t numLeafs = emitClusteredSubtree(topNodes, index + 1, primitives, clusterSizes, cluster, offset, bits, leafSize, nodes);
+	nodes[i].rightOffset = nodes.size() - i;
+	return numLeafs + emitClusteredSubtree(topNodes, index + topNode.rightOffset, primitives, clusterSizes, 
+		cluster, offset, bits, leafSize, nodes);
+}
+
+/// State of SBVH build shared by all nodes
+struct BVH::SpatialBuild
+{
+	struct Reference
+	{
+		BoundingBox bbox;
+		size_t object;
+	};
+
+	struct Bin
+	{
+		BoundingBox bbox;
+		/// number of references in bin, for spatial bins references starting in bin
+		size_t entries;
+		/// number of references ending in bin
+		size_t exits;
+		bool empty;
+	};
+
+	struct Split
+	{
+		/// unnormalized SAH cost, sum of child areas multiplied by their reference counts
+		float cost;
+		int dim;
+		bool spatial;
+		/// first bin of right child, used by object split
+		size_t bin;
+		/// split plane of spatial split, first centroid bin boundary of object split
+		float position;
+		/// centroid binning scale, used by object split
+		float scale;
+		BoundingBox left, right;
+		size_t numLeft, numRight;
+	};
+
+	/// spatial splits are not tried deeper to bound size of tree
+	static const size_t MAX_SPATIAL_DEPTH = 48;
+
+	SpatialBuild(const BuildParams& params, size_t numObjects, std::vector<Node>& nodes, std::vector<size_t>& references)
+		: params(params), minOverlap(0.0f), numReferences(numObjects), numLeafs(0), nodes(nodes), references(references),
+		bins(params.numBins), rightBins(params.numBins) {
+		maxReferences = numObjects + static_cast<size_t>(numObjects * std::max(params.maxDuplication, 0.0f));
+	}
+
+	void build(std::vector<Reference>& refs, size_t depth);
+	bool findObjectSplit(const std::vector<Reference>& refs, Split& split);
+	bool findSpatialSplit(const std::vector<Reference>& refs, const BoundingBox& bbox, Split& split);
+	void partitionObjects(std::vector<Reference>& refs, const Split& split, 
+		std::vector<Reference>& left, std::vector<Reference>& right);
+	void partitionSpatial(std::vector<Reference>& refs, const Split& split, 
+		std::vector<Reference>& left, std::vector<Reference>& right);
+
+	static BoundingBox clip(const BoundingBox& bbox, int dim, float lo, float hi) {
+		glm::vec3 min = bbox.min(), max = bbox.max();
+		min[dim] = std::max(min[dim], lo);
+		max[dim] = std::min(max[dim], hi);
+		return BoundingBox(min, max);
+	}
+
+	static void expand(BoundingBox& bbox, bool& empty, const BoundingBox& other) {
+		if (empty)
+			bbox = other;
+		else
+			bbox.expandToInclude(other);
+		empty = false;
+	}
+
+	const BuildParams& params;
+	float minOverlap;
+	size_t numReferences;
+	size_t maxReferences;
+	size_t numLeafs;
+	std::vector<Node>& nodes;
+	std::vector<size_t>& references;
+	std::vector<Bin> bins;
+	std::vector<Bin> rightBins;
+};
+
+size_t BVH::buildSpatial(const std::vector<BoundingBox>& boxes, const BuildParams& params, 
+		std::vector<Node>& nodes, std::vector<size_t>& references) {
+	SpatialBuild build(params, boxes.size(), nodes, references);
+
+	std::vector<SpatialBuild::Reference> refs(boxes.size());
+	BoundingBox bbox = boxes[0];
+	for (size_t i = 0; i < boxes.size(); ++i) {
+		refs[i].bbox = boxes[i];
+		refs[i].object = i;
+		bbox.expandToInclude(boxes[i]);
+	}
+
+	build.minOverlap = params.spatialSplitAlpha * bbox.surfaceArea();
+	nodes.reserve(boxes.size() * 2);
+	references.reserve(boxes.size());
+	build.build(refs, 0);
+	references.shrink_to_fit();
+	return build.numLeafs;
+}
+
+void BVH::SpatialBuild::build(std::vector<Reference>& refs, size_t depth) {
+	size_t n = refs.size();
+	BoundingBox bbox = refs[0].bbox;
+	for (size_t i = 1; i < n; ++i)
+		bbox.expandToInclude(refs[i].bbox);
+
+	size_t index = nodes.size();
+	Node node = { references.size(), 0, 0, bbox };
+	nodes.push_back(node);
+
+	Split split;
+	bool found = n > 1 && findObjectSplit(refs, split);
+
+	// try spatial split only where object split children overlap a lot
+	if (n > 1 && depth < MAX_SPATIAL_DEPTH && numReferences < maxReferences) {
+		float overlap = 0.0f;
+		if (found) {
+			glm::vec3 min = glm::max(split.left.min(), split.right.min());
+			glm::vec3 max = glm::min(split.left.max(), split.right.max());
+			if (min.x <= max.x && min.y <= max.y && min.z <= max.z)
+				overlap = BoundingBox(min, max).surfaceArea();
+		}
+
+		Split spatial;
+		if ((!found || overlap > minOverlap) && findSpatialSplit(refs, bbox, spatial) 
+				&& (!found || spatial.cost < split.cost)) {
+			split = spatial;
+			found = true;
+		}
+	}
+
+	bool leaf;
+	if (found) {
+		float area = bbox.surfaceArea();
+		float splitCost = params.traversalCost;
+		if (area > 0.0f)
+			splitCost += params.intersectionCost * split.cost / area;
+		else
+			splitCost += params.intersectionCost * n;
+		leaf = n <= params.leafSize && params.intersectionCost * n <= splitCost;
+	} else {
+		leaf = n <= params.leafSize;
+	}
+
+	if (leaf) {
+		for (auto& ref : refs)
+			references.push_back(ref.object);
+		nodes[index].numObjects = n;
+		numLeafs++;
+		return;
+	}
+
+	std::vector<Reference> left, right;
+	if (!found) {
+		// all centroids are the same, split in the middle
+		left.assign(refs.begin(), refs.begin() + n / 2);
+		right.assign(refs.begin() + n / 2, refs.end());
+	} else if (split.spatial) {
+		partitionSpatial(refs, split, left, right);
+	} else {
+		partitionObjects(refs, split, left, right);
+	}
+	std::vector<Reference>().swap(refs);
+
+	build(left, depth + 1);
+	nodes[index].rightOffset = nodes.size() - index;
+	build(right, depth + 1);
+	nodes[index].numObjects = references.size() - nodes[index].start;
+}
+
+bool BVH::SpatialBuild::findObjectSplit(const std::vector<Reference>& refs, Split& split) {
+	size_t numBins = bins.size();
+	BoundingBox centroids(refs[0].bbox.center());
+	for (auto& ref : refs)
+		centroids.expandToInclude(ref.bbox.center());
+
+	bool found = false;
+	split.cost = std::numeric_limits<float>::max();
+	for (int dim = 0; dim < 3; ++dim) {
+		float cmin = centroids.min()[dim];
+		float binScale = binningScale(cmin, centroids.max()[dim], numBins);
+		if (binScale == 0.0f)
+			continue;
+
+		for (auto& bin : bins) {
+			bin.entries = 0;
+			bin.empty = true;
+		}
+
+		for (auto& ref : refs) {
+			size_t b = binIndex(ref.bbox.center()[dim] - cmin, binScale, numBins);
+			expand(bins[b].bbox, bins[b].empty, ref.bbox);
+			bins[b].entries++;
+		}
+
+		// sweep from right and accumulate
+		rightBins[numBins - 1] = bins[numBins - 1];
+		for (size_t b = numBins - 1; b > 0; --b) {
+			rightBins[b - 1] = rightBins[b];
+			if (!bins[b - 1].empty) {
+				expand(rightBins[b - 1].bbox, rightBins[b - 1].empty, bins[b - 1].bbox);
+				rightBins[b - 1].entries += bins[b - 1].entries;
+			}
+		}
+
+		// sweep from left and evaluate split after each bin
+		Bin left = bins[0];
+		for (size_t b = 1; b < numBins; ++b) {
+			const Bin& right = rightBins[b];
+			if (left.entries != 0 && right.entries != 0) {
+				float cost = left.bbox.surfaceArea() * left.entries + right.bbox.surfaceArea() * right.entries;
+				if (cost < split.cost) {
+					split.cost = cost;
+					split.dim = dim;
+					split.spatial = false;
+					split.bin = b;
+					split.left = left.bbox;
+					split.right = right.bbox;
+					split.numLeft = left.entries;
+					split.numRight = right.entries;
+					found = true;
+				}
+			}
+
+			if (!bins[b].empty) {
+				expand(left.bbox, left.empty, bins[b].bbox);
+				left.entries += bins[b].entries;
+			}
+		}
+	}
+
+	// remember binning of centroids so partition can repeat it
+	if (found) {
+		split.position = centroids.min()[split.dim];
+		split.scale = binningScale(split.position, centroids.max()[split.dim], numBins);
+	}
+	return found;
+}
+
+bool BVH::SpatialBuild::findSpatialSplit(const std::vector<Reference>& refs, const BoundingBox& bbox, Split& split) {
+	size_t numBins = bins.size();
+
+	bool found = false;
+	split.cost = std::numeric_limits<float>::max();
+	for (int dim = 0; dim < 3; ++dim) {
+		float bmin = bbox.min()[dim];
+		float binScale = binningScale(bmin, bbox.max()[dim], numBins);
+		if (binScale == 0.0f)
+			continue;
+
+		float binWidth = (bbox.max()[dim] - bmin) / numBins;
+		for (auto& bin : bins) {
+			bin.entries = 0;
+			bin.exits = 0;
+			bin.empty = true;
+		}
+
+		// each reference is chopped to pieces by bin planes, every bin gets clipped piece
+		for (auto& ref : refs) {
+			size_t first = binIndex(ref.bbox.min()[dim] - bmin, binScale, numBins);
+			size_t last = binIndex(ref.bbox.max()[dim] - bmin, binScale, numBins);
+			for (size_t b = first; b <= last; ++b) {
+				float lo = bmin + b * binWidth;
+				float hi = b + 1 == numBins ? bbox.max()[dim] : lo + binWidth;
+				expand(bins[b].bbox, bins[b].empty, clip(ref.bbox, dim, lo, hi));
+			}
+			bins[first].entries++;
+			bins[last].exits++;
+		}
+
+		// on right side count references ending in bins, on left the ones starting
+		rightBins[numBins - 1] = bins[numBins - 1];
+		for (size_t b = numBins - 1; b > 0; --b) {
+			rightBins[b - 1] = rightBins[b];
+			if (!bins[b - 1].empty)
+				expand(rightBins[b - 1].bbox, rightBins[b - 1].empty, bins[b - 1].bbox);
+			rightBins[b - 1].exits += bins[b - 1].exits;
+		}
+
+		Bin left = bins[0];
+		for (size_t b = 1; b < numBins; ++b) {
+			const Bin& right = rightBins[b];
+			if (left.entries != 0 && right.exits != 0 && !left.empty && !right.empty) {
+				float cost = left.bbox.surfaceArea() * left.entries + right.bbox.surfaceArea() * right.exits;
+				if (cost < split.cost) {
+					split.cost = cost;
+					split.dim = dim;
+					split.spatial = true;
+					split.position = bmin + b * binWidth;
+					split.left = left.bbox;
+					split.right = right.bbox;
+					split.numLeft = left.entries;
+					split.numRight = right.exits;
+					found = true;
+				}
+			}
+
+			if (!bins[b].empty)
+				expand(left.bbox, left.empty, bins[b].bbox);
+			left.entries += bins[b].entries;
+		}
+	}
+
+	return found;
+}
+
+void BVH::SpatialBuild::partitionObjects(std::vector<Reference>& refs, const Split& split, 
+		std::vector<Reference>& left, std::vector<Reference>& right) {
+	size_t numBins = bins.size();
+	left.reserve(split.numLeft);
+	right.reserve(split.numRight);
+	for (auto& ref : refs) {
+		size_t b = binIndex(ref.bbox.center()[split.dim] - split.position, split.scale, numBins);
+		if (b < split.bin)
+			left.push_back(ref);
+		else
+			right.push_back(ref);
+	}
+}
+
+void BVH::SpatialBuild::partitionSpatial(std::vector<Reference>& refs, const Split& split, 
+		std::vector<Reference>& left, std::vector<Reference>& right) {
+	int dim = split.dim;
+	float position = split.position;
+	left.reserve(split.numLeft);
+	right.reserve(split.numRight);
+
+	// boxes and counts of children as they are updated by unsplitting
+	BoundingBox leftBox = split.left, rightBox = split.right;
+	float leftCount = static_cast<float>(split.numLeft), rightCount = static_cast<float>(split.numRight);
+
+	for (auto& ref : refs) {
+		if (ref.bbox.max()[dim] <= position) {
+			left.push_back(ref);
+		} else if (ref.bbox.min()[dim] >= position) {
+			right.push_back(ref);
+		} else {
+			// straddling reference is kept whole in one child if it is cheaper than duplicating it
+			BoundingBox leftUnsplit = leftBox, rightUnsplit = rightBox;
+			leftUnsplit.expandToInclude(ref.bbox);
+			rightUnsplit.expandToInclude(ref.bbox);
+
+			float splitCost = leftBox.surfaceArea() * leftCount + rightBox.surfaceArea() * rightCount;
+			float leftCost = leftUnsplit.surfaceArea() * leftCount + rightBox.surfaceArea() * (rightCount - 1.0f);
+			float rightCost = leftBox.surfaceArea() * (leftCount - 1.0f) + rightUnsplit.surfaceArea() * rightCount;
+
+			if (leftCost < splitCost && leftCost <= rightCost) {
+				left.push_back(ref);
+				leftBox = leftUnsplit;
+				rightCount -= 1.0f;
+			} else if (rightCost < splitCost) {
+				right.push_back(ref);
+				rightBox = rightUnsplit;
+				leftCount -= 1.0f;
+			} else {
+				Reference piece = ref;
+				piece.bbox = clip(ref.bbox, dim, -std::numeric_limits<float>::max(), position);
+				left.push_back(piece);
+				piece.bbox = clip(ref.bbox, dim, position, std::numeric_limits<float>::max());
+				right.push_back(piece);
+				numReferences++;
+			}
+		}
+	}
+
+	// unsplitting can move everything to one side
+	if (left.empty() || right.empty()) {
+		std::vector<Reference>& all = left.empty() ? right : left;
+		size_t half = all.size() / 2;
+		std::vector<Reference>& other = left.empty() ? left : right;
+		other.assign(all.begin() + half, all.end());
+		all.resize(half);
+	}
+}
+
+namespace {
+
+/// Node of linked tree which treelet restructuring works on, it keeps indices of flattened nodes
+struct TreeletNode
+{
+	/// children, both are NO_CHILD for leaf
+	size_t left, right;
+	BoundingBox bbox;
+	/// SAH cost of subtree
+	float cost;
+	/// number of nodes in subtree
+	size_t size;
+	/// object range of leaf
+	size_t start, numObjects;
+};
+
+const size_t NO_CHILD = ~static_cast<size_t>(0);
+/// minimal relative SAH improvement of restructured treelet
+const float TREELET_EPSILON = 1e-5f;
+
+/// Treelet and its optimal topology found by dynamic programming over subsets of leafs
+struct Treelet
+{
+	size_t leafs[BVH::MAX_TREELET_SIZE];
+	/// interior nodes which are reused for new topology, first one is treelet root
+	size_t internals[BVH::MAX_TREELET_SIZE - 1];
+	size_t numLeafs;
+	BoundingBox boxes[1 << BVH::MAX_TREELET_SIZE];
+	float costs[1 << BVH::MAX_TREELET_SIZE];
+	/// best split of each subset of leafs to left and right child
+	unsigned partitions[1 << BVH::MAX_TREELET_SIZE];
+};
+
+/// Writes optimal topology of leaf subset to treelet interior nodes, returns index of subset root
+size_t emitTreelet(std::vector<TreeletNode>& nodes, const Treelet& treelet, unsigned subset, size_t& nextInternal) {
+	if ((subset & (subset - 1)) == 0) {
+		size_t i = 0;
+		while ((subset & (1u << i)) == 0)
+			i++;
+		return treelet.leafs[i];
+	}
+
+	size_t index = treelet.internals[nextInternal++];
+	size_t left = emitTreelet(nodes, treelet, treelet.partitions[subset], nextInternal);
+	size_t right = emitTreelet(nodes, treelet, subset ^ treelet.partitions[subset], nextInternal);
+
+	TreeletNode& node = nodes[index];
+	node.left = left;
+	node.right = right;
+	node.bbox = treelet.boxes[subset];
+	node.cost = treelet.costs[subset];
+	node.size = 1 + nodes[left].size + nodes[right].size;
+	return index;
+}
+
+/// Rearranges treelet rooted in given interior node if it lowers SAH cost
+bool restructureTreelet(std::vector<TreeletNode>& nodes, size_t root, size_t treeletSize, 
+		float traversalCost, Treelet& treelet) {
+	// grow treelet by opening leaf with largest surface area
+	treelet.internals[0] = root;
+	treelet.leafs[0] = nodes[root].left;
+	treelet.leafs[1] = nodes[root].right;
+	size_t numInternals = 1;
+	size_t numLeafs = 2;
+	while (numLeafs < treeletSize) {
+		size_t best = NO_CHILD;
+		float bestArea = -1.0f;
+		for (size_t i = 0; i < numLeafs; ++i) {
+			const TreeletNode& leaf = nodes[treelet.leafs[i]];
+			if (leaf.left != NO_CHILD && leaf.bbox.surfaceArea() > bestArea) {
+				best = i;
+				bestArea = leaf.bbox.surfaceArea();
+			}
+		}
+
+		if (best == NO_CHILD)
+			break;
+
+		size_t opened = treelet.leafs[best];
+		treelet.internals[numInternals++] = opened;
+		treelet.leafs[best] = nodes[opened].left;
+		treelet.leafs[numLeafs++] = nodes[opened].right;
+	}
+
+	if (numLeafs < 3)
+		return false;
+
+	// subsets are processed in increasing order so all their parts are already solved
+	unsigned numSubsets = 1u << numLeafs;
+	for (unsigned subset = 1; subset < numSubsets; ++subset) {
+		unsigned lowest = subset & (~subset + 1);
+		if (subset == lowest) {
+			size_t i = 0;
+			while ((lowest & (1u << i)) == 0)
+				i++;
+			treelet.boxes[subset] = nodes[treelet.leafs[i]].bbox;
+			treelet.costs[subset] = nodes[treelet.leafs[i]].cost;
+			continue;
+		}
+
+		treelet.boxes[subset] = treelet.boxes[lowest];
+		treelet.boxes[subset].expandToInclude(treelet.boxes[subset ^ lowest]);
+
+		// partitions without lowest leaf mirror the ones with it
+		float bestCost = std::numeric_limits<float>::max();
+		unsigned bestPartition = lowest;
+		for (unsigned part = (subset - 1) & subset; part != 0; part = (part - 1) & subset) {
+			if ((part & lowest) == 0)
+				continue;
+
+			float cost = treelet.costs[part] + treelet.costs[subset ^ part];
+			if (cost < bestCost) {
+				bestCost = cost;
+				bestPartition = part;
+			}
+		}
+
+		treelet.costs[subset] = traversalCost * treelet.boxes[subset].surfaceArea() + bestCost;
+		treelet.partitions[subset] = bestPartition;
+	}
+
+	unsigned all = numSubsets - 1;
+	if (treelet.costs[all] >= nodes[root].cost * (1.0f - TREELET_EPSILON))
+		return false;
+
+	size_t nextInternal = 0;
+	emitTreelet(nodes, treelet, all, nextInternal);
+	return true;
+}
+
+/// Appends nodes of subtree in reversed preorder, so children come before their parents
+void collectBottomUp(const std::vector<TreeletNode>& nodes, size_t root, std::vector<size_t>& result) {
+	size_t start = result.size();
+	result.push_back(root);
+	for (size_t i = start; i < result.size(); ++i) {
+		const TreeletNode& node = nodes[result[i]];
+		if (node.left != NO_CHILD) {
+			result.push_back(node.left);
+			result.push_back(node.right);
+		}
+	}
+	std::reverse(result.begin() + start, result.end());
+}
+
+/// Restructures all treelets rooted in given nodes, returns number of rearranged treelets
+size_t restructureNodes(std::vector<TreeletNode>& nodes, const std::vector<size_t>& order, 
+		size_t treeletSize, float traversalCost) {
+	Treelet treelet;
+	size_t numRestructured = 0;
+	for (size_t index : order) {
+		if (nodes[index].left != NO_CHILD && restructureTreelet(nodes, index, treeletSize, traversalCost, treelet))
+			numRestructured++;
+	}
+	return numRestructured;
+}
+
+/// Flattens linked tree to depth first order
+void flattenTreelets(const std::vector<TreeletNode>& nodes, size_t index, 
+		std::vector<BVH::Node>& result, std::vector<size_t>& order) {
+	const TreeletNode& node = nodes[index];
+	size_t pos = result.size();
+	BVH::Node flat = { order.size(), 0, 0, node.bbox };
+	result.push_back(flat);
+
+	if (node.left == NO_CHILD) {
+		for (size_t i = node.start; i < node.start + node.numObjects; ++i)
+			order.push_back(i);
+	} else {
+		flattenTreelets(nodes, node.left, result, order);
+		result[pos].rightOffset = result.size() - pos;
+		flattenTreelets(nodes, node.right, result, order);
+	}
+	result[pos].numObjects = order.size() - result[pos].start;
+}
+
+}
+
+size_t BVH::restructureTreelets(const BuildParams& params, std::vector<size_t>& order) {
+	if (m_layout == NodeLayout::Compact || m_nodes[0].rightOffset == 0)
+		return 0;
+
+	// children have greater indices than parents, so costs can be computed in reverse order
+	size_t n = m_nodes.size();
+	std::vector<TreeletNode> nodes(n);
+	for (size_t i = n; i-- > 0;) {
+		const Node& node = m_nodes[i];
+		TreeletNode& treeletNode = nodes[i];
+		treeletNode.bbox = node.bbox;
+		treeletNode.start = node.start;
+		treeletNode.numObjects = node.numObjects;
+		if (node.rightOffset == 0) {
+			treeletNode.left = treeletNode.right = NO_CHILD;
+			treeletNode.cost = params.intersectionCost * node.bbox.surfaceArea() * node.numObjects;
+			treeletNode.size = 1;
+		} else {
+			treeletNode.left = i + 1;
+			treeletNode.right = i + node.rightOffset;
+			treeletNode.cost = params.traversalCost * node.bbox.surfaceArea() 
+				+ nodes[treeletNode.left].cost + nodes[treeletNode.right].cost;
+			treeletNode.size = 1 + nodes[treeletNode.left].size + nodes[treeletNode.right].size;
+		}
+	}
+
+	size_t numThreads = params.threadCount();
+	size_t grainSize = std::max(n / (numThreads * 8), MIN_PARALLEL_GRAIN);
+
+	size_t numRestructured = 0;
+	std::vector<size_t> tasks, top;
+	for (size_t iteration = 0; iteration < params.treeletIterations; ++iteration) {
+		// small subtrees are independent tasks, nodes above them are restructured afterwards,
+		// treelets grow only downwards so they never cross task boundary
+		tasks.clear();
+		top.clear();
+		top.push_back(0);
+		for (size_t i = 0; i < top.size(); ++i) {
+			const TreeletNode& node = nodes[top[i]];
+			for (size_t child : { node.left, node.right }) {
+				if (nodes[child].size <= grainSize)
+					tasks.push_back(child);
+				else
+					top.push_back(child);
+			}
+		}
+		std::reverse(top.begin(), top.end());
+
+		std::atomic<size_t> nextTask(0);
+		std::atomic<size_t> restructured(0);
+		auto worker = [&] () {
+			std::vector<size_t> order;
+			size_t count = 0;
+			for (size_t task = nextTask++; task < tasks.size(); task = nextTask++) {
+				order.clear();
+				collectBottomUp(nodes, tasks[task], order);
+				count += restructureNodes(nodes, order, params.treeletSize, params.traversalCost);
+			}
+			restructured += count;
+		};
+
+		// calling thread works as one of workers
+		std::vector<std::thread> threads;
+		for (size_t i = 1; i < std::min(numThreads, tasks.size()); ++i)
+			threads.push_back(std::thread(worker));
+		m_buildThreads = std::max(m_buildThreads, threads.size() + 1);
+		worker();
+		for (auto& thread : threads)
+			thread.join();
+
+		numRestructured += restructured + restructureNodes(nodes, top, params.treeletSize, params.traversalCost);
+	}
+
+	if (numRestructured == 0)
+		return 0;
+
+	std::vector<Node> result;
+	result.reserve(n);
+	order.clear();
+	order.reserve(m_nodes[0].numObjects);
+	flattenTreelets(nodes, 0, result, order);
+	m_nodes.swap(result);
+	return numRestructured;
+}
@@ -9,10 +9,24 @@
 #define BVH_H
 
 #include "Interfaces.h"
+#include "AlignedAllocator.h"
+#include "PrimitiveArrays.h"
 
 #include <vector>
+#include <iterator>
+#include <cstdint>
 #include <memory>
 #include <stdexcept>
+#include <algorithm>
+#include <limits>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
+#include <ostream>
+#include <cmath>
 
 /// Static Bounding volume hierarchy
 class BVH
@@ -24,42 +38,86 @@ public:
 		size_t numObjects;
 		size_t rightOffset;
 		BoundingBox bbox;
+
+		bool isLeaf() const {
+			return rightOffset == 0;
+		}
+
+		size_t rightChildOffset() const {
+			return rightOffset;
+		}
+
+		const BoundingBox& boundingBox() const {
+			return bbox;
+		}
 	};
 
-	class Iterator
+	/**
+	 * Compact node, two of them fit to one cache line. Interior nodes
+	 * does not store their object range.
+	 */
+	struct ALIGNED(32) CompactNode
+	{
+		glm::vec3 min;
+		/// first object for leaf, offset of right child for interior node
+		uint32_t offset;
+		glm::vec3 max;
+		/// number of objects in leaf, 0 for interior node
+		uint32_t count;
+
+		bool isLeaf() const {
+			return count != 0;
+		}
+
+		size_t rightChildOffset() const {
+			return count != 0 ? 0 : offset;
+		}
+
+		BoundingBox boundingBox() const {
+			return BoundingBox(min, max);
+		}
+	};
+
+	typedef std::vector<CompactNode, AlignedAllocator<CompactNode, 32>> CompactNodeArray;
+
+	/// Memory layout of nodes
+	enum class NodeLayout { Standard, Compact };
+
+	template <class NodeType>
+	class BasicIterator
 	{
 	public:
-		Iterator(BVH* bvh, size_t i) : m_bvh(bvh), m_index(i) {
+		BasicIterator(NodeType* nodes, size_t i) : m_nodes(nodes), m_index(i) {
 			stack.reserve(64);
 			stack.push_back(i);
 			++*this;
 		}
 
-		Iterator leftChild() {
-			return Iterator(m_bvh, m_index + 1);
+		BasicIterator leftChild() {
+			return BasicIterator(m_nodes, m_index + 1);
 		}
 
-		Iterator rightChild() {
-			return Iterator(m_bvh, m_index + m_bvh->m_nodes[m_index].rightOffset);
+		BasicIterator rightChild() {
+			return BasicIterator(m_nodes, m_index + m_nodes[m_index].rightChildOffset());
 		}
 
-		Node& operator*() {
-			return m_bvh->m_nodes[m_index];
+		NodeType& operator*() {
+			return m_nodes[m_index];
 		}
 
-		Node* operator->() {
-			return &m_bvh->m_nodes[m_index];
+		NodeType* operator->() {
+			return &m_nodes[m_index];
 		}
 
-		Iterator& operator++() {
+		BasicIterator& operator++() {
 			if (!stack.empty()) {
 				m_index = stack.back();
 				stack.pop_back();
 
-				auto& node = m_bvh->m_nodes[m_index];
+				auto& node = m_nodes[m_index];
 				// non-leaf
-				if (node.rightOffset != 0) {
-					stack.push_back(m_index + node.rightOffset);
+				if (!node.isLeaf()) {
+					stack.push_back(m_index + node.rightChildOffset());
 					stack.push_back(m_index + 1);
 				}
 			}
@@ -67,43 +125,358 @@ public:
 			return *this;
 		}
 
-		Iterator operator++(int) {
-			Iterator it(*this);
+		BasicIterator operator++(int) {
+			BasicIterator it(*this);
 			++*this;
 			return it;
 		}
 
-		bool operator==(const Iterator& other) {
-			return m_bvh == other.m_bvh && m_index == other.m_index;
+		bool operator==(const BasicIterator& other) {
+			return m_nodes == other.m_nodes && m_index == other.m_index;
 		}
 
-		bool operator!=(const Iterator& other) {
+		bool operator!=(const BasicIterator& other) {
 			return !(*this == other);
 		}
 	private:
-		BVH* m_bvh;
+		NodeType* m_nodes;
 		size_t m_index;
 		std::vector<size_t> stack;
 	};
 
+	typedef BasicIterator<Node> Iterator;
+	typedef BasicIterator<CompactNode> CompactIterator;
+
+	/**
+	 * Method used to choose split plane of BVH node during build
+	 * Morton builds linear BVH (LBVH) where objects are sorted along Morton
+	 * curve and nodes are split where Morton codes differ in highest bit.
+	 * Spatial is binned SAH which can also split space and reference objects
+	 * crossing the split plane from both children (SBVH).
+	 */
+	enum class SplitMethod { Middle, BinnedSAH, Morton, Spatial };
+
+	/// Maximum number of treelet leafs, restructuring tests all their partitions
+	static const size_t MAX_TREELET_SIZE = 7;
+
+	/// Parameters of BVH construction
+	struct BuildParams
+	{
+		BuildParams() : method(SplitMethod::Middle), leafSize(4), numBins(16),
+			traversalCost(1.0f), intersectionCost(1.0f), numThreads(1),
+			mortonBits(30), sahClusterBits(0), spatialSplitAlpha(1e-5f), maxDuplication(1.0f), 
+			treeletSize(0), treeletIterations(3), layout(NodeLayout::Standard) { }
+
+		/// How to choose split plane
+		SplitMethod method;
+		/// Maximum number of objects in leaf. When binned SAH is used nodes with
+		/// less objects may be split further if it lowers SAH cost.
+		size_t leafSize;
+		/// Number of bins per axis used by binned SAH
+		size_t numBins;
+		/// SAH cost of traversing interior node
+		float traversalCost;
+		/// SAH cost of testing single object
+		float intersectionCost;
+		/// Number of threads used to build independent subtrees,
+		/// 0 means one thread per hardware core.
+		size_t numThreads;
+
+		/// Number of bits of Morton codes used by Morton build, 30 or 63.
+		int mortonBits;
+		/// Morton build groups objects which share this number of top code bits to
+		/// clusters and builds top levels over these clusters using binned SAH (HLBVH).
+		/// 0 builds pure LBVH.
+		int sahClusterBits;
+
+		/// Spatial splits are tried only in nodes whose object split children overlap
+		/// by more than this fraction of root surface area.
+		float spatialSplitAlpha;
+		/// Maximum number of extra object references made by spatial splits
+		/// relative to number of objects.
+		float maxDuplication;
+
+		/// Number of leafs of treelets rearranged to optimal SAH cost after build 
+		/// (Karras, Aila: Fast Parallel Construction of High-Quality BVHs).
+		/// Can be 3 to 7, 0 disables restructuring. Pairs well with Morton build.
+		size_t treeletSize;
+		/// Number of restructuring passes over whole tree
+		size_t treeletIterations;
+		/// Layout of nodes of built BVH
+		NodeLayout layout;
+
+		/// Gets number of threads that will be actually used
+		size_t threadCount() const {
+			if (numThreads != 0)
+				return numThreads;
+			size_t n = std::thread::hardware_concurrency();
+			return n != 0 ? n : 1;
+		}
+	};
+
 	template <class RandomAccessIterator>
 	static BVH* build(RandomAccessIterator first, RandomAccessIterator last, size_t leafSize = 4);
 
+	/**
+	 * Builds BVH over objects with boundingBox() and centroid() methods accessed through
+	 * pointers. Bounds are gathered once and objects are reordered to order of leafs
+	 * only after build, BVH with spatial splits keeps them as they are.
+	 */
+	template <class RandomAccessIterator>
+	static BVH* build(RandomAccessIterator first, RandomAccessIterator last, const BuildParams& params);
+
+	/**
+	 * Builds BVH over primitives given by policy like PrimitiveArrays, having size(),
+	 * boundingBox(i), centroid(i) and swap(i, j) methods. Builder partitions primitives
+	 * in place so it reads them sequentially, their order after build is unspecified.
+	 * @param order receives original index of primitive for each object position in leafs
+	 */
+	template <class Primitives>
+	static BVH* build(Primitives& primitives, const BuildParams& params, std::vector<size_t>& order);
+
 	Iterator begin() {
-		return Iterator(this, 0);
+		return Iterator(m_nodes.data(), 0);
 	}
 
 	Iterator end() {
-		return Iterator(this, m_nodes.size() - 1);
+		return Iterator(m_nodes.data(), m_nodes.size() - 1);
+	}
+
+	CompactIterator compactBegin() {
+		return CompactIterator(m_compactNodes, 0);
+	}
+
+	CompactIterator compactEnd() {
+		return CompactIterator(m_compactNodes, m_numCompactNodes - 1);
 	}
 
+	/**
+	 * Updates bounding boxes of nodes after some objects moved. Only leafs
+	 * containing given objects and their ancestors are recomputed. Leafs of BVH with
+	 * spatial splits referencing moved objects lose their clipped bounds.
+	 * @param first objects in the same order as after build
+	 * @param dirtyObjects indices of objects whose bounding boxes changed
+	 */
+	template <class RandomAccessIterator>
+	void refit(RandomAccessIterator first, const std::vector<size_t>& dirtyObjects);
+
+	/// Gets leafs and ancestors recomputed by last refit of dirty objects
+	const std::vector<size_t>& refittedNodes() const {
+		return m_refitNodes;
+	}
+
+	/// Recomputes bounding boxes of all nodes.
+	template <class RandomAccessIterator>
+	void refit(RandomAccessIterator first);
+
+	/**
+	 * Incrementally improves tree quality by local tree rotations which lower SAH
+	 * cost (Kensler: Tree Rotations for Improving Bounding Volume Hierarchies).
+	 * Nodes are visited from bottom to top, following call continues where
+	 * previous one stopped. Rotations reorder objects inside of rotated subtree.
+	 * Compact BVH and BVH with spatial splits are not optimized.
+	 * @param first objects in the same order as after build, they will be reordered
+	 * @param timeBudget maximum time in milliseconds spent by optimization
+	 * @param rotatedNodes when given, nodes whose subtrees were rearranged are appended to it,
+	 *        nodes below them and their objects changed indices
+	 * @return number of rotations done
+	 */
+	template <class RandomAccessIterator>
+	size_t optimize(RandomAccessIterator first, double timeBudget, std::vector<size_t>* rotatedNodes = nullptr);
+
+	/// Checks if optimization visited every node since tree last changed without finding any rotation
+	bool isOptimized() const {
+		return !canOptimize() || m_unrotatedVisits >= m_nodes.size();
+	}
+
+	/// Checks if tree can be optimized by rotations, compact BVH and BVH with spatial splits cannot
+	bool canOptimize() const {
+		return m_layout != NodeLayout::Compact && !hasReferences();
+	}
+
+	/// Gets number of nodes in subtree with given root
+	size_t subtreeSize(size_t index) const;
+
+	/**
+	 * Traverses tree depth first, left child before right one. Traversal uses
+	 * fixed stack on the stack of caller so it never allocates.
+	 * @param accept functor bool(size_t node) deciding if subtree of node is visited
+	 * @param visitLeaf functor void(size_t node) called for each accepted leaf
+	 */
+	template <class AcceptFunc, class LeafFunc>
+	void traverse(AcceptFunc accept, LeafFunc visitLeaf) const {
+		traverseFrom(0, accept, visitLeaf);
+	}
+
+	NodeLayout layout() const {
+		return m_layout;
+	}
+
+	/**
+	 * Converts nodes to given layout. Compact layout takes less memory, but
+	 * it cannot be optimized and interior nodes does not know their objects.
+	 */
+	void setLayout(NodeLayout layout);
+
+	size_t numNodes() const {
+		return m_layout == NodeLayout::Compact ? m_numCompactNodes : m_nodes.size();
+	}
+
+	/// Gets number of threads which actually worked on build, 1 for serial builds and loaded trees
+	size_t buildThreads() const {
+		return m_buildThreads;
+	}
+
+	/// Tree quality and memory statistics
+	struct Statistics
+	{
+		size_t numNodes;
+		size_t numLeafs;
+		/// objects referenced by leafs, objects split by spatial splits are counted more times
+		size_t numObjects;
+		size_t maxDepth;
+		/// average depth of leafs
+		double averageDepth;
+		/// SAH cost of tree relative to cost of intersecting root
+		double sahCost;
+		/// leafHistogram[i] is number of leafs containing i objects
+		std::vector<size_t> leafHistogram;
+		/// sum of volumes shared by siblings
+		double overlapVolume;
+		/// overlap volume relative to volume of root
+		double relativeOverlap;
+		/// bytes taken by nodes
+		size_t nodesMemory;
+		/// bytes taken by object references, refit and optimization data
+		size_t auxiliaryMemory;
+	};
+
+	/// Computes statistics of tree, SAH cost uses given costs of node traversal and object intersection
+	Statistics statistics(float traversalCost = 1.0f, float intersectionCost = 1.0f) const;
+
+	/// Gets size of node array in bytes
+	size_t nodesMemorySize() const {
+		return m_layout == NodeLayout::Compact ? m_numCompactNodes * sizeof(CompactNode) 
+			: m_nodes.size() * sizeof(Node);
+	}
+
+	bool isLeaf(size_t i) const {
+		return m_layout == NodeLayout::Compact ? m_compactNodes[i].isLeaf() : m_nodes[i].isLeaf();
+	}
+
+	/// Gets index of right child of interior node, left child is always next to its parent
+	size_t rightChild(size_t i) const {
+		return i + (m_layout == NodeLayout::Compact ? m_compactNodes[i].offset : m_nodes[i].rightOffset);
+	}
+
+	/// Gets index of first object of leaf
+	size_t firstObject(size_t i) const {
+		return m_layout == NodeLayout::Compact ? m_compactNodes[i].offset : m_nodes[i].start;
+	}
+
+	/// Gets number of objects of leaf
+	size_t numObjects(size_t i) const {
+		return m_layout == NodeLayout::Compact ? m_compactNodes[i].count : m_nodes[i].numObjects;
+	}
+
+	BoundingBox boundingBox(size_t i) const {
+		return m_layout == NodeLayout::Compact ? m_compactNodes[i].boundingBox() : m_nodes[i].bbox;
+	}
+
+	/// Nodes in standard layout, empty when BVH is compact
 	std::vector<Node>& nodes() {
 		return m_nodes;
 	}
+
+	/// Nodes in compact layout, null when BVH is not compact
+	CompactNode* compactNodes() {
+		return m_compactNodes;
+	}
+
+	/// Gets copy of nodes in compact layout regardless of current layout
+	CompactNodeArray toCompactNodes() const;
+
+	/**
+	 * Creates compact BVH using nodes stored in external memory, for example 
+	 * in mapped file. Nodes are used in place and refit modifies them.
+	 * @param storage owner of node memory, kept alive as long as BVH uses nodes
+	 * @param references object references of BVH built with spatial splits
+	 */
+	static BVH* fromCompactNodes(CompactNode* nodes, size_t numNodes, size_t leafSize, 
+		std::shared_ptr<void> storage, std::vector<size_t> references = std::vector<size_t>());
+
+	/**
+	 * Checks that compact nodes from untrusted source form single tree in depth first order
+	 * and that leafs index only existing objects.
+	 * @param numItems number of objects or object references indexed by leafs
+	 */
+	static bool isValidCompactTree(const CompactNode* nodes, size_t numNodes, size_t numItems);
+
+	/// Checks if leafs reference objects through reference array, it happens when spatial splits were used
+	bool hasReferences() const {
+		return !m_references.empty();
+	}
+
+	/// Maps position in object range of leaf to index of object
+	size_t objectIndex(size_t i) const {
+		return m_references.empty() ? i : m_references[i];
+	}
+
+	/// Objects referenced by leafs, empty when leafs index objects directly
+	const std::vector<size_t>& references() const {
+		return m_references;
+	}
 private:
+	void setBoundingBox(size_t i, const BoundingBox& bbox);
+
+	BVH() : m_leafSize(0), m_numLeafs(0), m_buildThreads(1), m_layout(NodeLayout::Standard), 
+		m_compactNodes(nullptr), m_numCompactNodes(0), m_refitStamp(0), m_optimizeCursor(0), m_unrotatedVisits(0) { }
+
+	/**
+	 * Replaces subtree of node by three of its subtrees joined with one new interior node.
+	 * @param groupFirst if true result is ((a, b), c) otherwise (a, (b, c))
+	 */
+	template <class RandomAccessIterator>
+	void rotateSubtrees(RandomAccessIterator first, size_t index, size_t a, size_t b, size_t c, bool groupFirst);
+
+	/// Copies subtree nodes to scratch and moves object ranges of copied nodes
+	void copySubtree(size_t index, size_t size, size_t newStart);
+
+	/// Computes parent links and leafs of objects needed for refit.
+	void buildRefitData();
+	/// Adds node and its ancestors not yet collected by current refit to refit nodes
+	void collectRefitPath(size_t node) {
+		while (node != ROOT_PARENT && m_refitStamps[node] != m_refitStamp) {
+			m_refitStamps[node] = m_refitStamp;
+			m_refitNodes.push_back(node);
+			node = m_parents[node];
+		}
+	}
+
+	template <class RandomAccessIterator>
+	void refitNode(RandomAccessIterator first, size_t index);
+
+	/// Traverses subtree of given node, recurses when stack overflows
+	template <class AcceptFunc, class LeafFunc>
+	void traverseFrom(size_t index, AcceptFunc& accept, LeafFunc& visitLeaf) const;
+
+	/**
+	 * Rearranges treelets of standard nodes, nodes are visited from bottom to top
+	 * and independent subtrees are processed in parallel.
+	 * @param order receives old position of object for each new position
+	 * @return number of rearranged treelets
+	 */
+	size_t restructureTreelets(const BuildParams& params, std::vector<size_t>& order);
+
 	static const size_t UNTOUCHED = ~0;
 	static const size_t TOUCHED_TWICE = UNTOUCHED - 2;
 	static const size_t ROOT_PARENT = ~0;
+	/// smallest range of objects that is worth of handing to another thread
+	static const size_t MIN_PARALLEL_GRAIN = 256;
+	/// minimal relative SAH improvement of rotation
+	static const float ROTATION_EPSILON;
+	/// size of traversal stack, deeper trees are traversed with recursion
+	static const size_t TRAVERSAL_STACK_SIZE = 64;
 
 	struct BuildEntry
 	{
@@ -113,49 +486,288 @@ private:
 		size_t start, end;
 	};
 
+	struct SAHBin
+	{
+		size_t count;
+		BoundingBox bbox;
+	};
+
+	/// Subtree built by one task of parallel build
+	struct ParallelBuildTask
+	{
+		// The range of objects in the object list covered by this task.
+		size_t start, end;
+		// interior node when task splits its range into two child tasks
+		Node node;
+		// indices of child tasks, left == 0 means that task built whole subtree
+		size_t left, right;
+		// flattened subtree built by this task
+		std::vector<Node> nodes;
+		size_t numLeafs;
+	};
+
+	/// Task queue shared by threads of parallel build
+	struct ParallelBuildState
+	{
+		std::deque<ParallelBuildTask> tasks;
+		// index of next task that is not yet taken by any thread
+		size_t next;
+		size_t finished;
+		// ranges with at most this number of objects are built by one thread
+		size_t grainSize;
+		std::mutex mutex;
+		std::condition_variable cv;
+	};
+
+	/// Object with its Morton code used by Morton build
+	struct MortonPrimitive
+	{
+		uint64_t code;
+		size_t index;
+	};
+
+	/// Group of objects with same top Morton code bits
+	struct MortonCluster
+	{
+		// range of sorted Morton primitives
+		size_t start, end;
+		BoundingBox bbox;
+	};
+
+	struct SpatialBuild;
+
+	/**
+	 * Builds SBVH (Stich et al.: Spatial Splits in Bounding Volume Hierarchies).
+	 * Objects are not reordered, leafs index references array instead.
+	 * @return number of leafs
+	 */
+	static size_t buildSpatial(const std::vector<BoundingBox>& boxes, const BuildParams& params, 
+		std::vector<Node>& nodes, std::vector<size_t>& references);
+
+	template <class Primitives>
+	static size_t buildMorton(Primitives& primitives, size_t* indices, 
+		const BuildParams& params, std::vector<Node>& nodes);
+
+	static uint64_t mortonCode(const glm::vec3& p, int bits);
+	static void sortMortonPrimitives(std::vector<MortonPrimitive>& primitives, int bits);
+	static size_t emitMortonSubtree(const std::vector<MortonPrimitive>& primitives, size_t start, size_t end,
+		int bits, size_t leafSize, std::vector<Node>& nodes);
+	static size_t emitClusteredSubtree(const std::vector<Node>& topNodes, size_t index, 
+		const std::vector<MortonPrimitive>& primitives, const std::vector<size_t>& clusterSizes, 
+		size_t& cluster, size_t& offset, int bits, size_t leafSize, std::vector<Node>& nodes);
+
+	/**
+	 * Recomputes bounding boxes and object ranges of nodes from leafs up
+	 * @param positions position of primitive for each object position in leafs
+	 */
+	template <class Primitives>
+	static void computeNodeBounds(const Primitives& primitives, const std::vector<size_t>& positions, 
+		std::vector<Node>& nodes);
+
+	template <class Primitives>
+	static size_t buildSubtree(Primitives& primitives, size_t* indices, size_t start, size_t end, 
+		const BuildParams& params, std::vector<Node>& nodes);
+
+	template <class Primitives>
+	static size_t buildParallel(Primitives& primitives, size_t* indices, size_t numObjects, 
+		const BuildParams& params, size_t numThreads, std::vector<Node>& nodes);
+
+	template <class Primitives>
+	static void parallelBuildWorker(Primitives* primitives, size_t* indices, 
+		const BuildParams* params, ParallelBuildState* state);
+
+	static size_t assembleParallelBuild(std::deque<ParallelBuildTask>& tasks, size_t index, std::vector<Node>& nodes);
+
+	template <class Primitives>
+	static size_t splitNode(Primitives& primitives, size_t* indices, size_t start, size_t end, 
+		const BuildParams& params, std::vector<SAHBin>& bins, BoundingBox& bbox);
+
+	template <class Primitives>
+	static size_t partitionMiddle(Primitives& primitives, size_t* indices, size_t start, size_t end, 
+		const BoundingBox& centroidBox);
+
+	/**
+	 * Gets scale mapping offset from start of range to bin index. Returns 0 when range cannot be
+	 * split to bins, because its ends are equal up to float precision or scale would not be finite.
+	 */
+	static float binningScale(float min, float max, size_t numBins) {
+		float extent = max - min;
+		if (extent <= std::numeric_limits<float>::epsilon() * std::max(std::abs(min), std::abs(max)))
+			return 0.0f;
+		float scale = numBins / extent;
+		return scale <= std::numeric_limits<float>::max() ? scale : 0.0f;
+	}
+
+	/// Gets bin of offset from start of range, it is clamped before conversion so it is always valid index
+	static size_t binIndex(float offset, float scale, size_t numBins) {
+		float b = offset * scale;
+		if (!(b > 0.0f))
+			return 0;
+		return b < static_cast<float>(numBins - 1) ? static_cast<size_t>(b) : numBins - 1;
+	}
+
+	template <class Primitives>
+	static size_t partitionBinnedSAH(Primitives& primitives, size_t* indices, size_t start, size_t end, 
+		const BoundingBox& bbox, const BoundingBox& centroidBox, const BuildParams& params, std::vector<SAHBin>& bins);
+
 	size_t m_leafSize;
 	size_t m_numLeafs;		/// number of leafs in BVH
+	size_t m_buildThreads;
+	NodeLayout m_layout;
 	std::vector<Node> m_nodes;
+	/// objects referenced by leafs when spatial splits were used
+	std::vector<size_t> m_references;
+	/// compact nodes owned by BVH
+	CompactNodeArray m_compactStorage;
+	/// external memory holding compact nodes
+	std::shared_ptr<void> m_externalStorage;
+	CompactNode* m_compactNodes;
+	size_t m_numCompactNodes;
+
+	// refit data
+	std::vector<size_t> m_parents;			/// parent index of each node
+	std::vector<size_t> m_objectLeafs;		/// leaf index of each object, of each reference with spatial splits
+	std::vector<size_t> m_objectSlotsStart;	/// start of reference slots of each object in m_objectSlots
+	std::vector<size_t> m_objectSlots;		/// reference slots grouped by object they reference
+	std::vector<uint32_t> m_refitStamps;	/// stamp of last refit which touched node
+	std::vector<size_t> m_refitNodes;		/// nodes touched by current refit
+	uint32_t m_refitStamp;
+
+	// optimization data
+	size_t m_optimizeCursor;				/// next node to be optimized
+	size_t m_unrotatedVisits;				/// nodes visited by optimization since last rotation or refit
+	std::vector<Node> m_rotatedNodes;		/// scratch for rotated subtrees
 };
 
 template <class RandomAccessIterator>
 BVH* BVH::build(RandomAccessIterator first, RandomAccessIterator last, size_t leafSize) {
+	BuildParams params;
+	params.leafSize = leafSize;
+	return build(first, last, params);
+}
+
+template <class RandomAccessIterator>
+BVH* BVH::build(RandomAccessIterator first, RandomAccessIterator last, const BuildParams& params) {
 	if (last - first <= 0)
 		throw std::runtime_error("BVH::build cannot be caled on empty range");
 
-	size_t numLeafs = 0;
+	// objects are asked for their bounds only once, builder works on copies
+	PrimitiveArrays primitives(first, last);
+	std::vector<size_t> order;
+	BVH* result = build(primitives, params, order);
+
+	// leafs of spatial split BVH index references so objects stay where they are
+	if (!result->hasReferences()) {
+		typedef typename std::iterator_traits<RandomAccessIterator>::value_type ValueType;
+		std::vector<ValueType> objects;
+		objects.reserve(order.size());
+		for (size_t index : order)
+			objects.push_back(std::move(first[index]));
+		std::move(objects.begin(), objects.end(), first);
+	}
+	return result;
+}
+
+template <class Primitives>
+BVH* BVH::build(Primitives& primitives, const BuildParams& params, std::vector<size_t>& order) {
+	if (primitives.size() == 0)
+		throw std::runtime_error("BVH::build cannot be caled on empty range");
+	// Morton build bins clusters when it builds their top levels by SAH
+	bool binned = params.method == SplitMethod::BinnedSAH || params.method == SplitMethod::Spatial
+		|| (params.method == SplitMethod::Morton && params.sahClusterBits > 0);
+	if (binned && params.numBins < 2)
+		throw std::runtime_error("BVH::build binned SAH needs at least two bins");
+
+	if (params.method == SplitMethod::Morton && params.mortonBits != 30 && params.mortonBits != 63)
+		throw std::runtime_error("BVH::build Morton codes must have 30 or 63 bits");
+	if (params.treeletSize != 0 && (params.treeletSize < 3 || params.treeletSize > MAX_TREELET_SIZE))
+		throw std::runtime_error("BVH::build treelet size must be between 3 and 7");
+
+	size_t numObjects = primitives.size();
+	size_t numThreads = params.threadCount();
+
+	// indices are partitioned together with primitives
+	order.resize(numObjects);
+	for (size_t i = 0; i < numObjects; ++i)
+		order[i] = i;
+
 	std::vector<Node> nodes;
+	std::vector<size_t> references;
+	size_t numLeafs;
+	size_t buildThreads = 1;
+	if (params.method == SplitMethod::Morton) {
+		numLeafs = buildMorton(primitives, order.data(), params, nodes);
+	} else if (params.method == SplitMethod::Spatial) {
+		std::vector<BoundingBox> boxes(numObjects);
+		for (size_t i = 0; i < numObjects; ++i)
+			boxes[i] = primitives.boundingBox(i);
+		numLeafs = buildSpatial(boxes, params, nodes, references);
+	} else if (numThreads > 1 && numObjects > MIN_PARALLEL_GRAIN) {
+		numLeafs = buildParallel(primitives, order.data(), numObjects, params, numThreads, nodes);
+		buildThreads = numThreads;
+	} else {
+		numLeafs = buildSubtree(primitives, order.data(), 0, numObjects, params, nodes);
+	}
+
+	BVH* result = new BVH;
+	result->m_leafSize = params.leafSize;
+	result->m_nodes = std::move(nodes);
+	result->m_references = std::move(references);
+	result->m_numLeafs = numLeafs;
+	result->m_buildThreads = buildThreads;
+
+	// objects move together with restructured leafs
+	std::vector<size_t> positions;
+	if (params.treeletSize != 0 && result->restructureTreelets(params, positions) != 0) {
+		if (result->hasReferences()) {
+			std::vector<size_t> references(positions.size());
+			for (size_t i = 0; i < positions.size(); ++i)
+				references[i] = result->m_references[positions[i]];
+			result->m_references.swap(references);
+		} else {
+			std::vector<size_t> moved(positions.size());
+			for (size_t i = 0; i < positions.size(); ++i)
+				moved[i] = order[positions[i]];
+			order.swap(moved);
+		}
+	}
+
+	result->setLayout(params.layout);
+	return result;
+}
+
+template <class Primitives>
+size_t BVH::buildSubtree(Primitives& primitives, size_t* indices, size_t start, size_t end, 
+		const BuildParams& params, std::vector<Node>& nodes) {
+	size_t numLeafs = 0;
 
 	// create stack and reserve some space on it
 	std::vector<BuildEntry> stack;
 	stack.reserve(128);
 
+	// bins used by SAH, allocated once for whole build
+	std::vector<SAHBin> bins(params.numBins * 2);
+
 	// push root to stack
-	BuildEntry be = { ROOT_PARENT, 0, last - first };
+	BuildEntry be = { ROOT_PARENT, start, end };
 	stack.push_back(be);
 
-	nodes.reserve((last - first) * 2);
+	nodes.reserve(nodes.size() + (end - start) * 2);
 
 	while (!stack.empty()) {
 		BuildEntry stackNode = stack.back();
 		stack.pop_back();
 		size_t start = stackNode.start;
 		size_t end = stackNode.end;
-		size_t numObjects = end - start;
 
-		// calculate bounding box for this node
-		BoundingBox bb(first[start]->boundingBox());
-		BoundingBox bc(first[start]->centroid());
-		for (size_t i = start + 1; i < end; ++i) {
-			bb.expandToInclude(first[i]->boundingBox());
-			bc.expandToInclude(first[i]->centroid());
-		}
+		// find split position, split in start means that node will be leaf
+		BoundingBox bb;
+		size_t mid = splitNode(primitives, indices, start, end, params, bins, bb);
 
-		Node node = { stackNode.start, numObjects, UNTOUCHED, bb };
+		Node node = { stackNode.start, end - start, UNTOUCHED, bb };
 
-		// if number of primitives at this point is less than desired
-		// leaf size then this node will become leaf (Signified by rightOffset == 0)
-		if (numObjects <= leafSize) {
+		// leafs are signified by rightOffset == 0
+		if (mid == start) {
 			node.rightOffset = 0;
 			numLeafs++;
 		}
@@ -174,39 +786,621 @@ BVH* BVH::build(RandomAccessIterator first, RandomAccessIterator last, size_t le
 		if (node.rightOffset == 0)
 			continue;
 
-		// get longest dimension, which we will split
-		auto dim = bc.maxDimension();
+		// push left child
+		BuildEntry left = { nodes.size() - 1, mid, end };
+		stack.push_back(left);
 
-		// split in center of longest axis
-		float splitCoord = 0.5f * (bc.min()[dim] + bc.max()[dim]);
+		// push right child
+		BuildEntry right = { nodes.size() - 1, start, mid };
+		stack.push_back(right);
+	}
+
+	return numLeafs;
+}
 
-		// Partition the list of objects on this split
-		size_t mid = start;
+template <class Primitives>
+size_t BVH::buildParallel(Primitives& primitives, size_t* indices, size_t numObjects, 
+		const BuildParams& params, size_t numThreads, std::vector<Node>& nodes) {
+	ParallelBuildState state;
+	state.next = 0;
+	state.finished = 0;
+	// create several tasks per thread so threads are balanced even for uneven splits
+	size_t grainSize = numObjects / (numThreads * 8);
+	state.grainSize = grainSize > MIN_PARALLEL_GRAIN ? grainSize : MIN_PARALLEL_GRAIN;
+
+	ParallelBuildTask root;
+	root.start = 0;
+	root.end = numObjects;
+	root.left = root.right = 0;
+	root.numLeafs = 0;
+	state.tasks.push_back(std::move(root));
+
+	// calling thread works as one of workers
+	std::vector<std::thread> threads;
+	for (size_t i = 1; i < numThreads; ++i)
+		threads.push_back(std::thread(&BVH::parallelBuildWorker<Primitives>, &primitives, indices, &params, &state));
+	parallelBuildWorker(&primitives, indices, &params, &state);
+	for (auto& thread : threads)
+		thread.join();
+
+	// task subtrees have relative offsets so they can be simply concatenated
+	nodes.reserve(numObjects * 2);
+	return assembleParallelBuild(state.tasks, 0, nodes);
+}
+
+template <class Primitives>
+void BVH::parallelBuildWorker(Primitives* primitives, size_t* indices, 
+		const BuildParams* params, ParallelBuildState* state) {
+	std::vector<SAHBin> bins(params->numBins * 2);
+
+	std::unique_lock<std::mutex> lock(state->mutex);
+	while (true) {
+		// wait until there is some task or all tasks are done
+		state->cv.wait(lock, [state] { 
+			return state->next < state->tasks.size() || state->finished == state->tasks.size(); 
+		});
+		if (state->next == state->tasks.size())
+			break;
+
+		// deque does not invalidate references on push_back so we can work without lock
+		ParallelBuildTask& task = state->tasks[state->next++];
+		lock.unlock();
+
+		size_t mid = task.start;
+		if (task.end - task.start > state->grainSize) {
+			// split big range and let child ranges be processed by any thread
+			BoundingBox bb;
+			mid = splitNode(*primitives, indices, task.start, task.end, *params, bins, bb);
+			Node node = { task.start, task.end - task.start, 0, bb };
+			if (mid == task.start) {
+				task.nodes.push_back(node);
+				task.numLeafs = 1;
+			} else {
+				task.node = node;
+			}
+		} else {
+			task.numLeafs = buildSubtree(*primitives, indices, task.start, task.end, *params, task.nodes);
+		}
+
+		lock.lock();
+		if (mid != task.start) {
+			ParallelBuildTask child;
+			child.left = child.right = 0;
+			child.numLeafs = 0;
+
+			child.start = task.start;
+			child.end = mid;
+			task.left = state->tasks.size();
+			state->tasks.push_back(child);
+
+			child.start = mid;
+			child.end = task.end;
+			task.right = state->tasks.size();
+			state->tasks.push_back(std::move(child));
+		}
+		state->finished++;
+		state->cv.notify_all();
+	}
+}
+
+template <class Primitives>
+size_t BVH::buildMorton(Primitives& primitives, size_t* indices, 
+		const BuildParams& params, std::vector<Node>& nodes) {
+	// Lauterbach et al.: Fast BVH Construction on GPUs
+	int bits = params.mortonBits;
+	size_t numObjects = primitives.size();
+
+	// compute Morton codes of centroids quantized in centroids bounding box
+	BoundingBox bc(primitives.centroid(0));
+	for (size_t i = 1; i < numObjects; ++i)
+		bc.expandToInclude(primitives.centroid(i));
+
+	glm::vec3 extent = bc.max() - bc.min();
+	glm::vec3 scale;
+	for (int dim = 0; dim < 3; ++dim)
+		scale[dim] = extent[dim] > 0.0f ? 1.0f / extent[dim] : 0.0f;
+
+	std::vector<MortonPrimitive> sorted(numObjects);
+	for (size_t i = 0; i < numObjects; ++i) {
+		sorted[i].code = mortonCode((primitives.centroid(i) - bc.min()) * scale, bits);
+		sorted[i].index = i;
+	}
+
+	sortMortonPrimitives(sorted, bits);
+
+	size_t numLeafs;
+	int clusterShift = bits - params.sahClusterBits;
+	if (params.sahClusterBits <= 0 || clusterShift <= 0) {
+		numLeafs = emitMortonSubtree(sorted, 0, numObjects, bits, params.leafSize, nodes);
+	} else {
+		// Pantaleoni, Luebke: HLBVH: Hierarchical LBVH Construction for Real-Time Ray Tracing
+		std::vector<MortonCluster> clusters;
+		for (size_t i = 0; i < numObjects; ++i) {
+			BoundingBox bbox = primitives.boundingBox(sorted[i].index);
+			if (i == 0 || (sorted[i].code >> clusterShift) != (sorted[i - 1].code >> clusterShift)) {
+				MortonCluster cluster = { i, i + 1, bbox };
+				clusters.push_back(cluster);
+			} else {
+				clusters.back().end = i + 1;
+				clusters.back().bbox.expandToInclude(bbox);
+			}
+		}
+
+		// build top levels over clusters, every cluster ends in its own leaf
+		PrimitiveArrays clusterBounds(clusters.size());
+		std::vector<size_t> clusterOrder(clusters.size());
+		for (size_t i = 0; i < clusters.size(); ++i) {
+			clusterBounds.set(i, clusters[i].bbox);
+			clusterOrder[i] = i;
+		}
+
+		BuildParams topParams = params;
+		topParams.method = SplitMethod::BinnedSAH;
+		topParams.leafSize = 1;
+		std::vector<Node> topNodes;
+		buildSubtree(clusterBounds, clusterOrder.data(), 0, clusters.size(), topParams, topNodes);
+
+		// order primitives in order of clusters in top level leafs
+		std::vector<MortonPrimitive> ordered;
+		std::vector<size_t> clusterSizes;
+		ordered.reserve(numObjects);
+		for (auto& node : topNodes) {
+			if (node.rightOffset != 0)
+				continue;
+			const MortonCluster& cluster = clusters[clusterOrder[node.start]];
+			ordered.insert(ordered.end(), sorted.begin() + cluster.start, sorted.begin() + cluster.end);
+			clusterSizes.push_back(cluster.end - cluster.start);
+		}
+		sorted = std::move(ordered);
+
+		size_t cluster = 0, offset = 0;
+		numLeafs = emitClusteredSubtree(topNodes, 0, sorted, clusterSizes, cluster, offset, 
+			bits, params.leafSize, nodes);
+	}
+
+	// objects are ordered by their Morton codes, primitives can stay where they are
+	std::vector<size_t> positions(numObjects);
+	std::vector<size_t> unsorted(indices, indices + numObjects);
+	for (size_t i = 0; i < numObjects; ++i) {
+		positions[i] = sorted[i].index;
+		indices[i] = unsorted[positions[i]];
+	}
+
+	computeNodeBounds(primitives, positions, nodes);
+	return numLeafs;
+}
+
+template <class Primitives>
+void BVH::computeNodeBounds(const Primitives& primitives, const std::vector<size_t>& positions, 
+		std::vector<Node>& nodes) {
+	// children are always stored after their parent
+	for (size_t i = nodes.size(); i-- > 0; ) {
+		Node& node = nodes[i];
+		if (node.rightOffset == 0) {
+			node.bbox = primitives.boundingBox(positions[node.start]);
+			for (size_t j = node.start + 1; j < node.start + node.numObjects; ++j)
+				node.bbox.expandToInclude(primitives.boundingBox(positions[j]));
+		} else {
+			const Node& left = nodes[i + 1];
+			const Node& right = nodes[i + node.rightOffset];
+			node.bbox = left.bbox;
+			node.bbox.expandToInclude(right.bbox);
+			node.start = left.start;
+			node.numObjects = left.numObjects + right.numObjects;
+		}
+	}
+}
+
+template <class RandomAccessIterator>
+void BVH::refit(RandomAccessIterator first, const std::vector<size_t>& dirtyObjects) {
+	if (m_parents.empty())
+		buildRefitData();
+
+	// stamps tells which nodes are already collected, so we don't have to clear them
+	if (++m_refitStamp == 0) {
+		std::fill(m_refitStamps.begin(), m_refitStamps.end(), 0);
+		m_refitStamp = 1;
+	}
+
+	// collect dirty leafs and all their ancestors, object with references is in leaf of each of them
+	m_refitNodes.clear();
+	for (size_t object : dirtyObjects) {
+		if (hasReferences()) {
+			if (object + 1 >= m_objectSlotsStart.size())
+				continue;
+			for (size_t k = m_objectSlotsStart[object]; k < m_objectSlotsStart[object + 1]; ++k)
+				collectRefitPath(m_objectLeafs[m_objectSlots[k]]);
+		} else {
+			collectRefitPath(m_objectLeafs[object]);
+		}
+	}
+
+	// children are stored after their parents so process nodes from highest index
+	std::sort(m_refitNodes.begin(), m_refitNodes.end(), std::greater<size_t>());
+	for (size_t i : m_refitNodes)
+		refitNode(first, i);
+	m_unrotatedVisits = 0;
+}
+
+template <class RandomAccessIterator>
+void BVH::refit(RandomAccessIterator first) {
+	for (size_t i = numNodes(); i-- > 0; )
+		refitNode(first, i);
+	m_unrotatedVisits = 0;
+}
+
+template <class RandomAccessIterator>
+void BVH::refitNode(RandomAccessIterator first, size_t index) {
+	BoundingBox bbox;
+	if (isLeaf(index)) {
+		size_t start = firstObject(index);
+		size_t end = start + numObjects(index);
+		bbox = first[objectIndex(start)]->boundingBox();
+		for (size_t j = start + 1; j < end; ++j)
+			bbox.expandToInclude(first[objectIndex(j)]->boundingBox());
+	} else {
+		bbox = boundingBox(index + 1);
+		bbox.expandToInclude(boundingBox(rightChild(index)));
+	}
+	setBoundingBox(index, bbox);
+}
+
+template <class RandomAccessIterator>
+size_t BVH::optimize(RandomAccessIterator first, double timeBudget, std::vector<size_t>* rotatedNodes) {
+	typedef std::chrono::high_resolution_clock Clock;
+	auto deadline = Clock::now() + std::chrono::microseconds(static_cast<int64_t>(timeBudget * 1000.0));
+
+	if (!canOptimize())
+		return 0;
+
+	if (m_parents.empty())
+		buildRefitData();
+
+	size_t numRotations = 0;
+	for (size_t visited = 0; visited < m_nodes.size() && Clock::now() < deadline; ++visited) {
+		// walk nodes from the last one, so children are optimized before their parents
+		if (m_optimizeCursor == 0)
+			m_optimizeCursor = m_nodes.size();
+		size_t index = --m_optimizeCursor;
+
+		const Node& node = m_nodes[index];
+		if (node.rightOffset == 0) {
+			m_unrotatedVisits++;
+			continue;
+		}
+
+		size_t left = index + 1;
+		size_t right = index + node.rightOffset;
+		const Node& l = m_nodes[left];
+		const Node& r = m_nodes[right];
+
+		// only area of the child which gets new children changes
+		float bestDelta = 0.0f;
+		int bestRotation = -1;
+		if (r.rightOffset != 0) {
+			const BoundingBox& rl = m_nodes[right + 1].bbox;
+			const BoundingBox& rr = m_nodes[right + r.rightOffset].bbox;
+			float area = r.bbox.surfaceArea();
+
+			// swap left with right-left
+			BoundingBox bb = l.bbox;
+			bb.expandToInclude(rr);
+			if (bb.surfaceArea() - area < bestDelta) {
+				bestDelta = bb.surfaceArea() - area;
+				bestRotation = 0;
+			}
+
+			// swap left with right-right
+			bb = l.bbox;
+			bb.expandToInclude(rl);
+			if (bb.surfaceArea() - area < bestDelta) {
+				bestDelta = bb.surfaceArea() - area;
+				bestRotation = 1;
+			}
+		}
+		if (l.rightOffset != 0) {
+			const BoundingBox& ll = m_nodes[left + 1].bbox;
+			const BoundingBox& lr = m_nodes[left + l.rightOffset].bbox;
+			float area = l.bbox.surfaceArea();
+
+			// swap right with left-left
+			BoundingBox bb = r.bbox;
+			bb.expandToInclude(lr);
+			if (bb.surfaceArea() - area < bestDelta) {
+				bestDelta = bb.surfaceArea() - area;
+				bestRotation = 2;
+			}
+
+			// swap right with left-right
+			bb = r.bbox;
+			bb.expandToInclude(ll);
+			if (bb.surfaceArea() - area < bestDelta) {
+				bestDelta = bb.surfaceArea() - area;
+				bestRotation = 3;
+			}
+		}
+
+		// ignore tiny improvements caused by float imprecision
+		if (bestRotation == -1 || bestDelta > -ROTATION_EPSILON * node.bbox.surfaceArea()) {
+			m_unrotatedVisits++;
+			continue;
+		}
+
+		size_t rl = right + 1, rr = right + r.rightOffset;
+		size_t ll = left + 1, lr = left + l.rightOffset;
+		switch (bestRotation) {
+		case 0:
+			rotateSubtrees(first, index, rl, left, rr, false);
+			break;
+		case 1:
+			rotateSubtrees(first, index, rr, rl, left, false);
+			break;
+		case 2:
+			rotateSubtrees(first, index, right, lr, ll, true);
+			break;
+		case 3:
+			rotateSubtrees(first, index, ll, right, lr, true);
+			break;
+		}
+		m_unrotatedVisits = 0;
+		if (rotatedNodes)
+			rotatedNodes->push_back(index);
+		numRotations++;
+	}
+
+	return numRotations;
+}
+
+template <class RandomAccessIterator>
+void BVH::rotateSubtrees(RandomAccessIterator first, size_t index, size_t a, size_t b, size_t c, bool groupFirst) {
+	typedef typename std::iterator_traits<RandomAccessIterator>::value_type ValueType;
+
+	Node root = m_nodes[index];
+	Node na = m_nodes[a], nb = m_nodes[b], nc = m_nodes[c];
+	size_t sizeA = subtreeSize(a), sizeB = subtreeSize(b), sizeC = subtreeSize(c);
+
+	// objects of subtrees will be stored in order a, b, c
+	std::vector<ValueType> objects;
+	objects.reserve(root.numObjects);
+	for (const Node* n : { &na, &nb, &nc }) {
+		for (size_t i = n->start; i < n->start + n->numObjects; ++i)
+			objects.push_back(std::move(first[i]));
+	}
+	std::move(objects.begin(), objects.end(), first + root.start);
+
+	// copy subtrees to scratch in new order with moved object ranges
+	m_rotatedNodes.clear();
+	copySubtree(a, sizeA, root.start);
+	copySubtree(b, sizeB, root.start + na.numObjects);
+	copySubtree(c, sizeC, root.start + na.numObjects + nb.numObjects);
+
+	// new interior node joining two of the subtrees
+	Node inner;
+	size_t innerIndex;
+	if (groupFirst) {
+		Node n = { root.start, na.numObjects + nb.numObjects, 1 + sizeA, na.bbox };
+		inner = n;
+		inner.bbox.expandToInclude(nb.bbox);
+		innerIndex = index + 1;
+		root.rightOffset = 2 + sizeA + sizeB;
+	} else {
+		Node n = { root.start + na.numObjects, nb.numObjects + nc.numObjects, 1 + sizeB, nb.bbox };
+		inner = n;
+		inner.bbox.expandToInclude(nc.bbox);
+		innerIndex = index + 1 + sizeA;
+		root.rightOffset = 1 + sizeA;
+	}
+
+	// write subtrees back, inner node is placed before first of its children
+	size_t pos = index;
+	m_nodes[pos++] = root;
+	auto src = m_rotatedNodes.begin();
+	for (size_t size : { sizeA, sizeB, sizeC }) {
+		if (pos == innerIndex)
+			m_nodes[pos++] = inner;
+		std::copy(src, src + size, m_nodes.begin() + pos);
+		src += size;
+		pos += size;
+	}
+
+	// update parents and leafs of objects in rotated subtree
+	for (size_t i = index; i < pos; ++i) {
+		const Node& node = m_nodes[i];
+		if (node.rightOffset == 0) {
+			for (size_t j = node.start; j < node.start + node.numObjects; ++j)
+				m_objectLeafs[j] = i;
+		} else {
+			m_parents[i + 1] = i;
+			m_parents[i + node.rightOffset] = i;
+		}
+	}
+}
+
+template <class Primitives>
+size_t BVH::splitNode(Primitives& primitives, size_t* indices, size_t start, size_t end, 
+		const BuildParams& params, std::vector<SAHBin>& bins, BoundingBox& bbox) {
+	size_t numObjects = end - start;
+
+	// calculate bounding box for this node
+	BoundingBox bb(primitives.boundingBox(start));
+	BoundingBox bc(primitives.centroid(start));
+	for (size_t i = start + 1; i < end; ++i) {
+		bb.expandToInclude(primitives.boundingBox(i));
+		bc.expandToInclude(primitives.centroid(i));
+	}
+	bbox = bb;
+
+	size_t mid = start;
+	if (params.method == SplitMethod::BinnedSAH) {
+		if (numObjects > 1)
+			mid = partitionBinnedSAH(primitives, indices, start, end, bb, bc, params, bins);
+	} else if (numObjects > params.leafSize) {
+		mid = partitionMiddle(primitives, indices, start, end, bc);
+	}
+	return mid;
+}
+
+template <class Primitives>
+size_t BVH::partitionMiddle(Primitives& primitives, size_t* indices, size_t start, size_t end, 
+		const BoundingBox& centroidBox) {
+	// get longest dimension, which we will split
+	auto dim = centroidBox.maxDimension();
+
+	// split in center of longest axis
+	float splitCoord = 0.5f * (centroidBox.min()[dim] + centroidBox.max()[dim]);
+
+	// Partition the list of objects on this split
+	size_t mid = start;
+	for (size_t i = start; i < end; ++i) {
+		if (primitives.centroid(i)[dim] < splitCoord) {
+			primitives.swap(i, mid);
+			std::swap(indices[i], indices[mid]);
+			++mid;
+		}
+	}
+
+	// if we get bad split just choose center
+	if (mid == start || mid == end)
+		mid = start + (end - start) / 2;
+
+	return mid;
+}
+
+template <class Primitives>
+size_t BVH::partitionBinnedSAH(Primitives& primitives, size_t* indices, size_t start, size_t end, 
+		const BoundingBox& bbox, const BoundingBox& centroidBox, const BuildParams& params, std::vector<SAHBin>& bins) {
+	// Wald: On fast Construction of SAH-based Bounding Volume Hierarchies
+	size_t numObjects = end - start;
+	size_t numBins = params.numBins;
+
+	// first half of bins vector are bins themselves, second half holds
+	// prefix bounding boxes and counts accumulated from the right side
+	SAHBin* right = &bins[numBins];
+
+	int bestDim = -1;
+	size_t bestBin = 0;
+	float bestCost = std::numeric_limits<float>::max();
+
+	for (int dim = 0; dim < 3; ++dim) {
+		float cmin = centroidBox.min()[dim];
+		float binScale = binningScale(cmin, centroidBox.max()[dim], numBins);
+		// all centroids lies in one plane, cannot split this axis
+		if (binScale == 0.0f)
+			continue;
+
+		for (size_t b = 0; b < numBins; ++b)
+			bins[b].count = 0;
+
+		// put objects to bins
 		for (size_t i = start; i < end; ++i) {
-			if (first[i]->centroid()[dim] < splitCoord) {
-				std::swap(first[i], first[mid]);
-				++mid;
+			size_t b = binIndex(primitives.centroid(i)[dim] - cmin, binScale, numBins);
+			if (bins[b].count++ == 0)
+				bins[b].bbox = primitives.boundingBox(i);
+			else
+				bins[b].bbox.expandToInclude(primitives.boundingBox(i));
+		}
+
+		// sweep from right and accumulate
+		right[numBins - 1] = bins[numBins - 1];
+		for (size_t b = numBins - 1; b > 0; --b) {
+			right[b - 1] = right[b];
+			if (bins[b - 1].count != 0) {
+				if (right[b - 1].count == 0)
+					right[b - 1].bbox = bins[b - 1].bbox;
+				else
+					right[b - 1].bbox.expandToInclude(bins[b - 1].bbox);
+				right[b - 1].count += bins[b - 1].count;
 			}
 		}
 
-		// if we get bad split just choose center
-		if (mid == start || mid == end)
-			mid = start + (end - start) / 2;
+		// sweep from left and evaluate split after each bin
+		SAHBin left = bins[0];
+		for (size_t b = 1; b < numBins; ++b) {
+			if (left.count != 0 && right[b].count != 0) {
+				float cost = left.bbox.surfaceArea() * left.count + right[b].bbox.surfaceArea() * right[b].count;
+				if (cost < bestCost) {
+					bestCost = cost;
+					bestDim = dim;
+					bestBin = b;
+				}
+			}
 
-		// push left child
-		BuildEntry left = { nodes.size() - 1, mid, end };
-		stack.push_back(left);
+			if (bins[b].count != 0) {
+				if (left.count == 0)
+					left.bbox = bins[b].bbox;
+				else
+					left.bbox.expandToInclude(bins[b].bbox);
+				left.count += bins[b].count;
+			}
+		}
+	}
 
-		// push right child
-		BuildEntry right = { nodes.size() - 1, start, mid };
-		stack.push_back(right);
+	// all centroids are the same, split in the middle
+	if (bestDim == -1) {
+		if (numObjects <= params.leafSize)
+			return start;
+		return start + numObjects / 2;
 	}
 
-	BVH* result = new BVH;
-	result->m_leafSize = leafSize;
-	result->m_nodes = std::move(nodes);
-	result->m_numLeafs = numLeafs;
-	return result;
+	float area = bbox.surfaceArea();
+	float splitCost = params.traversalCost;
+	if (area > 0.0f)
+		splitCost += params.intersectionCost * bestCost / area;
+	else
+		splitCost += params.intersectionCost * numObjects;
+	float leafCost = params.intersectionCost * numObjects;
+
+	// make leaf when it is cheaper than split
+	if (numObjects <= params.leafSize && leafCost <= splitCost)
+		return start;
+
+	// Partition the list of objects on selected bin boundary
+	float cmin = centroidBox.min()[bestDim];
+	float binScale = binningScale(cmin, centroidBox.max()[bestDim], numBins);
+	size_t mid = start;
+	for (size_t i = start; i < end; ++i) {
+		size_t b = binIndex(primitives.centroid(i)[bestDim] - cmin, binScale, numBins);
+		if (b < bestBin) {
+			primitives.swap(i, mid);
+			std::swap(indices[i], indices[mid]);
+			++mid;
+		}
+	}
+
+	return mid;
+}
+
+/// Writes statistics in single line
+std::ostream& operator<<(std::ostream& out, const BVH::Statistics& stats);
+
+template <class AcceptFunc, class LeafFunc>
+void BVH::traverseFrom(size_t index, AcceptFunc& accept, LeafFunc& visitLeaf) const {
+	size_t stack[TRAVERSAL_STACK_SIZE];
+	size_t stackSize = 0;
+
+	for (;;) {
+		if (accept(index)) {
+			if (isLeaf(index)) {
+				visitLeaf(index);
+			} else {
+				size_t right = rightChild(index);
+				if (stackSize < TRAVERSAL_STACK_SIZE) {
+					stack[stackSize++] = right;
+				} else {
+					// stack is full, left subtree gets fresh stack in recursive call
+					traverseFrom(index + 1, accept, visitLeaf);
+					index = right;
+					continue;
+				}
+				index = index + 1;
+				continue;
+			}
+		}
+
+		if (stackSize == 0)
+			break;
+		index = stack[--stackSize];
+	}
 }
 
 #endif // BVH_H
\ No newline at end of file
@@ -7,8 +7,11 @@
 
 #include "BaseSceneObject.h"
 
+#include <stdexcept>
+
 BaseSceneObject::BaseSceneObject(std::shared_ptr<Mesh> mesh, std::shared_ptr<IMaterial> material)
-	: m_mesh(std::move(mesh)), m_material(std::move(material)), m_buffer(nullptr), m_scene(nullptr) { }
+	: m_mesh(std::move(mesh)), m_material(std::move(material)), m_buffer(nullptr), m_scene(nullptr), m_sceneIndex(0),
+	m_dynamicProxy(DynamicBVH::NULL_NODE), m_tile(Scene::NO_TILE), m_instanceIndex(NO_INSTANCE) { }
 
 void BaseSceneObject::setModelMatrix(const glm::mat4& m) {
 	BufferData data = { m,  glm::transpose(glm::inverse(m)) };
@@ -18,6 +21,12 @@ void BaseSceneObject::setModelMatrix(const glm::mat4& m) {
 	} else {
 		m_memoryData = data;
 	}
+
+	modelMatrixChanged();
+
+	// let scene know that it has to update BVH
+	if (m_scene)
+		m_scene->objectMoved(this);
 }
 
 void BaseSceneObject::addedToScene(Scene* scene) {
@@ -30,11 +39,15 @@ void BaseSceneObject::sceneRendererChanged() {
 }
 
 void BaseSceneObject::removedFromScene() {
+	// buffer holds current transform, keep it for the case object is added again
+	m_memoryData = m_buffer->data();
 	m_buffer = nullptr;
 	m_scene = nullptr;
 }
 
 void BaseSceneObject::createUniformBuffer(gl::Renderer* renderer) {
+	if (m_buffer)
+		m_memoryData = m_buffer->data();
 	m_buffer = renderer->createUniformBuffer<BufferData>(m_memoryData);
 }
 
@@ -42,6 +55,14 @@ void BaseSceneObject::setMesh(std::shared_ptr<Mesh> mesh) {
 	m_mesh = std::move(mesh);
 }
 
+void BaseSceneObject::setLods(std::vector<Lod> lods) {
+	for (size_t i = 1; i < lods.size(); ++i) {
+		if (lods[i].screenSize >= lods[i - 1].screenSize)
+			throw std::runtime_error("BaseSceneObject::setLods levels have to have decreasing screen sizes");
+	}
+	m_lods = std::move(lods);
+}
+
 void BaseSceneObject::setMaterial(std::shared_ptr<IMaterial> material) {
 	m_material = std::move(material);
 }
@@ -30,11 +30,46 @@ public:
 	}
 	void setMesh(std::shared_ptr<Mesh> mesh);
 
+	/// Coarser level of detail drawn instead of mesh when object is small on screen
+	struct Lod
+	{
+		std::shared_ptr<Mesh> mesh;
+		/// level is used when object covers less than this fraction of viewport height
+		float screenSize;
+	};
+
+	/**
+	 * Sets levels of detail sorted from finest one with decreasing screen sizes.
+	 * Renderer reads them on registration so they have to be set before object is added to scene.
+	 */
+	void setLods(std::vector<Lod> lods);
+
+	const std::vector<Lod>& lods() const {
+		return m_lods;
+	}
+
+	virtual size_t numLods() const {
+		return m_lods.size();
+	}
+
+	virtual Mesh* lodMesh(size_t level) {
+		return m_lods[level - 1].mesh.get();
+	}
+
+	virtual float lodScreenSize(size_t level) const {
+		return m_lods[level - 1].screenSize;
+	}
+
 	virtual IMaterial* material() {
 		return m_material.get();
 	}
 	void setMaterial(std::shared_ptr<IMaterial> material);
 
+	/// Gets owning pointer to material so it can be shared with other objects
+	const std::shared_ptr<IMaterial>& sharedMaterial() const {
+		return m_material;
+	}
+
 	const glm::mat4& modelMatrix() const {
 		if (m_buffer)
 			return m_buffer->data().model;
@@ -47,12 +82,26 @@ public:
 		return m_buffer->internalBuffer();
 	}
 
+	/// Instance index of object which is not in two level BVH of scene
+	static const size_t NO_INSTANCE = static_cast<size_t>(-1);
+
+	/// Identifies type of object in saved scenes, it is passed to object factory when scene is loaded
+	virtual uint32_t typeId() const {
+		return 0;
+	}
+
 	void addedToScene(Scene* scene);
 	void sceneRendererChanged();
 	void removedFromScene();
+protected:
+	/// Called after model matrix changes, derived classes should update their bounding box here
+	virtual void modelMatrixChanged() { }
 private:
+	friend class Scene;
+
 	void createUniformBuffer(gl::Renderer* renderer);
 	std::shared_ptr<Mesh> m_mesh;
+	std::vector<Lod> m_lods;
 	std::shared_ptr<IMaterial> m_material;
 
 	struct BufferData
@@ -64,6 +113,14 @@ private:
 	std::unique_ptr<UniformBuffer<BufferData>> m_buffer;
 	BufferData m_memoryData;
 	Scene* m_scene;
+	/// index of object in scene object list, slot of dynamic object
+	size_t m_sceneIndex;
+	/// proxy of object added to scene at runtime, DynamicBVH::NULL_NODE for static object
+	uint32_t m_dynamicProxy;
+	/// streamed tile which object belongs to, Scene::NO_TILE for other objects
+	size_t m_tile;
+	/// index of mesh instance in two level BVH of scene
+	size_t m_instanceIndex;
 };
 
 #endif // !BASE_SCENE_OBJECT_H
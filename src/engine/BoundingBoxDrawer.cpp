@@ -64,8 +64,20 @@ void BoundingBoxDrawer::drawLinedSingle(const BoundingBox& bbox) {
 }
 
 void BoundingBoxDrawer::drawSingle(const BoundingBox& bbox) {
-	// TODO: optimize!!!!
+	beginBoxes();
+	drawBox(bbox);
+}
+
+void BoundingBoxDrawer::beginBoxes() {
+	if (m_state->shader != m_shader.get()) {
+		m_shader->use();
+		m_state->shader = m_shader.get();
+	}
 
+	m_vao.bind();
+}
+
+void BoundingBoxDrawer::drawBox(const BoundingBox& bbox) {
 	auto bmin = bbox.min();
 	auto bmax = bbox.max();
 
@@ -75,12 +87,6 @@ void BoundingBoxDrawer::drawSingle(const BoundingBox& bbox) {
 		bmin, glm::vec3(bmin.x, bmin.y, bmax.z), glm::vec3(bmax.x, bmin.y, bmax.z) 
 	};
 
-	if (m_state->shader != m_shader.get()) {
-		m_shader->use();
-		m_state->shader = m_shader.get();
-	}
-
-	m_vao.bind();
 	m_vbo.updateData(0, sizeof(vertices), vertices);
 	glDrawElements(GL_TRIANGLE_STRIP, BOX_INDICES, GL_UNSIGNED_SHORT, 0);
 }
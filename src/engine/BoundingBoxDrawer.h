@@ -23,6 +23,12 @@ public:
 
 	void drawSingle(const BoundingBox& bbox);
 
+	/// Binds shader and geometry of solid boxes, following drawBox calls do not change any state
+	void beginBoxes();
+
+	/// Draws solid box, beginBoxes has to be called before
+	void drawBox(const BoundingBox& bbox);
+
 	void drawLinedSingle(const BoundingBox& bbox);
 private:
 	std::shared_ptr<ShaderProgram> m_shader;
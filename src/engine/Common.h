@@ -10,6 +10,8 @@
 
 #include "Exception.h"
 
+#include <cstddef>
+
 class ShaderException : public Exception 
 {
 public:
@@ -57,5 +59,11 @@ struct VertexElement
 	size_t offset;
 };
 
+/// Size of single component of given type in bytes
+inline size_t vertexElementTypeSize(VertexElementType type) {
+	static const size_t typeSizes[] = { 1, 1, 2, 2, 4, 4, 4, 8 };
+	return typeSizes[static_cast<int>(type)];
+}
+
 
 #endif // !COMMON_H
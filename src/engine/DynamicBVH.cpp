@@ -0,0 +1,235 @@
+/**
+ * @file DynamicBVH.cpp
+ *
+ * @author Jan Duek <xdusek17@stud.fit.vutbr.cz>
+ * @date 2013
+ */
+
+#include "DynamicBVH.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <cassert>
+
+static BoundingBox combine(const BoundingBox& a, const BoundingBox& b) {
+	BoundingBox result = a;
+	result.expandToInclude(b);
+	return result;
+}
+
+static bool containsBox(const BoundingBox& outer, const BoundingBox& inner) {
+	return outer.contains(inner.min()) && outer.contains(inner.max());
+}
+
+DynamicBVH::DynamicBVH(float margin)
+	: m_root(NULL_NODE), m_freeList(NULL_NODE), m_numProxies(0), m_margin(margin) {
+}
+
+uint32_t DynamicBVH::insert(const BoundingBox& bbox, size_t userData) {
+	uint32_t leaf = allocateNode();
+	Node& node = m_nodes[leaf];
+	node.bbox = fatten(bbox);
+	node.userData = userData;
+	node.height = 0;
+
+	insertLeaf(leaf);
+	m_numProxies++;
+	return leaf;
+}
+
+void DynamicBVH::remove(uint32_t proxy) {
+	assert(proxy < m_nodes.size() && m_nodes[proxy].isLeaf() && m_nodes[proxy].height == 0);
+
+	removeLeaf(proxy);
+	freeNode(proxy);
+	m_numProxies--;
+}
+
+bool DynamicBVH::move(uint32_t proxy, const BoundingBox& bbox) {
+	assert(proxy < m_nodes.size() && m_nodes[proxy].isLeaf() && m_nodes[proxy].height == 0);
+
+	if (containsBox(m_nodes[proxy].bbox, bbox))
+		return false;
+
+	removeLeaf(proxy);
+	m_nodes[proxy].bbox = fatten(bbox);
+	insertLeaf(proxy);
+	return true;
+}
+
+void DynamicBVH::clear() {
+	m_nodes.clear();
+	m_root = NULL_NODE;
+	m_freeList = NULL_NODE;
+	m_numProxies = 0;
+}
+
+uint32_t DynamicBVH::allocateNode() {
+	uint32_t index;
+	if (m_freeList != NULL_NODE) {
+		index = m_freeList;
+		m_freeList = m_nodes[index].parent;
+	} else {
+		if (m_nodes.size() >= NULL_NODE)
+			throw std::runtime_error("DynamicBVH::allocateNode too many nodes");
+		index = static_cast<uint32_t>(m_nodes.size());
+		m_nodes.push_back(Node());
+	}
+
+	Node& node = m_nodes[index];
+	node.parent = NULL_NODE;
+	node.child[0] = node.child[1] = NULL_NODE;
+	node.height = 0;
+	node.userData = 0;
+	return index;
+}
+
+void DynamicBVH::freeNode(uint32_t node) {
+	m_nodes[node].parent = m_freeList;
+	m_nodes[node].height = -1;
+	m_freeList = node;
+}
+
+void DynamicBVH::insertLeaf(uint32_t leaf) {
+	if (m_root == NULL_NODE) {
+		m_root = leaf;
+		m_nodes[leaf].parent = NULL_NODE;
+		return;
+	}
+
+	// descend to sibling while creating new parent there costs less than going deeper
+	BoundingBox leafBox = m_nodes[leaf].bbox;
+	uint32_t index = m_root;
+	while (!m_nodes[index].isLeaf()) {
+		const Node& node = m_nodes[index];
+		float area = node.bbox.surfaceArea();
+		float combinedArea = combine(node.bbox, leafBox).surfaceArea();
+
+		// cost of new parent of this node and leaf
+		float cost = 2.0f * combinedArea;
+		// cost pushed down to children by enlarging this node
+		float inheritanceCost = 2.0f * (combinedArea - area);
+
+		float childCost[2];
+		for (int i = 0; i < 2; ++i) {
+			const Node& child = m_nodes[node.child[i]];
+			float enlarged = combine(child.bbox, leafBox).surfaceArea();
+			if (child.isLeaf())
+				childCost[i] = enlarged + inheritanceCost;
+			else
+				childCost[i] = enlarged - child.bbox.surfaceArea() + inheritanceCost;
+		}
+
+		if (cost < childCost[0] && cost < childCost[1])
+			break;
+
+		index = childCost[0] < childCost[1] ? node.child[0] : node.child[1];
+	}
+
+	uint32_t sibling = index;
+	uint32_t oldParent = m_nodes[sibling].parent;
+	uint32_t newParent = allocateNode();
+	Node& parent = m_nodes[newParent];
+	parent.parent = oldParent;
+	parent.bbox = combine(leafBox, m_nodes[sibling].bbox);
+	parent.height = m_nodes[sibling].height + 1;
+	parent.child[0] = sibling;
+	parent.child[1] = leaf;
+	m_nodes[sibling].parent = newParent;
+	m_nodes[leaf].parent = newParent;
+
+	if (oldParent != NULL_NODE) {
+		Node& grandParent = m_nodes[oldParent];
+		grandParent.child[grandParent.child[0] == sibling ? 0 : 1] = newParent;
+	} else {
+		m_root = newParent;
+	}
+
+	refitAncestors(m_nodes[leaf].parent);
+}
+
+void DynamicBVH::removeLeaf(uint32_t leaf) {
+	if (leaf == m_root) {
+		m_root = NULL_NODE;
+		return;
+	}
+
+	uint32_t parent = m_nodes[leaf].parent;
+	uint32_t grandParent = m_nodes[parent].parent;
+	uint32_t sibling = m_nodes[parent].child[m_nodes[parent].child[0] == leaf ? 1 : 0];
+
+	// sibling takes place of parent
+	m_nodes[sibling].parent = grandParent;
+	freeNode(parent);
+	if (grandParent != NULL_NODE) {
+		Node& node = m_nodes[grandParent];
+		node.child[node.child[0] == parent ? 0 : 1] = sibling;
+		refitAncestors(grandParent);
+	} else {
+		m_root = sibling;
+	}
+}
+
+void DynamicBVH::refitAncestors(uint32_t index) {
+	while (index != NULL_NODE) {
+		index = balance(index);
+
+		Node& node = m_nodes[index];
+		const Node& left = m_nodes[node.child[0]];
+		const Node& right = m_nodes[node.child[1]];
+		node.height = 1 + std::max(left.height, right.height);
+		node.bbox = combine(left.bbox, right.bbox);
+
+		index = node.parent;
+	}
+}
+
+uint32_t DynamicBVH::balance(uint32_t iA) {
+	Node& a = m_nodes[iA];
+	if (a.isLeaf() || a.height < 2)
+		return iA;
+
+	// child which is higher by more than one is rotated up, A takes one of its children
+	int32_t diff = m_nodes[a.child[1]].height - m_nodes[a.child[0]].height;
+	if (diff >= -1 && diff <= 1)
+		return iA;
+
+	int up = diff > 1 ? 1 : 0;
+	uint32_t iUp = a.child[up];
+	uint32_t iStay = a.child[1 - up];
+	Node& upNode = m_nodes[iUp];
+	uint32_t iF = upNode.child[0];
+	uint32_t iG = upNode.child[1];
+
+	// A becomes child of rotated node
+	upNode.child[0] = iA;
+	upNode.parent = a.parent;
+	a.parent = iUp;
+
+	if (upNode.parent != NULL_NODE) {
+		Node& parent = m_nodes[upNode.parent];
+		parent.child[parent.child[0] == iA ? 0 : 1] = iUp;
+	} else {
+		m_root = iUp;
+	}
+
+	// higher grandchild stays with rotated node, lower one moves under A
+	uint32_t iKeep = iF, iMove = iG;
+	if (m_nodes[iG].height > m_nodes[iF].height)
+		std::swap(iKeep, iMove);
+
+	upNode.child[1] = iKeep;
+	a.child[up] = iMove;
+	m_nodes[iMove].parent = iA;
+
+	a.bbox = combine(m_nodes[iStay].bbox, m_nodes[iMove].bbox);
+	a.height = 1 + std::max(m_nodes[iStay].height, m_nodes[iMove].height);
+	upNode.bbox = combine(a.bbox, m_nodes[iKeep].bbox);
+	upNode.height = 1 + std::max(a.height, m_nodes[iKeep].height);
+	return iUp;
+}
+
+BoundingBox DynamicBVH::fatten(const BoundingBox& bbox) const {
+	glm::vec3 d = (bbox.max() - bbox.min()) * m_margin;
+	return BoundingBox(bbox.min() - d, bbox.max() + d);
+}
@@ -0,0 +1,174 @@
+/**
+ * @file DynamicBVH.h
+ *
+ * @author Jan Duek <xdusek17@stud.fit.vutbr.cz>
+ * @date 2013
+ */
+
+#ifndef DYNAMIC_BVH_H
+#define DYNAMIC_BVH_H
+
+#include "BoundingBox.h"
+#include "Frustum.h"
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * BVH supporting insertion and removal of single objects. Leafs hold one
+ * object each and their boxes are enlarged by margin (fat boxes), so moving
+ * object restructures tree only when it leaves its fat box. Objects are inserted
+ * next to sibling giving lowest surface area growth and tree is kept balanced
+ * by rotations like AVL tree.
+ */
+class DynamicBVH
+{
+public:
+	/// Invalid node or proxy index
+	static const uint32_t NULL_NODE = 0xFFFFFFFF;
+
+	/// @param margin fraction of object extent added to each side of its leaf box
+	explicit DynamicBVH(float margin = 0.1f);
+
+	/**
+	 * Inserts object into tree.
+	 * @param userData value returned to visitors for this object
+	 * @return proxy identifying object in tree
+	 */
+	uint32_t insert(const BoundingBox& bbox, size_t userData);
+
+	/// Removes object, its proxy can be reused by following insertions
+	void remove(uint32_t proxy);
+
+	/**
+	 * Updates bounds of object.
+	 * @return true when object left its fat box and was reinserted
+	 */
+	bool move(uint32_t proxy, const BoundingBox& bbox);
+
+	/// Removes all objects
+	void clear();
+
+	size_t userData(uint32_t proxy) const {
+		return m_nodes[proxy].userData;
+	}
+
+	/// Gets enlarged box of object stored in its leaf
+	const BoundingBox& fatBoundingBox(uint32_t proxy) const {
+		return m_nodes[proxy].bbox;
+	}
+
+	size_t numProxies() const {
+		return m_numProxies;
+	}
+
+	bool empty() const {
+		return m_root == NULL_NODE;
+	}
+
+	/// Gets length of longest path from root to leaf
+	int height() const {
+		return m_root != NULL_NODE ? m_nodes[m_root].height : 0;
+	}
+
+	size_t memorySize() const {
+		return m_nodes.capacity() * sizeof(Node);
+	}
+
+	/**
+	 * Finds objects whose fat boxes intersect frustum.
+	 * @param visitor functor called as visitor(userData) for each visible object
+	 */
+	template <class Visitor>
+	void cullFrustum(const Frustum& frustum, Visitor visitor) const;
+
+	/// Calls visitor(userData) for each object
+	template <class Visitor>
+	void forEach(Visitor visitor) const;
+private:
+	struct Node
+	{
+		BoundingBox bbox;
+		/// parent node, next free node when node is in free list
+		uint32_t parent;
+		uint32_t child[2];
+		/// leaf has height 0, free node -1
+		int32_t height;
+		size_t userData;
+
+		bool isLeaf() const {
+			return child[0] == NULL_NODE;
+		}
+	};
+
+	struct StackEntry
+	{
+		uint32_t node;
+		/// node is whole inside frustum so its children does not have to be tested
+		bool inside;
+	};
+
+	uint32_t allocateNode();
+	void freeNode(uint32_t node);
+
+	void insertLeaf(uint32_t leaf);
+	void removeLeaf(uint32_t leaf);
+	/// Recomputes heights and boxes from node to root, rotating unbalanced nodes
+	void refitAncestors(uint32_t node);
+	/// Rotates node when its children heights differ by more than one, returns node which took its place
+	uint32_t balance(uint32_t node);
+
+	BoundingBox fatten(const BoundingBox& bbox) const;
+
+	std::vector<Node> m_nodes;
+	uint32_t m_root;
+	uint32_t m_freeList;
+	size_t m_numProxies;
+	float m_margin;
+	/// traversal stack, kept so culling does not allocate every frame
+	mutable std::vector<StackEntry> m_stack;
+};
+
+template <class Visitor>
+void DynamicBVH::cullFrustum(const Frustum& frustum, Visitor visitor) const {
+	if (m_root == NULL_NODE)
+		return;
+
+	StackEntry root = { m_root, false };
+	m_stack.clear();
+	m_stack.push_back(root);
+
+	while (!m_stack.empty()) {
+		StackEntry entry = m_stack.back();
+		m_stack.pop_back();
+		const Node& node = m_nodes[entry.node];
+
+		bool inside = entry.inside;
+		if (!inside) {
+			Frustum::Intersection result = frustum.boundingBoxIntersetion(node.bbox);
+			if (result == Frustum::Intersection::None)
+				continue;
+			inside = result == Frustum::Intersection::Inside;
+		}
+
+		if (node.isLeaf()) {
+			visitor(node.userData);
+		} else {
+			StackEntry right = { node.child[1], inside };
+			StackEntry left = { node.child[0], inside };
+			m_stack.push_back(right);
+			m_stack.push_back(left);
+		}
+	}
+}
+
+template <class Visitor>
+void DynamicBVH::forEach(Visitor visitor) const {
+	for (const auto& node : m_nodes) {
+		if (node.height == 0)
+			visitor(node.userData);
+	}
+}
+
+#endif // !DYNAMIC_BVH_H
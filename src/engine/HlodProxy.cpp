@@ -0,0 +1,107 @@
+/**
+ * @file HlodProxy.cpp
+ *
+ * @author Jan Duek <xdusek17@stud.fit.vutbr.cz>
+ * @date 2013
+ */
+
+#include "HlodProxy.h"
+
+#include <glm/gtc/swizzle.hpp>
+
+#include <algorithm>
+
+namespace {
+
+struct ProxyVertex
+{
+	glm::vec3 position;
+	glm::vec3 normal;
+};
+
+/// Appends mesh transformed to world space, returns false when mesh cannot be merged
+bool appendMesh(const Mesh& mesh, const glm::mat4& model, std::vector<ProxyVertex>& vertices, 
+		std::vector<uint32_t>& indices) {
+	if (!mesh.isValid() || !mesh.hasNormals())
+		return false;
+	if (mesh.primitiveType() != PrimitiveType::TriangleList && mesh.primitiveType() != PrimitiveType::TriangleStrip)
+		return false;
+
+	const VertexElement& position = mesh.vertexLayout()[0];
+	if (position.type != VertexElementType::Float || position.numComponents < 3)
+		return false;
+
+	std::vector<glm::vec3> positions = mesh.positions();
+	std::vector<glm::vec3> normals = mesh.normals();
+	glm::mat4 normalMatrix = glm::transpose(glm::inverse(model));
+
+	size_t base = vertices.size();
+	for (size_t i = 0; i < positions.size(); ++i) {
+		ProxyVertex v;
+		v.position = glm::swizzle<glm::X, glm::Y, glm::Z>(model * glm::vec4(positions[i], 1.0f));
+		v.normal = glm::normalize(glm::swizzle<glm::X, glm::Y, glm::Z>(normalMatrix * glm::vec4(normals[i], 0.0f)));
+		vertices.push_back(v);
+	}
+
+	size_t count = mesh.isIndexed() ? mesh.indices().size() : positions.size();
+	auto vertexAt = [&] (size_t i) -> size_t {
+		return mesh.isIndexed() ? mesh.indices()[i] : i;
+	};
+
+	// strips are converted to lists, every odd triangle of strip has reversed order
+	bool strip = mesh.primitiveType() == PrimitiveType::TriangleStrip;
+	size_t numTriangles = strip ? (count >= 3 ? count - 2 : 0) : count / 3;
+	for (size_t t = 0; t < numTriangles; ++t) {
+		size_t first = strip ? t : t * 3;
+		size_t triangle[3] = { vertexAt(first), vertexAt(first + 1), vertexAt(first + 2) };
+		if (strip && (t & 1))
+			std::swap(triangle[1], triangle[2]);
+
+		for (size_t vertex : triangle) {
+			if (vertex >= positions.size())
+				return false;
+			indices.push_back(static_cast<uint32_t>(base + vertex));
+		}
+	}
+	return true;
+}
+
+}
+
+HlodProxy::HlodProxy(std::shared_ptr<Mesh> mesh, std::shared_ptr<IMaterial> material, const BoundingBox& bbox)
+	: BaseSceneObject(std::move(mesh), std::move(material)), m_bbox(bbox) {
+	setModelMatrix(glm::mat4(1.0f));
+}
+
+std::shared_ptr<HlodProxy> HlodProxy::create(const std::vector<BaseSceneObject*>& objects, const BoundingBox& bbox) {
+	if (objects.empty())
+		return nullptr;
+
+	// proxy is drawn by single draw call so it can have only one material
+	std::shared_ptr<IMaterial> material = objects[0]->sharedMaterial();
+	std::vector<ProxyVertex> vertices;
+	std::vector<uint32_t> indices;
+	for (BaseSceneObject* object : objects) {
+		if (object->sharedMaterial() != material)
+			return nullptr;
+
+		// coarsest level is good enough because proxy is used only for distant subtrees
+		Mesh* mesh = object->numLods() > 0 ? object->lodMesh(object->numLods()) : object->mesh();
+		if (!mesh || !appendMesh(*mesh, object->modelMatrix(), vertices, indices))
+			return nullptr;
+	}
+
+	if (indices.empty())
+		return nullptr;
+
+	std::vector<char> data(reinterpret_cast<const char*>(vertices.data()), 
+		reinterpret_cast<const char*>(vertices.data() + vertices.size()));
+	std::vector<VertexElement> layout = {
+		VertexElement(3, VertexElementType::Float),
+		VertexElement(3, VertexElementType::Float)
+	};
+	auto mesh = std::shared_ptr<Mesh>(Mesh::create(std::move(data), vertices.size(), std::move(layout), 
+		std::move(indices), PrimitiveType::TriangleList));
+
+	return std::shared_ptr<HlodProxy>(new HlodProxy(std::move(mesh), std::move(material), bbox));
+}
@@ -0,0 +1,45 @@
+/**
+ * @file HlodProxy.h
+ *
+ * @author Jan Duek <xdusek17@stud.fit.vutbr.cz>
+ * @date 2013
+ */
+
+#ifndef HLOD_PROXY_H
+#define HLOD_PROXY_H
+
+#include "BaseSceneObject.h"
+
+#include <memory>
+#include <vector>
+
+/**
+ * Hierarchical level of detail. Single mesh merged from coarsest levels of detail
+ * of all objects of BVH subtree, it is drawn by one draw call instead of whole subtree
+ * when subtree is small on screen. Vertices are in world space so model matrix is identity.
+ */
+class HlodProxy : public BaseSceneObject
+{
+public:
+	/**
+	 * Merges objects to single proxy.
+	 * @param bbox bounding box of BVH subtree containing objects
+	 * @return null when objects do not share material or some of them has mesh
+	 *         which is not triangle list or strip with positions and normals
+	 */
+	static std::shared_ptr<HlodProxy> create(const std::vector<BaseSceneObject*>& objects, const BoundingBox& bbox);
+
+	virtual BoundingBox boundingBox() const {
+		return m_bbox;
+	}
+
+	virtual glm::vec3 centroid() const {
+		return m_bbox.center();
+	}
+private:
+	HlodProxy(std::shared_ptr<Mesh> mesh, std::shared_ptr<IMaterial> material, const BoundingBox& bbox);
+
+	BoundingBox m_bbox;
+};
+
+#endif // !HLOD_PROXY_H
@@ -33,6 +33,21 @@ public:
 	virtual IMaterial* material() = 0;
 
 	virtual gl::IndexedBuffer* uniformBuffer() = 0;
+
+	/// Gets number of coarser levels of detail which can replace mesh()
+	virtual size_t numLods() const {
+		return 0;
+	}
+
+	/// Gets mesh of coarser level of detail, levels are numbered from 1
+	virtual Mesh* lodMesh(size_t /*level*/) {
+		return nullptr;
+	}
+
+	/// Gets fraction of viewport height under which level of detail is used
+	virtual float lodScreenSize(size_t /*level*/) const {
+		return 0.0f;
+	}
 };
 
 #endif // INTERFACES_H
@@ -34,8 +34,3 @@ void Light::setSpecular(const glm::vec4& value) {
 	m_buffer->data().specular = value;
 	m_buffer->dataChanged();
 }
-
-void Light::setViewProjection(const glm::mat4& value) {
-	m_buffer->data().viewProjection = value;
-	m_buffer->dataChanged();
-}
@@ -31,16 +31,11 @@ public:
 		return m_buffer->data().specular;
 	}
 
-	const glm::mat4& viewProjection() const {
-		return m_buffer->data().viewProjection;
-	}
-
 	void flushChanges();
 	void setPosition(const glm::vec4& value);
 	void setAmbient(const glm::vec4& value);
 	void setDiffuse(const glm::vec4& value);
 	void setSpecular(const glm::vec4& value);
-	void setViewProjection(const glm::mat4& value);
 
 	gl::IndexedBuffer* uniformBuffer() {
 		return m_buffer->internalBuffer();
@@ -60,7 +55,6 @@ private:
 		glm::vec4 ambient;
 		glm::vec4 diffuse;
 		glm::vec4 specular;
-		glm::mat4 viewProjection;
 	};
 
 	std::unique_ptr<UniformBuffer<BufferData>> m_buffer;
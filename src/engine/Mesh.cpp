@@ -7,6 +7,9 @@
 
 #include "Mesh.h"
 
+#include <cstring>
+#include <stdexcept>
+
 void Mesh::loadVertices(std::vector<char> data, size_t count, std::vector<VertexElement> layout) {
 	m_vertexData = std::move(data);
 	m_vertexCount = count;
@@ -44,3 +47,44 @@ Mesh* Mesh::create(std::vector<char> vertexData, size_t vertexCount,
 	mesh->loadIndices(std::move(indices));
 	return mesh;
 }
+
+std::vector<glm::vec3> Mesh::positions() const {
+	if (m_vertexLayout.empty() || m_vertexLayout[0].type != VertexElementType::Float ||
+		m_vertexLayout[0].numComponents < 3)
+		throw std::runtime_error("Mesh::positions first vertex element is not float position");
+
+	return readVec3(0);
+}
+
+std::vector<glm::vec3> Mesh::normals() const {
+	if (!hasNormals())
+		throw std::runtime_error("Mesh::normals second vertex element is not float normal");
+
+	return readVec3(1);
+}
+
+std::vector<glm::vec3> Mesh::readVec3(size_t element) const {
+	// same rules as when vertices are uploaded, zero stride means interleaved layout
+	// and zero offset means element follows previous one
+	size_t offset = 0;
+	for (size_t i = 0; i <= element; ++i) {
+		if (i != 0 && m_vertexLayout[i].offset == 0)
+			offset += m_vertexLayout[i - 1].numComponents * vertexElementTypeSize(m_vertexLayout[i - 1].type);
+		else
+			offset = m_vertexLayout[i].offset;
+	}
+
+	size_t stride = m_vertexLayout[element].stride;
+	if (stride == 0) {
+		for (const auto& e : m_vertexLayout)
+			stride += e.numComponents * vertexElementTypeSize(e.type);
+	}
+
+	if (m_vertexCount > 0 && offset + (m_vertexCount - 1) * stride + 3 * sizeof(float) > m_vertexData.size())
+		throw std::runtime_error("Mesh::readVec3 vertex data are too short");
+
+	std::vector<glm::vec3> values(m_vertexCount);
+	for (size_t i = 0; i < m_vertexCount; ++i)
+		std::memcpy(&values[i], &m_vertexData[offset + i * stride], 3 * sizeof(float));
+	return values;
+}
@@ -12,6 +12,8 @@
 
 #include "ArrayRef.h"
 
+#include <glm/glm.hpp>
+
 #include <vector>
 #include <cstdint>
 #include <cassert>
@@ -68,7 +70,7 @@ public:
 		return m_vertexData;
 	}
 
-	size_t vertexCount() {
+	size_t vertexCount() const {
 		return m_vertexCount;
 	}
 
@@ -88,7 +90,29 @@ public:
 		return m_indices;
 	}
 
+	/**
+	 * Extracts vertex positions. First element of vertex layout has to be
+	 * position made of at least three floats.
+	 * @throw std::runtime_error when layout does not start with position
+	 */
+	std::vector<glm::vec3> positions() const;
+
+	/// Returns true when second element of vertex layout is normal made of three floats
+	bool hasNormals() const {
+		return m_vertexLayout.size() >= 2 && m_vertexLayout[1].type == VertexElementType::Float 
+			&& m_vertexLayout[1].numComponents == 3;
+	}
+
+	/**
+	 * Extracts vertex normals stored as second element of vertex layout.
+	 * @throw std::runtime_error when mesh has no normals
+	 */
+	std::vector<glm::vec3> normals() const;
+
 private:
+	/// Reads first three floats of vertex element, offsets and strides are computed as when vertices are uploaded
+	std::vector<glm::vec3> readVec3(size_t element) const;
+
 	std::vector<char> m_vertexData;
 	size_t m_vertexCount;
 	std::vector<VertexElement> m_vertexLayout;
@@ -0,0 +1,85 @@
+/**
+ * @file PrimitiveArrays.h
+ *
+ * @author Jan Duek <xdusek17@stud.fit.vutbr.cz>
+ * @date 2013
+ */
+
+#ifndef PRIMITIVE_ARRAYS_H
+#define PRIMITIVE_ARRAYS_H
+
+#include "BoundingBox.h"
+
+#include <vector>
+#include <cstddef>
+#include <utility>
+
+/**
+ * Bounding boxes and centroids of BVH build primitives in structure of arrays.
+ * It is primitive policy used by BVH::build, any class with size(), 
+ * boundingBox(i), centroid(i) and swap(i, j) methods can be used instead of it.
+ */
+class PrimitiveArrays
+{
+public:
+	explicit PrimitiveArrays(size_t size = 0) {
+		resize(size);
+	}
+
+	/// Gathers bounds of objects accessed through pointers, e.g. ISceneObject
+	template <class RandomAccessIterator>
+	PrimitiveArrays(RandomAccessIterator first, RandomAccessIterator last) {
+		resize(last - first);
+		for (size_t i = 0; i < size(); ++i)
+			set(i, first[i]->boundingBox(), first[i]->centroid());
+	}
+
+	size_t size() const {
+		return m_centroid[0].size();
+	}
+
+	void resize(size_t size) {
+		for (int dim = 0; dim < 3; ++dim) {
+			m_min[dim].resize(size);
+			m_max[dim].resize(size);
+			m_centroid[dim].resize(size);
+		}
+	}
+
+	void set(size_t i, const BoundingBox& bbox, const glm::vec3& centroid) {
+		for (int dim = 0; dim < 3; ++dim) {
+			m_min[dim][i] = bbox.min()[dim];
+			m_max[dim][i] = bbox.max()[dim];
+			m_centroid[dim][i] = centroid[dim];
+		}
+	}
+
+	/// Sets primitive whose centroid is center of its bounding box
+	void set(size_t i, const BoundingBox& bbox) {
+		set(i, bbox, bbox.center());
+	}
+
+	BoundingBox boundingBox(size_t i) const {
+		return BoundingBox(glm::vec3(m_min[0][i], m_min[1][i], m_min[2][i]), 
+			glm::vec3(m_max[0][i], m_max[1][i], m_max[2][i]));
+	}
+
+	glm::vec3 centroid(size_t i) const {
+		return glm::vec3(m_centroid[0][i], m_centroid[1][i], m_centroid[2][i]);
+	}
+
+	/// Exchanges two primitives, builder partitions primitives with it
+	void swap(size_t i, size_t j) {
+		for (int dim = 0; dim < 3; ++dim) {
+			std::swap(m_min[dim][i], m_min[dim][j]);
+			std::swap(m_max[dim][i], m_max[dim][j]);
+			std::swap(m_centroid[dim][i], m_centroid[dim][j]);
+		}
+	}
+private:
+	std::vector<float> m_min[3];
+	std::vector<float> m_max[3];
+	std::vector<float> m_centroid[3];
+};
+
+#endif // !PRIMITIVE_ARRAYS_H
@@ -11,6 +11,7 @@
 #include <GL/glew.h>
 
 #include <algorithm>
+#include <vector>
 
 namespace gl {
 	class Query;
@@ -74,6 +75,64 @@ private:
 	GLuint m_handle;
 };
 
+/**
+ * Queries stored in one array and generated at once, query is addressed by index.
+ * Useful when every node of some hierarchy needs its own query.
+ */
+class QueryArray
+{
+public:
+	QueryArray() { }
+
+	~QueryArray() {
+		if (!m_handles.empty())
+			glDeleteQueries(static_cast<GLsizei>(m_handles.size()), m_handles.data());
+	}
+
+	/// Changes number of queries, existing queries are kept
+	void resize(size_t size) {
+		size_t oldSize = m_handles.size();
+		if (size > oldSize) {
+			m_handles.resize(size);
+			glGenQueries(static_cast<GLsizei>(size - oldSize), m_handles.data() + oldSize);
+		} else if (size < oldSize) {
+			glDeleteQueries(static_cast<GLsizei>(oldSize - size), m_handles.data() + size);
+			m_handles.resize(size);
+		}
+	}
+
+	size_t size() const {
+		return m_handles.size();
+	}
+
+	void begin(size_t i, GLenum target) {
+		glBeginQuery(target, m_handles[i]);
+	}
+
+	void end(GLenum target) {
+		glEndQuery(target);
+	}
+
+	bool isResultAvailable(size_t i) {
+		int result = GL_FALSE;
+		glGetQueryObjectiv(m_handles[i], GL_QUERY_RESULT_AVAILABLE, &result);
+		return result == GL_TRUE;
+	}
+
+	void getResult(size_t i, GLint* params) {
+		glGetQueryObjectiv(m_handles[i], GL_QUERY_RESULT, params);
+	}
+
+	void getResult(size_t i, GLuint* params) {
+		glGetQueryObjectuiv(m_handles[i], GL_QUERY_RESULT, params);
+	}
+private:
+	QueryArray(const QueryArray&);
+	QueryArray& operator=(const QueryArray&);
+
+	std::vector<GLuint> m_handles;
+};
+
 }
 
 inline void swap(gl::Query& first, gl::Query& second) {
@@ -44,15 +44,10 @@ void GeometryBatch::setIndices(const std::shared_ptr<Buffer>& ebo, GLenum type,
 	ebo->bind(GL_ELEMENT_ARRAY_BUFFER);
 }
 
-static size_t elementTypeSize(VertexElementType type) {
-	static size_t typeSizes[] = { 1, 1, 2, 2, 4, 4, 4, 8 };
-	return typeSizes[static_cast<int>(type)];
-}
-
 static size_t computeStride(const std::vector<VertexElement>& layout) {
 	size_t stride = 0;
 	for (const auto& element : layout) {
-		stride += element.numComponents * elementTypeSize(element.type);
+		stride += element.numComponents * vertexElementTypeSize(element.type);
 	}
 	return stride;
 }
@@ -73,7 +68,7 @@ void GeometryBatch::setVertices(const std::shared_ptr<Buffer>& vbo, size_t count
 		size_t offset = element.offset;
 		// if offset is 0 then compute it
 		if (i != 0 && offset == 0)
-			offset = previousOffset + layout[i - 1].numComponents * elementTypeSize(layout[i - 1].type);
+			offset = previousOffset + layout[i - 1].numComponents * vertexElementTypeSize(layout[i - 1].type);
 
 		previousOffset = offset;
 
@@ -14,6 +14,7 @@
 #include "VertexArrayObject.h"
 
 #include <vector>
+#include <memory>
 
 namespace gl {
 
@@ -82,15 +83,26 @@ private:
 	bool m_primitiveTypeSet;
 };
 
+/**
+ * Geometry of coarser level of detail.
+ */
+struct LodGeometry
+{
+	std::shared_ptr<GeometryBatch> geometry;
+	/// level is used when object covers less than this fraction of viewport height
+	float screenSize;
+};
+
 /**
  * All things necessary for draw call.
  */
 class RenderBatch
 {
 public:
-	RenderBatch() : shader(nullptr), materialUbo(nullptr), nodeUbo(nullptr), geometry(nullptr) { }
+	RenderBatch() : shader(nullptr), materialUbo(nullptr), nodeUbo(nullptr), geometry(nullptr), lastDrawn(0), lod(0) { }
 	RenderBatch(RenderBatch&& other) 
-		: shader(other.shader), materialUbo(other.materialUbo), nodeUbo(other.nodeUbo), geometry(std::move(other.geometry))
+		: shader(other.shader), materialUbo(other.materialUbo), nodeUbo(other.nodeUbo), geometry(std::move(other.geometry)),
+		lods(std::move(other.lods)), lastDrawn(other.lastDrawn), lod(other.lod)
 	{ }
 
 	RenderBatch& operator=(RenderBatch&& other) {
@@ -98,8 +110,16 @@ public:
 		this->materialUbo = other.materialUbo;
 		this->nodeUbo = other.nodeUbo;
 		this->geometry = std::move(other.geometry);
+		this->lods = std::move(other.lods);
+		this->lastDrawn = other.lastDrawn;
+		this->lod = other.lod;
 		return *this;
 	}
+
+	/// Gets geometry of currently selected level of detail
+	GeometryBatch& lodGeometry() {
+		return lod == 0 ? *geometry : *lods[lod - 1].geometry;
+	}
 	
 	RenderBatch(const RenderBatch&) = delete;
 	RenderBatch& operator=(const RenderBatch&) = delete;
@@ -110,8 +130,14 @@ public:
 	gl::IndexedBuffer* materialUbo;
 	/// UBO for node transforms
 	gl::IndexedBuffer* nodeUbo;
-	/// Geometry stuff
-	std::unique_ptr<GeometryBatch> geometry;
+	/// Geometry stuff, it is shared by batches of objects with same mesh
+	std::shared_ptr<GeometryBatch> geometry;
+	/// Coarser levels of detail sorted from finest, level i is lods[i - 1]
+	std::vector<LodGeometry> lods;
+	/// Pass in which batch was drawn last, object can be referenced from more BVH leafs
+	uint32_t lastDrawn;
+	/// Selected level of detail, 0 is full geometry
+	uint32_t lod;
 };
 
 }
@@ -14,33 +14,41 @@
 #include "Exception.h"
 #include "Scene.h"
 #include "BoundingBoxDrawer.h"
+#include "HlodProxy.h"
 
 #include <GL/glew.h>
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/swizzle.hpp>
 
 #include <algorithm>
+#include <limits>
+#include <cmath>
 #include <cassert>
 
 namespace gl {
 
-ShadowMap::ShadowMap(size_t size, std::shared_ptr<ShaderProgram> shader) 
-	: m_size(size), m_shader(std::move(shader)) 
+// in-class constant is bound to reference by std::min so it needs definition
+const size_t Renderer::MAX_SHADOW_CASCADES;
+
+ShadowMap::ShadowMap(size_t size, size_t numCascades, std::shared_ptr<ShaderProgram> shader) 
+	: m_size(size), m_numCascades(numCascades), m_shader(std::move(shader)) 
 {
 	glGenFramebuffers(1, &m_fbo);
 	glBindFramebuffer(GL_FRAMEBUFFER, m_fbo);
 
-	// create depth buffer texture
+	// create depth buffer texture with layer for each cascade
 	glGenTextures(1, &m_tex);
-	glBindTexture(GL_TEXTURE_2D, m_tex);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, size, size, 0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_R_TO_TEXTURE);
-
-	// use texture as depth buffer
-	glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, m_tex, 0);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, m_tex);
+	glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_DEPTH_COMPONENT, size, size, numCascades, 0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_R_TO_TEXTURE);
+
+	// use first layer as depth buffer, others are attached when their cascade is drawn
+	glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, m_tex, 0, 0);
 
 	// do not draw color buffer
 	glDrawBuffer(GL_NONE);
@@ -56,8 +64,14 @@ ShadowMap::~ShadowMap() {
 	glDeleteFramebuffers(1, &m_fbo);
 }
 
-Renderer::Renderer() : m_shadowMappingActive(false), m_showBboxes(false), 
-	m_scene(nullptr), m_frameID(0) {
+void ShadowMap::setCascade(size_t cascade) {
+	glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, m_tex, 0, cascade);
+}
+
+Renderer::Renderer() : m_lodHysteresis(0.1f), m_hlodScreenSize(0.1f), m_shadowMappingActive(false), m_light(nullptr), 
+	m_numCascades(MAX_SHADOW_CASCADES), m_cascadeSplitLambda(0.75f), 
+	m_shadowCasterCulling(true), m_showBboxes(false), 
+	m_occlusionCulling(true), m_scene(nullptr), m_queryBatchSize(50), m_assumedVisibleFrames(10), m_frameID(0), m_passID(0), m_lastForwardPass(0) {
 
 }
 
@@ -84,35 +98,107 @@ void Renderer::setViewport(const Viewport& viewport) {
 	m_viewport = viewport;
 }
 
-void Renderer::drawSceneNodeBatches(SceneNode* node) {
-	// view frustum culling
-	if (m_camera->viewFrustum().boundingBoxIntersetion(node->boundingBox()) == Frustum::Intersection::None)
+void Renderer::drawSceneWithFrustumCulling() {
+	if (!m_scene->wideBvh())
 		return;
 
-	if (m_showBboxes)
-		m_bboxDrawer->drawLinedSingle(node->boundingBox());
+	m_scene->wideBvh()->cullFrustum(m_camera->viewFrustum(), [this] (size_t first, size_t count) {
+		for (size_t i = first; i < first + count; ++i) {
+			BaseSceneObject* object = m_scene->object(i);
+			RenderBatch& batch = m_batches.at(object);
+			if (!markDrawn(batch))
+				continue;
 
-	if (node->isLeaf()) {
-		for (size_t i = 0; i < node->numObjects(); ++i) {
 			if (m_showBboxes)
-				m_bboxDrawer->drawLinedSingle(node->object(i)->boundingBox());
-			drawBatch(m_batches.at(node->object(i)));
+				m_bboxDrawer->drawLinedSingle(object->boundingBox());
+			selectLod(batch, object->boundingBox());
+			drawBatch(batch);
+			m_receivers.push_back(object);
 		}
-	} else {
-		drawSceneNodeBatches(node->leftChild());
-		drawSceneNodeBatches(node->rightChild());
-	}
+	});
+}
+
+void Renderer::drawDynamicObjects() {
+	m_scene->dynamicBvh().cullFrustum(m_camera->viewFrustum(), [this] (size_t slot) {
+		BaseSceneObject* object = m_scene->dynamicObject(slot);
+		RenderBatch& batch = m_batches.at(object);
+		if (!markDrawn(batch))
+			return;
+
+		if (m_showBboxes)
+			m_bboxDrawer->drawLinedSingle(object->boundingBox());
+		selectLod(batch, object->boundingBox());
+		drawBatch(batch);
+		m_receivers.push_back(object);
+	});
+}
+
+void Renderer::drawTiles() {
+	const Frustum& frustum = m_camera->viewFrustum();
+	m_scene->tileBvh().cullFrustum(frustum, [this, &frustum] (size_t id) {
+		const Scene::Tile& tile = m_scene->tile(id);
+		const BVH& bvh = *tile.bvh;
+		bvh.traverse([&frustum, &bvh] (size_t node) {
+			return frustum.boundingBoxIntersetion(bvh.boundingBox(node)) != Frustum::Intersection::None;
+		}, [this, &tile, &bvh] (size_t node) {
+			size_t first = bvh.firstObject(node);
+			for (size_t i = first; i < first + bvh.numObjects(node); ++i) {
+				BaseSceneObject* object = tile.objects[bvh.objectIndex(i)].get();
+				RenderBatch& batch = m_batches.at(object);
+				if (!markDrawn(batch))
+					continue;
+
+				if (m_showBboxes)
+					m_bboxDrawer->drawLinedSingle(object->boundingBox());
+				selectLod(batch, object->boundingBox());
+				drawBatch(batch);
+				m_receivers.push_back(object);
+			}
+		});
+	});
 }
 
-void Renderer::drawSceneNodeGeometry(SceneNode* node) {
-	if (node->isLeaf()) {
-		for (size_t i = 0; i < node->numObjects(); ++i) {
-			drawGeometry(*m_batches.at(node->object(i)).geometry);
+void Renderer::drawDynamicGeometry(const Frustum& frustum) {
+	m_scene->dynamicBvh().cullFrustum(frustum, [this] (size_t slot) {
+		RenderBatch& batch = m_batches.at(m_scene->dynamicObject(slot));
+		if (markDrawn(batch))
+			drawBatchGeometry(batch);
+	});
+
+	m_scene->tileBvh().cullFrustum(frustum, [this, &frustum] (size_t id) {
+		const Scene::Tile& tile = m_scene->tile(id);
+		const BVH& bvh = *tile.bvh;
+		bvh.traverse([&frustum, &bvh] (size_t node) {
+			return frustum.boundingBoxIntersetion(bvh.boundingBox(node)) != Frustum::Intersection::None;
+		}, [this, &tile, &bvh] (size_t node) {
+			size_t first = bvh.firstObject(node);
+			for (size_t i = first; i < first + bvh.numObjects(node); ++i) {
+				RenderBatch& batch = m_batches.at(tile.objects[bvh.objectIndex(i)].get());
+				if (markDrawn(batch))
+					drawBatchGeometry(batch);
+			}
+		});
+	});
+}
+
+void Renderer::drawSceneGeometry(const Frustum& frustum) {
+	// levels of detail selected in last forward pass are reused
+	drawDynamicGeometry(frustum);
+
+	const BVH* bvh = m_scene->bvh();
+	if (!bvh)
+		return;
+
+	bvh->traverse([&frustum, bvh] (size_t node) {
+		return frustum.boundingBoxIntersetion(bvh->boundingBox(node)) != Frustum::Intersection::None;
+	}, [this, bvh] (size_t node) {
+		size_t first = bvh->firstObject(node);
+		for (size_t i = first; i < first + bvh->numObjects(node); ++i) {
+			RenderBatch& batch = m_batches.at(m_scene->object(i));
+			if (markDrawn(batch))
+				drawBatchGeometry(batch);
 		}
-	} else {
-		drawSceneNodeGeometry(node->leftChild());
-		drawSceneNodeGeometry(node->rightChild());
-	}
+	});
 }
 
 void Renderer::drawFrame() {
@@ -124,11 +210,20 @@ void Renderer::drawFrame() {
 	}
 
 	// draw normal forward pass
+	m_passID++;
+	m_lastForwardPass = m_passID;
+	m_receivers.clear();
 
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-	drawSceneWithOcclussionCulling(m_scene->rootNode());
-	//drawSceneNodeBatches(m_scene->rootNode());
+	if (m_occlusionCulling)
+		drawSceneWithOcclussionCulling();
+	else
+		drawSceneWithFrustumCulling();
+
+	// objects added at runtime and streamed tiles are not occlusion culled
+	drawDynamicObjects();
+	drawTiles();
 
 	VertexArrayObject::unbind();
 }
@@ -140,21 +235,42 @@ void Renderer::setCamera(Camera* camera) {
 
 void Renderer::setLight(Light* light) {
 	light->uniformBuffer()->bind(LIGHT_BINDING_POINT,  GL_UNIFORM_BUFFER);
+	m_light = light;
 
 	// create shadow map if we don't have one and new light is shadow source.
 	if (!m_shadowMappingActive && light->isShadowSource()) {
-		m_shadowMap = std::unique_ptr<ShadowMap>(
-			new ShadowMap(SHADOW_MAP_SIZE, shaderManager()->getGlslProgram("shadowmap"))
-		);
-
+		createShadowMap();
 		m_shadowMappingActive = true;
 	// release shadow map if light is no longer shadow source.
 	} else if (m_shadowMappingActive && !light->isShadowSource()) {
 		m_shadowMap = nullptr;
+		m_lightCamera = nullptr;
+		m_cascadesUbo = nullptr;
+		m_shadowPassUbos.clear();
 		m_shadowMappingActive = false;
 	}
 }
 
+void Renderer::setShadowCascades(size_t count, float splitLambda) {
+	m_numCascades = std::min(std::max<size_t>(count, 1), MAX_SHADOW_CASCADES);
+	m_cascadeSplitLambda = glm::clamp(splitLambda, 0.0f, 1.0f);
+
+	if (m_shadowMappingActive && m_shadowMap->numCascades() != m_numCascades)
+		createShadowMap();
+}
+
+void Renderer::createShadowMap() {
+	m_shadowMap = std::unique_ptr<ShadowMap>(
+		new ShadowMap(SHADOW_MAP_SIZE, m_numCascades, shaderManager()->getGlslProgram("shadowmap"))
+	);
+	m_lightCamera = createUniformBuffer<LightCameraData>();
+	m_cascadesUbo = createUniformBuffer<CascadesData>();
+
+	m_shadowPassUbos.clear();
+	for (size_t i = 0; i < m_numCascades; ++i)
+		m_shadowPassUbos.push_back(createUniformBuffer<ShadowPassData>());
+}
+
 void Renderer::setScene(Scene* scene) {
 	m_scene = scene;
 }
@@ -167,28 +283,28 @@ void Renderer::registerSceneObject(ISceneObject* renderable) {
 	batch.materialUbo = renderable->material()->uniformBuffer();
 	batch.nodeUbo = renderable->uniformBuffer();
 
+	// batch without geometry is never drawn, but scene can still look it up like any other
 	auto mesh = renderable->mesh();
 	if (!mesh->isValid()) {
 		LOG(ERROR) << "Renderable with invalid mesh registered to renderer.";
+		m_batches.insert(std::make_pair(renderable, std::move(batch)));
 		return;
 	}
 
-	// create OpenGL geometry i.e. vao, vbo etc.
+	batch.geometry = geometryForMesh(mesh);
 
-	auto vbo = std::make_shared<Buffer>();
-	vbo->loadData(mesh->vertexData().data(), mesh->vertexData().size());
+	for (size_t level = 1; level <= renderable->numLods(); ++level) {
+		Mesh* lodMesh = renderable->lodMesh(level);
+		if (!lodMesh || !lodMesh->isValid()) {
+			LOG(WARNING) << "Renderable has missing or invalid mesh of level of detail " << level << ", coarser levels are ignored.";
+			break;
+		}
 
-	auto geom = new GeometryBatch();
-	geom->vao().bind();
-	geom->setPrimitiveType(mesh->primitiveType());
-	geom->setVertices(vbo, mesh->vertexCount(), mesh->vertexLayout());
-	if (mesh->isIndexed()) {
-		auto ebo = std::make_shared<Buffer>();
-		ebo->loadData(mesh->indices().data(), mesh->indices().size() * sizeof(uint32_t));
-		geom->setIndices(ebo, GL_UNSIGNED_INT, mesh->indices().size());
+		LodGeometry lod;
+		lod.geometry = geometryForMesh(lodMesh);
+		lod.screenSize = renderable->lodScreenSize(level);
+		batch.lods.push_back(std::move(lod));
 	}
-	VertexArrayObject::unbind();
-	batch.geometry.reset(geom);
 
 	m_batches.insert(std::make_pair(renderable, std::move(batch)));
 
@@ -204,10 +320,85 @@ void Renderer::registerSceneObject(ISceneObject* renderable) {
 }
 
 void Renderer::unregisterSceneObject(ISceneObject* renderable) {
-	LOG(ERROR) << "Renderer::unregisterSceneNode not implemented.";
+	auto it = m_batches.find(renderable);
+	if (it == m_batches.end())
+		return;
+
+	// buffers can be released and their addresses reused by new objects so forget them
+	if (m_currentState.materialUbo == it->second.materialUbo)
+		m_currentState.materialUbo = nullptr;
+	if (m_currentState.nodeUbo == it->second.nodeUbo)
+		m_currentState.nodeUbo = nullptr;
+
+	// receivers are kept until next frame, object drawn in last forward pass must not stay among them
+	if (it->second.lastDrawn == m_lastForwardPass)
+		m_receivers.erase(std::remove(m_receivers.begin(), m_receivers.end(), renderable), m_receivers.end());
+
+	// destroying last batch using geometry deletes its vao and buffers
+	m_batches.erase(it);
+	releaseGeometry(renderable->mesh());
+	for (size_t level = 1; level <= renderable->numLods(); ++level)
+		releaseGeometry(renderable->lodMesh(level));
+}
+
+void Renderer::releaseGeometry(const Mesh* mesh) {
+	auto it = m_geometries.find(mesh);
+	if (it != m_geometries.end() && it->second.expired())
+		m_geometries.erase(it);
+}
+
+std::shared_ptr<GeometryBatch> Renderer::geometryForMesh(Mesh* mesh) {
+	auto& cached = m_geometries[mesh];
+	if (auto geom = cached.lock())
+		return geom;
+
+	// create OpenGL geometry i.e. vao, vbo etc.
+
+	auto vbo = std::make_shared<Buffer>();
+	vbo->loadData(mesh->vertexData().data(), mesh->vertexData().size());
+
+	auto geom = std::make_shared<GeometryBatch>();
+	geom->vao().bind();
+	geom->setPrimitiveType(mesh->primitiveType());
+	geom->setVertices(vbo, mesh->vertexCount(), mesh->vertexLayout());
+	if (mesh->isIndexed()) {
+		auto ebo = std::make_shared<Buffer>();
+		ebo->loadData(mesh->indices().data(), mesh->indices().size() * sizeof(uint32_t));
+		geom->setIndices(ebo, GL_UNSIGNED_INT, mesh->indices().size());
+	}
+	VertexArrayObject::unbind();
+
+	cached = geom;
+	return geom;
+}
+
+float Renderer::projectedSize(const BoundingBox& bbox) const {
+	float radius = 0.5f * glm::length(bbox.max() - bbox.min());
+	float distance = glm::length(bbox.center() - m_camera->position());
+	if (distance <= radius)
+		return std::numeric_limits<float>::max();
+	return radius * m_camera->projectionMatrix()[1][1] / distance;
+}
+
+void Renderer::selectLod(RenderBatch& batch, const BoundingBox& bbox) {
+	if (batch.lods.empty())
+		return;
+
+	float screenSize = projectedSize(bbox);
+
+	// level changes only when size gets out of band around threshold
+	uint32_t lod = batch.lod;
+	while (lod < batch.lods.size() && screenSize < batch.lods[lod].screenSize * (1.0f - m_lodHysteresis))
+		lod++;
+	while (lod > 0 && screenSize > batch.lods[lod - 1].screenSize * (1.0f + m_lodHysteresis))
+		lod--;
+	batch.lod = lod;
 }
 
 void Renderer::drawBatch(RenderBatch& batch) {
+	if (!batch.geometry)
+		return;
+
 	if (batch.shader != m_currentState.shader) {
 		batch.shader->use();
 		m_currentState.shader = batch.shader;
@@ -226,10 +417,22 @@ void Renderer::drawBatch(RenderBatch& batch) {
 	// bind shadow map to texture unit
 	if (m_shadowMappingActive) {
 		glActiveTexture(GL_TEXTURE0 + SHADOW_MAP_BINDING_POINT);
-		glBindTexture(GL_TEXTURE_2D, m_shadowMap->depthTexture());
+		glBindTexture(GL_TEXTURE_2D_ARRAY, m_shadowMap->depthTexture());
 	}
 
-	drawGeometry(*batch.geometry);
+	drawGeometry(batch.lodGeometry());
+}
+
+void Renderer::drawBatchGeometry(RenderBatch& batch) {
+	if (!batch.geometry)
+		return;
+
+	if (batch.nodeUbo != m_currentState.nodeUbo) {
+		batch.nodeUbo->bind(NODE_BINDING_POINT, GL_UNIFORM_BUFFER);
+		m_currentState.nodeUbo = batch.nodeUbo;
+	}
+
+	drawGeometry(batch.lodGeometry());
 }
 
 void Renderer::drawGeometry(GeometryBatch& geom) {
@@ -240,62 +443,318 @@ void Renderer::drawGeometry(GeometryBatch& geom) {
 		glDrawArrays(geom.drawMode(), 0, geom.vertexCount());
 }
 
+bool Renderer::selectProxy(SceneNodes& nodes, size_t node, const BoundingBox& bbox) {
+	if (!m_scene->hlodProxy(node)) {
+		nodes.setUsesProxy(node, false);
+		return false;
+	}
+
+	// same hysteresis as levels of detail of single objects
+	float threshold = m_hlodScreenSize * (nodes.usesProxy(node) ? 1.0f + m_lodHysteresis : 1.0f - m_lodHysteresis);
+	bool usesProxy = projectedSize(bbox) < threshold;
+	nodes.setUsesProxy(node, usesProxy);
+	return usesProxy;
+}
+
+void Renderer::updateCascades() {
+	// near and far distance of perspective projection
+	const glm::mat4& proj = m_camera->projectionMatrix();
+	float zNear = proj[3][2] / (proj[2][2] - 1.0f);
+	float zFar = proj[3][2] / (proj[2][2] + 1.0f);
+
+	// corners of view frustum at near and far plane in world space
+	glm::mat4 invViewProj = glm::inverse(proj * m_camera->viewMatrix());
+	glm::vec3 nearCorners[4], farCorners[4];
+	for (int i = 0; i < 4; ++i) {
+		float x = (i & 1) ? 1.0f : -1.0f;
+		float y = (i & 2) ? 1.0f : -1.0f;
+		glm::vec4 n = invViewProj * glm::vec4(x, y, -1.0f, 1.0f);
+		glm::vec4 f = invViewProj * glm::vec4(x, y, 1.0f, 1.0f);
+		nearCorners[i] = glm::swizzle<glm::X, glm::Y, glm::Z>(n) / n.w;
+		farCorners[i] = glm::swizzle<glm::X, glm::Y, glm::Z>(f) / f.w;
+	}
+
+	// light looks along its direction, view rotation is the same for all cascades and frames
+	glm::vec3 lightDir = glm::normalize(glm::swizzle<glm::X, glm::Y, glm::Z>(m_light->position()));
+	glm::vec3 up = std::abs(lightDir.z) > 0.99f ? glm::vec3(0.0f, 1.0f, 0.0f) : glm::vec3(0.0f, 0.0f, 1.0f);
+	glm::mat4 lightView = glm::lookAt(glm::vec3(0.0f), lightDir, up);
+
+	float splitNear = zNear;
+	for (size_t c = 0; c < m_numCascades; ++c) {
+		// practical split scheme, blend of logarithmic and uniform split
+		float t = static_cast<float>(c + 1) / m_numCascades;
+		float logSplit = zNear * std::pow(zFar / zNear, t);
+		float uniformSplit = zNear + (zFar - zNear) * t;
+		float splitFar = m_cascadeSplitLambda * logSplit + (1.0f - m_cascadeSplitLambda) * uniformSplit;
+
+		glm::vec3 corners[8];
+		glm::vec3 center(0.0f);
+		for (int i = 0; i < 4; ++i) {
+			corners[i] = glm::mix(nearCorners[i], farCorners[i], (splitNear - zNear) / (zFar - zNear));
+			corners[i + 4] = glm::mix(nearCorners[i], farCorners[i], (splitFar - zNear) / (zFar - zNear));
+			center += corners[i] + corners[i + 4];
+		}
+		center /= 8.0f;
+
+		// bounding sphere does not change with camera rotation, rounded radius keeps texel size constant
+		float radius = 0.0f;
+		for (int i = 0; i < 8; ++i)
+			radius = std::max(radius, glm::length(corners[i] - center));
+		radius = std::ceil(radius * 16.0f) / 16.0f;
+
+		// move projection only by whole texels so shadow edges do not shimmer when camera moves
+		float texelSize = 2.0f * radius / m_shadowMap->size();
+		glm::vec3 lightCenter = glm::swizzle<glm::X, glm::Y, glm::Z>(lightView * glm::vec4(center, 1.0f));
+		lightCenter.x = std::floor(lightCenter.x / texelSize) * texelSize;
+		lightCenter.y = std::floor(lightCenter.y / texelSize) * texelSize;
+
+		glm::mat4 lightProj = glm::ortho(lightCenter.x - radius, lightCenter.x + radius,
+			lightCenter.y - radius, lightCenter.y + radius, -lightCenter.z - radius, -lightCenter.z + radius);
+		m_cascades.viewProjection[c] = lightProj * lightView;
+		m_cascades.splits[c] = splitFar;
+
+		ShadowPassData pass = { m_cascades.viewProjection[c] };
+		m_shadowPassUbos[c]->setData(pass);
+		m_shadowPassUbos[c]->flushData();
+
+		splitNear = splitFar;
+	}
+	m_cascades.numCascades = static_cast<int32_t>(m_numCascades);
+
+	m_cascadesUbo->setData(m_cascades);
+	m_cascadesUbo->flushData();
+	m_cascadesUbo->internalBuffer()->bind(CASCADES_BINDING_POINT, GL_UNIFORM_BUFFER);
+}
+
 void Renderer::drawShadowMap() {
+	updateCascades();
+
 	// bind fbo and set its viewport
 	glBindFramebuffer(GL_FRAMEBUFFER, m_shadowMap->fbo());
 	glViewport(0, 0, m_shadowMap->size(), m_shadowMap->size());
 
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	// casters between light and cascade are flattened onto its near plane
+	glEnable(GL_DEPTH_CLAMP);
+
+	// receivers are known only after first forward pass
+	const BVH* bvh = m_scene->bvh();
+	bool cullCasters = m_shadowCasterCulling && bvh && m_lastForwardPass != 0;
+
+	for (size_t c = 0; c < m_numCascades; ++c) {
+		m_shadowMap->setCascade(c);
+		m_shadowPassUbos[c]->internalBuffer()->bind(SHADOW_PASS_BINDING_POINT, GL_UNIFORM_BUFFER);
+
+		m_shadowMap->shader()->use();
+		m_currentState.shader = m_shadowMap->shader();
+
+		// projection box contains whole cascade slice so receivers outside it are shadowed by other cascades
+		Frustum receiverFrustum(m_cascades.viewProjection[c]);
+		// objects outside cascade projection cannot cast shadow into it, except those towards light
+		Frustum frustum = receiverFrustum;
+		frustum.removeNearPlane();
 
-	m_shadowMap->shader()->use();
-	m_currentState.shader = m_shadowMap->shader();
+		if (cullCasters) {
+			drawReceiverMask(receiverFrustum);
+			findShadowCasters(frustum, m_cascades.viewProjection[c]);
 
-	// draw only geometry
-	drawSceneNodeGeometry(m_scene->rootNode());
+			m_shadowMap->shader()->use();
+			m_currentState.shader = m_shadowMap->shader();
+		}
+
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+		// draw only geometry
+		m_passID++;
+		if (cullCasters) {
+			drawDynamicGeometry(frustum);
+			for (size_t node : m_casterLeaves) {
+				size_t first = bvh->firstObject(node);
+				for (size_t i = first; i < first + bvh->numObjects(node); ++i) {
+					RenderBatch& batch = m_batches.at(m_scene->object(i));
+					if (markDrawn(batch))
+						drawBatchGeometry(batch);
+				}
+			}
+		} else {
+			drawSceneGeometry(frustum);
+		}
+	}
 	VertexArrayObject::unbind();
 
+	glDisable(GL_DEPTH_CLAMP);
+
 	// unbound fbo and set viewport back
 	glBindFramebuffer(GL_FRAMEBUFFER, 0);
 	glViewport(static_cast<int>(m_viewport.x), static_cast<int>(m_viewport.y), 
 		static_cast<size_t>(m_viewport.width), static_cast<size_t>(m_viewport.height));
 }
 
-void Renderer::drawSceneWithOcclussionCulling(SceneNode* root) {
-	traversalStack.push_back(root);
+void Renderer::drawReceiverMask(const Frustum& frustum) {
+	// keep farthest depth, texels without receiver stay at 0 so nothing passes there
+	glClearDepth(0.0);
+	glClear(GL_DEPTH_BUFFER_BIT);
+	glClearDepth(1.0);
+	glDepthFunc(GL_GREATER);
+
+	for (ISceneObject* object : m_receivers) {
+		if (frustum.boundingBoxIntersetion(object->boundingBox()) != Frustum::Intersection::None)
+			drawBatchGeometry(m_batches.at(object));
+	}
+
+	glDepthFunc(GL_LESS);
+}
+
+void Renderer::findShadowCasters(const Frustum& frustum, const glm::mat4& viewProjection) {
+	const BVH* bvh = m_scene->bvh();
+	if (m_casterQueries.size() != bvh->numNodes())
+		m_casterQueries.resize(bvh->numNodes());
+
+	// boxes are drawn by bounding box drawer which uses camera block
+	LightCameraData lightCamera = { glm::mat4(1.0f), glm::mat4(1.0f), viewProjection, glm::vec3(0.0f) };
+	m_lightCamera->setData(lightCamera);
+	m_lightCamera->flushData();
+	m_lightCamera->internalBuffer()->bind(CAMERA_BINDING_POINT, GL_UNIFORM_BUFFER);
+
+	// box passes where it is in front of farthest receiver, depth clamp of shadow pass flattens boxes crossing near plane
+	glDepthMask(GL_FALSE);
+
+	// traversal stack and query queue of occlusion culling are empty outside forward pass
+	m_casterLeaves.clear();
+	m_bboxDrawer->beginBoxes();
+	if (frustum.boundingBoxIntersetion(bvh->boundingBox(0)) != Frustum::Intersection::None)
+		traversalStack.push_back(0);
+	while (!traversalStack.empty() || !queryQueue.empty()) {
+		// process finished queries, GPU is waited for only when there is no node left to query
+		while (!queryQueue.empty() && (traversalStack.empty() || m_casterQueries.isResultAvailable(queryQueue.front().node))) {
+			size_t node = queryQueue.front().node;
+			queryQueue.pop();
+
+			int visible = GL_FALSE;
+			m_casterQueries.getResult(node, &visible);
+			if (!visible)
+				continue;
+
+			if (bvh->isLeaf(node)) {
+				m_casterLeaves.push_back(node);
+				continue;
+			}
+
+			// children outside light projection are not queried at all
+			size_t children[] = { node + 1, bvh->rightChild(node) };
+			for (size_t child : children) {
+				if (frustum.boundingBoxIntersetion(bvh->boundingBox(child)) != Frustum::Intersection::None)
+					traversalStack.push_back(child);
+			}
+		}
+
+		// query next node while results of previous ones are on their way
+		if (!traversalStack.empty()) {
+			QueryEntry entry = { traversalStack.back(), 0, 1 };
+			traversalStack.pop_back();
+
+			m_casterQueries.begin(entry.node, GL_ANY_SAMPLES_PASSED);
+			m_bboxDrawer->drawBox(bvh->boundingBox(entry.node));
+			m_casterQueries.end(GL_ANY_SAMPLES_PASSED);
+			queryQueue.push(entry);
+		}
+	}
+
+	glDepthMask(GL_TRUE);
+	m_camera->uniformBuffer()->bind(CAMERA_BINDING_POINT, GL_UNIFORM_BUFFER);
+}
+
+void Renderer::drawSceneWithOcclussionCulling() {
+	const BVH* bvh = m_scene->bvh();
+	if (!bvh)
+		return;
+
+	SceneNodes& nodes = m_scene->nodes();
+	gl::QueryArray& queries = nodes.queries();
+
+	multiQueryNodes.clear();
+	traversalStack.push_back(0);
 	while (!traversalStack.empty() || !queryQueue.empty()) {
 		// process finished queries
-		while (!queryQueue.empty() && (queryQueue.front()->query().isResultAvailable() || traversalStack.empty())) {
+		while (!queryQueue.empty()) {
+			QueryEntry entry = queryQueue.front();
+			if (!queries.isResultAvailable(entry.node)) {
+				// keep GPU busy while result is not ready
+				if (!visibleQueue.empty()) {
+					issueQueries(nodes, visibleQueue, false);
+					continue;
+				}
+				if (!traversalStack.empty())
+					break;
+				if (!invisibleQueue.empty()) {
+					issueQueries(nodes, invisibleQueue, true);
+					continue;
+				}
+			}
+
 			// pop node from queue
-			auto node = queryQueue.front();
 			queryQueue.pop();
 
-			// get query result (will wait to result if traversalStack is empty)
+			// get query result (will wait to result if there is nothing else to do)
 			int visible = GL_FALSE;
-			node->query().getResult(&visible);
-			if (visible) {
-				pullUpVisibility(node);
-				traverseNode(node);
+			queries.getResult(entry.node, &visible);
+			if (!visible)
+				continue;
+
+			if (entry.count > 1) {
+				// some nodes of group are visible, find out which ones
+				splitQueue.assign(multiQueryNodes.begin() + entry.first, multiQueryNodes.begin() + entry.first + entry.count);
+				issueQueries(nodes, splitQueue, false);
+			} else {
+				// newly visible node is assumed visible for random part of interval
+				if (nodes.nextQuery(entry.node) <= m_frameID)
+					nodes.setNextQuery(entry.node, m_frameID + 1 + m_random() % m_assumedVisibleFrames);
+
+				pullUpVisibility(nodes, entry.node);
+				traverseNode(entry.node);
 			}
 		}
 
 		// hierarchical traversal
 		if (!traversalStack.empty()) {
 			// pop node from stack
-			auto node = traversalStack.back();
+			size_t node = traversalStack.back();
 			traversalStack.pop_back();
 			
 			// do frustum culling
-			if (m_camera->viewFrustum().boundingBoxIntersetion(node->boundingBox()) != Frustum::Intersection::None) {
+			BoundingBox bbox = bvh->boundingBox(node);
+			if (m_camera->viewFrustum().boundingBoxIntersetion(bbox) != Frustum::Intersection::None) {
 				// determine if node was previously visible
-				bool wasVisible = node->isVisible() && (node->lastVisited() == m_frameID - 1);
+				bool visitedLastFrame = nodes.lastVisited(node) == m_frameID - 1;
+				bool wasVisible = nodes.isVisible(node) && visitedLastFrame;
 
-				// update node visibility
-				node->setVisibility(false);
-				node->setLastVisited(m_frameID);
+				// count how long node stays invisible, history of nodes outside frustum is lost
+				if (!wasVisible && visitedLastFrame)
+					nodes.setInvisibleFrames(node, nodes.invisibleFrames(node) + 1);
+				else
+					nodes.setInvisibleFrames(node, 0);
 
-				// issue query for leafs and previously invisible
-				if (node->isLeaf() || !wasVisible) {
-					issueQuery(node);
+				// update node visibility
+				nodes.setVisibility(node, false);
+				nodes.setLastVisited(node, m_frameID);
+
+				// distant subtree drawn by its proxy is leaf for this frame
+				bool usesProxy = selectProxy(nodes, node, bbox);
+
+				// query leafs and previously invisible, visible ones after they are drawn
+				if (wasVisible) {
+					if (bvh->isLeaf(node) || usesProxy) {
+						if (m_frameID < nodes.nextQuery(node)) {
+							// assumed visible, no query this frame
+							pullUpVisibility(nodes, node);
+						} else {
+							nodes.setNextQuery(node, m_frameID + m_assumedVisibleFrames);
+							visibleQueue.push_back(node);
+						}
+					}
+				} else {
+					invisibleQueue.push_back(node);
+					if (invisibleQueue.size() >= m_queryBatchSize)
+						issueQueries(nodes, invisibleQueue, true);
 				}
 
 				// always traverse a node when it was visible
@@ -303,31 +762,55 @@ void Renderer::drawSceneWithOcclussionCulling(SceneNode* root) {
 					traverseNode(node);
 			}
 		}
+
+		// traversal is finished, so remaining queries have to be issued to get their results
+		if (traversalStack.empty() && queryQueue.empty()) {
+			if (!invisibleQueue.empty())
+				issueQueries(nodes, invisibleQueue, true);
+			if (!visibleQueue.empty())
+				issueQueries(nodes, visibleQueue, false);
+		}
 	}
 }
 
-void Renderer::pullUpVisibility(SceneNode* node) {
-	while (node && !node->isVisible()) {
-		node->setVisibility(true);
-		node = node->parent();
+void Renderer::pullUpVisibility(SceneNodes& nodes, size_t node) {
+	while (node != SceneNodes::NO_PARENT && !nodes.isVisible(node)) {
+		nodes.setVisibility(node, true);
+		node = nodes.parent(node);
 	}
 }
 
-void Renderer::traverseNode(SceneNode* node) {
+void Renderer::traverseNode(size_t node) {
+	const BVH* bvh = m_scene->bvh();
 	if (m_showBboxes)
-		m_bboxDrawer->drawLinedSingle(node->boundingBox());
-
-	if (node->isLeaf()) {
-		for (size_t i = 0; i < node->numObjects(); ++i) {
-			drawBatch(m_batches.at(node->object(i)));
+		m_bboxDrawer->drawLinedSingle(bvh->boundingBox(node));
+
+	if (m_scene->nodes().usesProxy(node)) {
+		// whole subtree by one draw call, children are not visited
+		ISceneObject* proxy = m_scene->hlodProxy(node);
+		RenderBatch& batch = m_batches.at(proxy);
+		if (markDrawn(batch)) {
+			drawBatch(batch);
+			m_receivers.push_back(proxy);
+		}
+	} else if (bvh->isLeaf(node)) {
+		size_t first = bvh->firstObject(node);
+		for (size_t i = first; i < first + bvh->numObjects(node); ++i) {
+			BaseSceneObject* object = m_scene->object(i);
+			RenderBatch& batch = m_batches.at(object);
+			if (markDrawn(batch)) {
+				selectLod(batch, object->boundingBox());
+				drawBatch(batch);
+				m_receivers.push_back(object);
+			}
 		}
 	} else {
-		auto left = node->leftChild();
-		auto right = node->rightChild();
+		size_t left = node + 1;
+		size_t right = bvh->rightChild(node);
 
 		// compute distance from camera position to children bboxes
-		float distToLeft = left->boundingBox().distance(m_camera->position());
-		float distToRight = right->boundingBox().distance(m_camera->position());
+		float distToLeft = bvh->boundingBox(left).distance(m_camera->position());
+		float distToRight = bvh->boundingBox(right).distance(m_camera->position());
 
 		// push children to stack ... farther child first
 		if (distToLeft > distToRight) {
@@ -340,21 +823,69 @@ void Renderer::traverseNode(SceneNode* node) {
 	}
 }
 
-void Renderer::issueQuery(SceneNode* node) {
+void Renderer::issueQueries(SceneNodes& nodes, std::vector<size_t>& queue, bool grouped) {
+	// nodes invisible for longest time are grouped first
+	if (grouped) {
+		std::stable_sort(queue.begin(), queue.end(), [&nodes] (size_t a, size_t b) {
+			return nodes.invisibleFrames(a) > nodes.invisibleFrames(b);
+		});
+	}
+
 	// disable writing to depth buffer and color buffer
 	glDepthMask(GL_FALSE);
 	glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
-	
-	node->query().begin(GL_ANY_SAMPLES_PASSED);
-	m_bboxDrawer->drawSingle(node->boundingBox());
-	node->query().end(GL_ANY_SAMPLES_PASSED);
+	m_bboxDrawer->beginBoxes();
+
+	const BVH* bvh = m_scene->bvh();
+	for (size_t i = 0; i < queue.size(); ) {
+		QueryEntry entry;
+		entry.node = queue[i];
+		entry.first = multiQueryNodes.size();
+		entry.count = grouped ? multiQuerySize(nodes, queue, i) : 1;
+		if (entry.count > 1)
+			multiQueryNodes.insert(multiQueryNodes.end(), queue.begin() + i, queue.begin() + i + entry.count);
+
+		nodes.queries().begin(entry.node, GL_ANY_SAMPLES_PASSED);
+		for (size_t j = i; j < i + entry.count; ++j)
+			m_bboxDrawer->drawBox(bvh->boundingBox(queue[j]));
+		nodes.queries().end(GL_ANY_SAMPLES_PASSED);
+
+		// push to queue
+		queryQueue.push(entry);
+		i += entry.count;
+	}
+	queue.clear();
 
 	// re enable writing to depth buffer and color buffer
 	glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
 	glDepthMask(GL_TRUE);
+}
+
+/// Probability that node stays invisible after given number of frames it was invisible (CHC++)
+static float stayInvisibleProbability(uint32_t invisibleFrames) {
+	return 0.99f - 0.7f * std::exp(-static_cast<float>(invisibleFrames));
+}
 
-	// push to queue
-	queryQueue.push(node);
+size_t Renderer::multiQuerySize(const SceneNodes& nodes, const std::vector<size_t>& queue, size_t first) const {
+	// nodes without history of invisibility are queried alone
+	if (nodes.invisibleFrames(queue[first]) == 0)
+		return 1;
+
+	// group grows while it saves queries, when multi-query fails all its nodes are queried again
+	float p = stayInvisibleProbability(nodes.invisibleFrames(queue[first]));
+	float value = 1.0f / (2.0f - p);
+	size_t size = 1;
+	while (first + size < queue.size() && nodes.invisibleFrames(queue[first + size]) != 0) {
+		float groupP = p * stayInvisibleProbability(nodes.invisibleFrames(queue[first + size]));
+		float groupValue = (size + 1) / (1.0f + (1.0f - groupP) * (size + 1));
+		if (groupValue <= value)
+			break;
+
+		p = groupP;
+		value = groupValue;
+		size++;
+	}
+	return size;
 }
 
 }
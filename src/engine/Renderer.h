@@ -14,17 +14,21 @@
 #include "ShaderManager.h"
 #include "Interfaces.h"
 #include "Query.h"
+#include "RingBuffer.h"
 
 #include <memory>
 #include <vector>
 #include <unordered_map>
-#include <queue>
+#include <algorithm>
+#include <random>
 
 class Camera;
+class Frustum;
 class IMaterial;
 class Light;
+class Mesh;
 class Scene;
-class SceneNode;
+class SceneNodes;
 
 namespace gl {
 
@@ -61,7 +65,7 @@ public:
 
 	/// Register scene object in render, so he will draw it.
 	void registerSceneObject(ISceneObject* renderable);
-	/// Stops drawing given object.
+	/// Stops drawing given object and releases its geometry.
 	void unregisterSceneObject(ISceneObject* renderable);
 
 	void setViewport(const Viewport& viewport);
@@ -81,43 +85,182 @@ public:
 	void showBboxes() { m_showBboxes = true; }
 	void hideBboxes() { m_showBboxes = false; }
 	void toggleBboxVisibility() { m_showBboxes = !m_showBboxes; }
+
+	/// Switches between occlusion culling and frustum culling only
+	void toggleOcclusionCulling() { m_occlusionCulling = !m_occlusionCulling; }
+
+	/// Switches culling of static shadow casters which cannot shadow any visible receiver
+	void toggleShadowCasterCulling() { m_shadowCasterCulling = !m_shadowCasterCulling; }
+
+	/**
+	 * Sets relative band around level of detail thresholds in which selected level is kept,
+	 * so objects near threshold do not switch levels every frame.
+	 */
+	void setLodHysteresis(float hysteresis) { m_lodHysteresis = hysteresis; }
+
+	/**
+	 * Sets number of queries of previously invisible nodes issued together. Bigger batches
+	 * need less state changes but results of first queries in batch arrive later.
+	 */
+	void setQueryBatchSize(size_t size) { m_queryBatchSize = std::max<size_t>(size, 1); }
+
+	/**
+	 * Sets number of frames for which visible leaf is assumed visible without query.
+	 * Leafs which become visible are queried again after random number of frames up to
+	 * this interval, so their queries do not land in the same frame. 1 queries every frame.
+	 */
+	void setAssumedVisibleFrames(uint32_t frames) { m_assumedVisibleFrames = std::max<uint32_t>(frames, 1); }
+
+	/// Sets fraction of viewport height under which BVH subtrees are drawn by their HLOD proxies
+	void setHlodScreenSize(float screenSize) { m_hlodScreenSize = screenSize; }
+
+	/**
+	 * Sets number of shadow map cascades view frustum is split to. Each cascade has its own
+	 * SHADOW_MAP_SIZE layer, at most MAX_SHADOW_CASCADES of them.
+	 * @param splitLambda blend between uniform (0) and logarithmic (1) split distances
+	 */
+	void setShadowCascades(size_t count, float splitLambda);
+
+	static const size_t MAX_SHADOW_CASCADES = 4;
 private:
 	static const int CAMERA_BINDING_POINT = 0;
 	static const int NODE_BINDING_POINT = 1;
 	static const int MATERIAL_BINDING_POINT = 2;
 	static const int LIGHT_BINDING_POINT = 3;
+	static const int CASCADES_BINDING_POINT = 4;
+	static const int SHADOW_PASS_BINDING_POINT = 5;
 
 	static const size_t SHADOW_MAP_SIZE = 1024;
 	static const int SHADOW_MAP_BINDING_POINT = 0;
 
-	void drawBatch(RenderBatch& batch);
-	void drawGeometry(GeometryBatch& geom);
+	/// Gets OpenGL geometry of mesh, it is created once and shared by all objects using mesh
+	std::shared_ptr<GeometryBatch> geometryForMesh(Mesh* mesh);
+	/// Forgets geometry of mesh when no batch uses it
+	void releaseGeometry(const Mesh* mesh);
+
+	/// Gets fraction of viewport height covered by bounding sphere of box
+	float projectedSize(const BoundingBox& bbox) const;
 
-	void drawSceneNodeBatches(SceneNode* node);
-	void drawSceneNodeGeometry(SceneNode* node);
+	/// Selects level of detail of batch by size of object bounding box projected to screen
+	void selectLod(RenderBatch& batch, const BoundingBox& bbox);
 
+	/// Decides if node is drawn by its HLOD proxy and stores decision to node state
+	bool selectProxy(SceneNodes& nodes, size_t node, const BoundingBox& bbox);
+
+	void drawBatch(RenderBatch& batch);
+	void drawGeometry(GeometryBatch& geom);
+	/// Draws geometry of batch with its node transform but keeps current shader, used by depth only passes
+	void drawBatchGeometry(RenderBatch& batch);
+
+	/// Draws geometry of all objects inside frustum
+	void drawSceneGeometry(const Frustum& frustum);
+	/// Draws geometry of objects added at runtime and of streamed tiles inside frustum
+	void drawDynamicGeometry(const Frustum& frustum);
+	/// Draws objects inside view frustum using wide BVH
+	void drawSceneWithFrustumCulling();
+	/// Draws objects added to scene at runtime which are inside view frustum
+	void drawDynamicObjects();
+	/// Draws objects of streamed tiles inside view frustum, tiles and their BVHs are culled hierarchically
+	void drawTiles();
+
+	/// Creates shadow map with layer for each cascade and buffers of cascade projections
+	void createShadowMap();
+	/// Splits view frustum to cascades and fits light projection to each of them
+	void updateCascades();
 	void drawShadowMap();
 
-	void drawSceneWithOcclussionCulling(SceneNode* root);
-	void pullUpVisibility(SceneNode* node);
-	void traverseNode(SceneNode* node);
-	void issueQuery(SceneNode* node);
+	/**
+	 * Shadow caster culling (Bittner et al.: Shadow Caster Culling for Efficient Shadow Mapping).
+	 * Objects drawn in last forward pass are receivers, their farthest depth in light space
+	 * is rendered to shadow map depth buffer, receivers outside frustum are skipped.
+	 */
+	void drawReceiverMask(const Frustum& frustum);
+	/**
+	 * Finds static BVH leafs inside frustum whose boxes are in front of some receiver in mask by hierarchical queries.
+	 * Queries are issued while results of previous ones are pending, same as in occlusion culling.
+	 * @param viewProjection light projection mask was rendered with
+	 */
+	void findShadowCasters(const Frustum& frustum, const glm::mat4& viewProjection);
+	/// Coherent hierarchical culling over BVH nodes, their state is kept in scene nodes arrays
+	void drawSceneWithOcclussionCulling();
+	void pullUpVisibility(SceneNodes& nodes, size_t node);
+	void traverseNode(size_t node);
+	/**
+	 * Issues queries of all nodes in queue with state set once for all of them and clears queue.
+	 * @param grouped nodes likely to stay invisible are grouped under single multi-query
+	 */
+	void issueQueries(SceneNodes& nodes, std::vector<size_t>& queue, bool grouped);
+	/// Gets number of nodes from queue starting at first which are worth to query together
+	size_t multiQuerySize(const SceneNodes& nodes, const std::vector<size_t>& queue, size_t first) const;
+
+	/// Marks batch as drawn in current pass, returns false when it already was drawn
+	bool markDrawn(RenderBatch& batch) {
+		if (batch.lastDrawn == m_passID)
+			return false;
+		batch.lastDrawn = m_passID;
+		return true;
+	}
 
 	Viewport m_viewport;
 
 	Camera* m_camera;
 
 	std::unordered_map<ISceneObject*, RenderBatch> m_batches;
+	std::unordered_map<const Mesh*, std::weak_ptr<GeometryBatch>> m_geometries;
+	float m_lodHysteresis;
+	float m_hlodScreenSize;
 	State m_currentState;
 
 	bool m_shadowMappingActive;
 	std::unique_ptr<ShadowMap> m_shadowMap;
+	Light* m_light;
+
+	/// Projections of all cascades, used by shaders receiving shadows
+	struct CascadesData
+	{
+		glm::mat4 viewProjection[MAX_SHADOW_CASCADES];
+		/// far view depth of each cascade
+		glm::vec4 splits;
+		int32_t numCascades;
+		int32_t padding[3];
+	};
+
+	/// Projection of cascade being rendered, used by shadow map shader
+	struct ShadowPassData
+	{
+		glm::mat4 viewProjection;
+	};
+
+	size_t m_numCascades;
+	float m_cascadeSplitLambda;
+	CascadesData m_cascades;
+	std::unique_ptr<UniformBuffer<CascadesData>> m_cascadesUbo;
+	std::vector<std::unique_ptr<UniformBuffer<ShadowPassData>>> m_shadowPassUbos;
+
+	/// Light view projection in layout of camera block, boxes are drawn in light space with it
+	struct LightCameraData
+	{
+		glm::mat4 view;
+		glm::mat4 projection;
+		glm::mat4 viewProjection;
+		glm::vec3 pos;
+	};
+
+	bool m_shadowCasterCulling;
+	std::unique_ptr<UniformBuffer<LightCameraData>> m_lightCamera;
+	gl::QueryArray m_casterQueries;
+	/// objects drawn in last forward pass, recorded while drawing so mask does not search all batches
+	std::vector<ISceneObject*> m_receivers;
+	/// static BVH leafs which can shadow visible receivers
+	std::vector<size_t> m_casterLeaves;
 
 	Scene* m_scene;
 	bool m_showBboxes;
+	bool m_occlusionCulling;
 	std::unique_ptr<BoundingBoxDrawer> m_bboxDrawer;
 
-	std::vector<SceneNode*> traversalStack;
+	/// indices of BVH nodes waiting for traversal
+	std::vector<size_t> traversalStack;
 
 	/*struct QueryNode
 	{
@@ -131,16 +274,46 @@ private:
 		QueryNode& operator=(const QueryNode&);
 	};*/
 
-	std::queue<SceneNode*> queryQueue;
+	/// Issued query, multi-query uses query of its first node
+	struct QueryEntry
+	{
+		size_t node;
+		/// range of multi-query nodes in multiQueryNodes, count is 1 for single node query
+		size_t first;
+		size_t count;
+	};
+
+	/// issued queries
+	RingBuffer<QueryEntry> queryQueue;
+	/// nodes of multi-queries issued in current frame
+	std::vector<size_t> multiQueryNodes;
+	/// nodes of multi-query which returned visible, they are queried again one by one
+	std::vector<size_t> splitQueue;
+	/// previously invisible nodes waiting for query, issued when batch is full
+	std::vector<size_t> invisibleQueue;
+	/// drawn previously visible nodes waiting for query, issued while waiting for results
+	std::vector<size_t> visibleQueue;
+	size_t m_queryBatchSize;
+	uint32_t m_assumedVisibleFrames;
+	/// spreads queries of newly visible leafs over frames
+	std::minstd_rand m_random;
 	uint32_t m_frameID;
+	/// Incremented by each pass over scene, used to draw every object once per pass
+	uint32_t m_passID;
+	/// Pass id of last forward pass, 0 before first frame
+	uint32_t m_lastForwardPass;
 };
 
 class ShadowMap
 {
 public:
-	ShadowMap(size_t size, std::shared_ptr<ShaderProgram> shader);
+	/// Creates depth texture array with layer of given size for each cascade
+	ShadowMap(size_t size, size_t numCascades, std::shared_ptr<ShaderProgram> shader);
 	~ShadowMap();
 
+	/// Attaches layer of cascade as fbo depth buffer
+	void setCascade(size_t cascade);
+
 	GLuint fbo() {
 		return m_fbo;
 	}
@@ -153,6 +326,10 @@ public:
 		return m_size;
 	}
 
+	size_t numCascades() const {
+		return m_numCascades;
+	}
+
 	gl::ShaderProgram* shader() {
 		return m_shader.get();
 	}
@@ -161,6 +338,7 @@ private:
 	ShadowMap& operator=(const ShadowMap&);
 
 	size_t m_size;
+	size_t m_numCascades;
 	std::shared_ptr<ShaderProgram> m_shader;
 
 	GLuint m_fbo;
@@ -7,10 +7,16 @@
 
 #include "Scene.h"
 #include "BaseSceneObject.h"
+#include "HlodProxy.h"
 #include "Logging.h"
+#include "MappedFile.h"
 
 #include <SDL.h>
 
+#include <fstream>
+#include <cstring>
+#include <algorithm>
+
 double getTime() {
 	static uint64_t freq;
 	static bool first = true;
@@ -28,29 +34,569 @@ void Scene::changeRenderer(gl::Renderer* renderer) {
 	for (auto& node : m_objects) {
 		node->sceneRendererChanged();
 	}
+	for (auto& node : m_dynamicObjects) {
+		if (node)
+			node->sceneRendererChanged();
+	}
+	for (auto& proxy : m_hlodProxies) {
+		if (proxy)
+			proxy->sceneRendererChanged();
+	}
+}
+
+void Scene::addObject(std::shared_ptr<BaseSceneObject> object) {
+	if (!object || object->m_scene)
+		throw std::runtime_error("Scene::addObject object is already in scene");
+
+	size_t slot;
+	if (!m_freeDynamicSlots.empty()) {
+		slot = m_freeDynamicSlots.back();
+		m_freeDynamicSlots.pop_back();
+	} else {
+		slot = m_dynamicObjects.size();
+		m_dynamicObjects.push_back(nullptr);
+	}
+
+	object->addedToScene(this);
+	m_renderer->registerSceneObject(object.get());
+	object->m_sceneIndex = slot;
+	object->m_instanceIndex = BaseSceneObject::NO_INSTANCE;
+	object->m_dynamicProxy = m_dynamicBvh.insert(object->boundingBox(), slot);
+	m_dynamicObjects[slot] = std::move(object);
+}
+
+void Scene::removeObject(BaseSceneObject* object) {
+	if (object->m_scene != this || object->m_dynamicProxy == DynamicBVH::NULL_NODE)
+		throw std::runtime_error("Scene::removeObject object was not added by addObject");
+
+	m_dynamicBvh.remove(object->m_dynamicProxy);
+	m_renderer->unregisterSceneObject(object);
+	object->removedFromScene();
+	object->m_dynamicProxy = DynamicBVH::NULL_NODE;
+
+	// object can be destroyed by releasing its slot
+	size_t slot = object->m_sceneIndex;
+	m_freeDynamicSlots.push_back(slot);
+	m_dynamicObjects[slot] = nullptr;
 }
 
 void Scene::setStaticGeometry(std::vector<std::shared_ptr<BaseSceneObject>> objects) {
 	m_objects = std::move(objects);
+
+	volatile double t1 = getTime();
+	m_bvh = std::unique_ptr<BVH>(BVH::build(m_objects.begin(), m_objects.end(), m_bvhParams));
+	volatile double t2 = getTime();
+
+	LOG(INFO) << "Building BVH took: " << (t2 - t1) * 1000 << " ms using " 
+		<< m_bvh->buildThreads() << " thread(s)";
+
+	initStaticGeometry();
+}
+
+namespace {
+
+struct SceneFileHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t leafSize;
+	uint64_t numObjects;
+	uint64_t numNodes;
+	uint64_t nodesOffset;
+	uint64_t objectsOffset;
+	/// object references of leafs, 0 when BVH was built without spatial splits
+	uint64_t numReferences;
+	uint64_t referencesOffset;
+	/// hash of build parameters BVH was built with
+	uint64_t paramsHash;
+};
+
+const char SCENE_FILE_MAGIC[8] = { 'S', 'M', 'S', 'C', 'E', 'N', 'E', '\0' };
+const uint32_t SCENE_FILE_VERSION = 3;
+/// nodes start at cache line so mapped nodes keep their alignment
+const uint64_t SCENE_FILE_NODES_OFFSET = 128;
+
+static_assert(sizeof(SceneFileHeader) <= SCENE_FILE_NODES_OFFSET, "Scene file header does not fit before nodes");
+static_assert(sizeof(BVH::CompactNode) == 32, "Compact BVH node has unexpected size");
+static_assert(sizeof(Scene::StoredObject) == 96, "Stored scene object has unexpected size");
+
+/// FNV-1a hash of build parameters which shape the tree, thread count and node layout do not
+uint64_t buildParamsHash(const BVH::BuildParams& params) {
+	uint64_t hash = 14695981039346656037ull;
+	auto add = [&hash] (uint64_t value) {
+		for (int i = 0; i < 8; ++i) {
+			hash ^= (value >> (i * 8)) & 0xff;
+			hash *= 1099511628211ull;
+		}
+	};
+	auto addFloat = [&add] (float value) {
+		uint32_t bits;
+		std::memcpy(&bits, &value, sizeof(bits));
+		add(bits);
+	};
+
+	add(static_cast<uint64_t>(params.method));
+	add(params.leafSize);
+	add(params.numBins);
+	addFloat(params.traversalCost);
+	addFloat(params.intersectionCost);
+	add(static_cast<uint64_t>(params.mortonBits));
+	add(static_cast<uint64_t>(params.sahClusterBits));
+	addFloat(params.spatialSplitAlpha);
+	addFloat(params.maxDuplication);
+	add(params.treeletSize);
+	add(params.treeletIterations);
+	return hash;
+}
+
+/// Checks that count items of given size starting at offset lie inside file, without overflow
+bool fitsInFile(uint64_t offset, uint64_t count, uint64_t itemSize, uint64_t fileSize) {
+	return offset <= fileSize && count <= (fileSize - offset) / itemSize;
+}
+
+}
+
+void Scene::saveStaticGeometry(const std::string& path) const {
+	if (!m_bvh)
+		throw std::runtime_error("Scene::saveStaticGeometry scene has no static geometry");
+
+	BVH::CompactNodeArray nodes = m_bvh->toCompactNodes();
+
+	SceneFileHeader header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, SCENE_FILE_MAGIC, sizeof(header.magic));
+	header.version = SCENE_FILE_VERSION;
+	header.leafSize = static_cast<uint32_t>(m_bvhParams.leafSize);
+	header.numObjects = m_objects.size();
+	header.numNodes = nodes.size();
+	header.nodesOffset = SCENE_FILE_NODES_OFFSET;
+	header.objectsOffset = header.nodesOffset + header.numNodes * sizeof(BVH::CompactNode);
+	header.numReferences = m_bvh->references().size();
+	header.referencesOffset = header.objectsOffset + header.numObjects * sizeof(StoredObject);
+	header.paramsHash = buildParamsHash(m_bvhParams);
+
+	// objects are stored in BVH order so leafs can index them directly or through references
+	std::vector<StoredObject> objects(m_objects.size());
+	for (size_t i = 0; i < m_objects.size(); ++i) {
+		BoundingBox bbox = m_objects[i]->boundingBox();
+		StoredObject& stored = objects[i];
+		stored.model = m_objects[i]->modelMatrix();
+		stored.min = bbox.min();
+		stored.max = bbox.max();
+		stored.type = m_objects[i]->typeId();
+		stored.reserved = 0;
+	}
+
+	std::vector<uint32_t> references(m_bvh->references().begin(), m_bvh->references().end());
+
+	std::ofstream file(path, std::ios::binary | std::ios::trunc);
+	if (!file)
+		throw std::runtime_error("Scene::saveStaticGeometry unable to open " + path);
+
+	char padding[SCENE_FILE_NODES_OFFSET] = { 0 };
+	file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	file.write(padding, SCENE_FILE_NODES_OFFSET - sizeof(header));
+	file.write(reinterpret_cast<const char*>(nodes.data()), nodes.size() * sizeof(BVH::CompactNode));
+	file.write(reinterpret_cast<const char*>(objects.data()), objects.size() * sizeof(StoredObject));
+	file.write(reinterpret_cast<const char*>(references.data()), references.size() * sizeof(uint32_t));
+	if (!file)
+		throw std::runtime_error("Scene::saveStaticGeometry unable to write " + path);
+}
+
+bool Scene::loadStaticGeometry(const std::string& path, const ObjectFactory& factory) {
+	if (!MappedFile::exists(path))
+		return false;
+
+	volatile double t1 = getTime();
+	auto file = std::make_shared<MappedFile>(path);
+
+	const SceneFileHeader* header = reinterpret_cast<const SceneFileHeader*>(file->data());
+	if (file->size() < sizeof(SceneFileHeader) 
+			|| std::memcmp(header->magic, SCENE_FILE_MAGIC, sizeof(header->magic)) != 0
+			|| header->version != SCENE_FILE_VERSION) {
+		LOG(WARNING) << "Ignoring scene file " << path << ": unknown format";
+		return false;
+	}
+
+	// cached scene is valid only for BVH built the same way as it would be now
+	if (header->paramsHash != buildParamsHash(m_bvhParams)) {
+		LOG(INFO) << "Ignoring scene file " << path << ": built with different BVH parameters";
+		return false;
+	}
+
+	// counts are checked against remaining size so corrupted ones cannot overflow past it
+	uint64_t fileSize = file->size();
+	if (header->numNodes == 0 || header->nodesOffset % sizeof(BVH::CompactNode) != 0 
+			|| !fitsInFile(header->nodesOffset, header->numNodes, sizeof(BVH::CompactNode), fileSize)
+			|| !fitsInFile(header->objectsOffset, header->numObjects, sizeof(StoredObject), fileSize)
+			|| !fitsInFile(header->referencesOffset, header->numReferences, sizeof(uint32_t), fileSize)) {
+		LOG(WARNING) << "Ignoring scene file " << path << ": file is truncated";
+		return false;
+	}
+
+	const uint32_t* storedReferences = reinterpret_cast<const uint32_t*>(file->data() + header->referencesOffset);
+	std::vector<size_t> references(storedReferences, storedReferences + header->numReferences);
+	for (size_t reference : references) {
+		if (reference >= header->numObjects) {
+			LOG(WARNING) << "Ignoring scene file " << path << ": invalid object reference";
+			return false;
+		}
+	}
+
+	// leafs index objects directly or through references
+	BVH::CompactNode* nodes = reinterpret_cast<BVH::CompactNode*>(file->data() + header->nodesOffset);
+	size_t numItems = static_cast<size_t>(references.empty() ? header->numObjects : header->numReferences);
+	if (!BVH::isValidCompactTree(nodes, static_cast<size_t>(header->numNodes), numItems)) {
+		LOG(WARNING) << "Ignoring scene file " << path << ": invalid BVH nodes";
+		return false;
+	}
+
+	const StoredObject* stored = reinterpret_cast<const StoredObject*>(file->data() + header->objectsOffset);
+	std::vector<std::shared_ptr<BaseSceneObject>> objects;
+	objects.reserve(static_cast<size_t>(header->numObjects));
+	for (size_t i = 0; i < header->numObjects; ++i) {
+		auto object = factory(stored[i]);
+		object->setModelMatrix(stored[i].model);
+		objects.push_back(std::move(object));
+	}
+
+	m_objects = std::move(objects);
+	m_bvh = std::unique_ptr<BVH>(BVH::fromCompactNodes(nodes, static_cast<size_t>(header->numNodes), 
+		header->leafSize, file, std::move(references)));
+	m_bvh->setLayout(m_bvhParams.layout);
+	volatile double t2 = getTime();
+
+	LOG(INFO) << "Loading scene " << path << " took: " << (t2 - t1) * 1000 << " ms";
+
+	initStaticGeometry();
+	return true;
+}
+
+void Scene::initStaticGeometry() {
 	for (auto& obj : m_objects) {
 		obj->addedToScene(this);
 		m_renderer->registerSceneObject(obj.get());
 	}
 
+	if (m_bvhOptimizationBudget > 0.0 && !m_bvh->canOptimize()) {
+		LOG(WARNING) << "BVH with compact layout or spatial splits cannot be optimized by rotations, optimization disabled";
+		m_bvhOptimizationBudget = 0.0;
+	}
+
+	m_nodes.reset(*m_bvh);
+	m_wideBvh = std::unique_ptr<SceneWideBVH>(new SceneWideBVH(*m_bvh));
+	LOG(INFO) << "BVH statistics: " << m_bvh->statistics(m_bvhParams.traversalCost, m_bvhParams.intersectionCost);
+
+	// objects without triangle mesh are not instanced, without instance BVH none of them is
+	m_instanceBvh.clear();
+	for (auto& obj : m_objects) {
+		Mesh* mesh = obj->mesh();
+		if (m_instanceBvhEnabled && mesh && MeshBVH::isSupported(*mesh))
+			obj->m_instanceIndex = m_instanceBvh.addInstance(*mesh, obj->modelMatrix());
+		else
+			obj->m_instanceIndex = BaseSceneObject::NO_INSTANCE;
+	}
+	if (m_instanceBvhEnabled) {
+		m_instanceBvh.update();
+		LOG(INFO) << "Two level BVH: " << m_instanceBvh.numInstances() << " instances of " 
+			<< m_instanceBvh.numMeshes() << " meshes, top level " << m_instanceBvh.topLevelMemorySize() 
+			<< " B, bottom levels " << m_instanceBvh.bottomLevelsMemorySize() << " B";
+	}
+
+	// build reordered objects so remember where each of them is
+	for (size_t i = 0; i < m_objects.size(); ++i)
+		m_objects[i]->m_sceneIndex = i;
+	m_movedObjects.clear();
+
+	buildHlodProxies();
+}
+
+void Scene::buildHlodProxies() {
+	releaseHlodProxies();
+	if (m_hlodMaxObjects == 0)
+		return;
+
+	volatile double t1 = getTime();
+
+	size_t numNodes = m_bvh->numNodes();
+	m_hlodProxies.resize(numNodes);
+	m_hlodStale.assign(numNodes, 0);
+	size_t numProxies = 0, numMerged = 0;
+	for (size_t node = 0; node < numNodes; ++node) {
+		size_t merged = createHlodProxy(node);
+		if (merged != 0) {
+			numProxies++;
+			numMerged += merged;
+		}
+	}
+
+	volatile double t2 = getTime();
+	LOG(INFO) << "Building " << numProxies << " HLOD proxies of " << numMerged << " objects took: " 
+		<< (t2 - t1) * 1000 << " ms";
+}
+
+void Scene::releaseHlodProxies() {
+	for (auto& proxy : m_hlodProxies) {
+		if (proxy) {
+			m_renderer->unregisterSceneObject(proxy.get());
+			proxy->removedFromScene();
+		}
+	}
+	m_hlodProxies.clear();
+	m_hlodStale.clear();
+	m_staleHlodNodes.clear();
+}
+
+size_t Scene::createHlodProxy(size_t node) {
+	if (m_bvh->isLeaf(node))
+		return 0;
+
+	// spatial splits can reference one object from more leafs of subtree
+	size_t count = 0;
+	m_hlodIndices.clear();
+	m_hlodStack.assign(1, node);
+	while (!m_hlodStack.empty()) {
+		size_t i = m_hlodStack.back();
+		m_hlodStack.pop_back();
+		if (m_bvh->isLeaf(i)) {
+			size_t first = m_bvh->firstObject(i);
+			for (size_t j = first; j < first + m_bvh->numObjects(i); ++j)
+				m_hlodIndices.push_back(m_bvh->objectIndex(j));
+			count += m_bvh->numObjects(i);
+			if (count > m_hlodMaxObjects)
+				return 0;
+		} else {
+			m_hlodStack.push_back(m_bvh->rightChild(i));
+			m_hlodStack.push_back(i + 1);
+		}
+	}
+	if (count < m_hlodMinObjects)
+		return 0;
+
+	std::sort(m_hlodIndices.begin(), m_hlodIndices.end());
+	m_hlodIndices.erase(std::unique(m_hlodIndices.begin(), m_hlodIndices.end()), m_hlodIndices.end());
+
+	m_hlodObjects.clear();
+	for (size_t index : m_hlodIndices)
+		m_hlodObjects.push_back(m_objects[index].get());
+
+	auto proxy = HlodProxy::create(m_hlodObjects, m_bvh->boundingBox(node));
+	if (!proxy)
+		return 0;
+
+	proxy->addedToScene(this);
+	m_renderer->registerSceneObject(proxy.get());
+	m_hlodProxies[node] = std::move(proxy);
+	return m_hlodObjects.size();
+}
+
+void Scene::invalidateHlodProxy(size_t node) {
+	if (m_hlodProxies.empty())
+		return;
+
+	auto& proxy = m_hlodProxies[node];
+	if (proxy) {
+		m_renderer->unregisterSceneObject(proxy.get());
+		proxy->removedFromScene();
+		proxy = nullptr;
+	}
+
+	if (!m_hlodStale[node]) {
+		m_hlodStale[node] = 1;
+		m_staleHlodNodes.push_back(node);
+	}
+}
+
+void Scene::rebuildStaleHlodProxies() {
+	if (m_staleHlodNodes.empty())
+		return;
+
 	volatile double t1 = getTime();
-	m_bvh = std::unique_ptr<BVH>(BVH::build(m_objects.begin(), m_objects.end()));
-	m_root = std::unique_ptr<SceneNode>(buildTree(0));
+
+	size_t numProxies = 0;
+	for (size_t node : m_staleHlodNodes) {
+		m_hlodStale[node] = 0;
+		if (createHlodProxy(node) != 0)
+			numProxies++;
+	}
+
 	volatile double t2 = getTime();
+	LOG(INFO) << "Rebuilding " << numProxies << " HLOD proxies of " << m_staleHlodNodes.size() 
+		<< " changed nodes took: " << (t2 - t1) * 1000 << " ms";
+	m_staleHlodNodes.clear();
+}
+
+size_t Scene::addTile(std::vector<std::shared_ptr<BaseSceneObject>> objects, std::unique_ptr<BVH> bvh) {
+	if (objects.empty())
+		return NO_TILE;
+	if (!bvh)
+		throw std::runtime_error("Scene::addTile tile has no BVH");
+
+	size_t id;
+	if (!m_freeTileSlots.empty()) {
+		id = m_freeTileSlots.back();
+		m_freeTileSlots.pop_back();
+	} else {
+		id = m_tiles.size();
+		m_tiles.push_back(nullptr);
+	}
+
+	Tile* tile = new Tile;
+	tile->objects = std::move(objects);
+	tile->bvh = std::move(bvh);
+	tile->numUploaded = 0;
+	tile->proxy = DynamicBVH::NULL_NODE;
+	m_tiles[id] = std::unique_ptr<Tile>(tile);
+
+	m_uploadQueue.push_back(id);
+	return id;
+}
+
+void Scene::removeTile(size_t id) {
+	if (id == NO_TILE)
+		return;
+
+	Tile& tile = *m_tiles[id];
+	if (tile.proxy != DynamicBVH::NULL_NODE)
+		m_tileBvh.remove(tile.proxy);
+	else
+		m_uploadQueue.erase(std::find(m_uploadQueue.begin(), m_uploadQueue.end(), id));
+
+	for (size_t i = 0; i < tile.numUploaded; ++i) {
+		BaseSceneObject* object = tile.objects[i].get();
+		m_renderer->unregisterSceneObject(object);
+		object->removedFromScene();
+		object->m_tile = NO_TILE;
+	}
+
+	m_tiles[id] = nullptr;
+	m_freeTileSlots.push_back(id);
+}
+
+void Scene::uploadTiles() {
+	size_t budget = m_uploadBudget;
+	while (budget > 0 && !m_uploadQueue.empty()) {
+		size_t id = m_uploadQueue.front();
+		Tile& tile = *m_tiles[id];
+		while (budget > 0 && tile.numUploaded < tile.objects.size()) {
+			BaseSceneObject* object = tile.objects[tile.numUploaded++].get();
+			object->addedToScene(this);
+			object->m_tile = id;
+			m_renderer->registerSceneObject(object);
+			budget--;
+		}
+
+		// tile is drawn only when it is complete
+		if (tile.numUploaded == tile.objects.size()) {
+			tile.proxy = m_tileBvh.insert(tile.bvh->boundingBox(0), id);
+			m_uploadQueue.pop_front();
+		}
+	}
+}
+
+void Scene::objectMoved(BaseSceneObject* object) {
+	// tile BVHs are built on background thread and never refitted
+	if (object->m_tile != NO_TILE)
+		return;
+
+	// dynamic objects are reinserted only when they leave their fat boxes
+	if (object->m_dynamicProxy != DynamicBVH::NULL_NODE) {
+		m_dynamicBvh.move(object->m_dynamicProxy, object->boundingBox());
+		return;
+	}
 
-	LOG(INFO) << "Building BVH took: " << (t2 - t1) * 1000 << " ms";
+	if (m_bvh)
+		m_movedObjects.push_back(object->m_sceneIndex);
+	if (object->m_instanceIndex != BaseSceneObject::NO_INSTANCE)
+		m_instanceBvh.setTransform(object->m_instanceIndex, object->modelMatrix());
 }
 
-SceneNode* Scene::buildTree(size_t iBvhNode, SceneNode* parent) {
-	BVH::Node* bvhNode = &m_bvh->nodes()[iBvhNode];
-	SceneNode* node = new SceneNode(this, bvhNode, parent);
-	if (bvhNode->rightOffset != 0) {
-		node->m_left = std::unique_ptr<SceneNode>(buildTree(iBvhNode + 1, node));
-		node->m_right = std::unique_ptr<SceneNode>(buildTree(iBvhNode + bvhNode->rightOffset, node));
+void Scene::update() {
+	uploadTiles();
+	if (m_instanceBvhEnabled)
+		m_instanceBvh.update();
+
+	bool bvhChanged = false;
+	if (!m_movedObjects.empty()) {
+		m_bvh->refit(m_objects.begin(), m_movedObjects);
+		m_movedObjects.clear();
+		m_bvhNeedsOptimization = true;
+		bvhChanged = true;
+
+		// proxies hold merged copies of objects, only subtrees containing moved objects are stale
+		for (size_t node : m_bvh->refittedNodes())
+			invalidateHlodProxy(node);
+	}
+
+	// refitted tree degrades so improve it little by little
+	if (m_bvhNeedsOptimization && m_bvhOptimizationBudget > 0.0) {
+		m_rotatedNodes.clear();
+		size_t rotations = m_bvh->optimize(m_objects.begin(), m_bvhOptimizationBudget, &m_rotatedNodes);
+		// budget may stop sweep anywhere, tree is done only after whole sweep without rotation
+		if (m_bvh->isOptimized())
+			m_bvhNeedsOptimization = false;
+
+		if (rotations != 0) {
+			// rotations moved only nodes and objects below rotated nodes, other nodes keep their state
+			for (size_t node : m_rotatedNodes) {
+				m_nodes.resetSubtree(*m_bvh, node);
+				size_t end = node + m_bvh->subtreeSize(node);
+				for (size_t i = node + 1; i < end; ++i)
+					invalidateHlodProxy(i);
+				size_t first = m_bvh->firstObject(node);
+				for (size_t i = first; i < first + m_bvh->numObjects(node); ++i)
+					m_objects[i]->m_sceneIndex = i;
+			}
+			bvhChanged = true;
+		}
+	}
+
+	// wide BVH is cheap to collapse again compared to patching it
+	if (bvhChanged)
+		m_wideBvh = std::unique_ptr<SceneWideBVH>(new SceneWideBVH(*m_bvh));
+
+	// proxies of changed subtrees are rebuilt once objects stop moving
+	if (!bvhChanged)
+		rebuildStaleHlodProxies();
+}
+
+void SceneNodes::reset(const BVH& bvh) {
+	size_t numNodes = bvh.numNodes();
+	if (numNodes > NO_PARENT)
+		throw std::runtime_error("SceneNodes::reset BVH has too many nodes");
+
+	// previous visibility is unknown, nodes start visible but not visited
+	m_parents.assign(numNodes, static_cast<uint32_t>(NO_PARENT));
+	m_visible.assign(numNodes, 1);
+	m_lastVisited.assign(numNodes, 0);
+	m_invisibleFrames.assign(numNodes, 0);
+	m_nextQuery.assign(numNodes, 0);
+	m_usesProxy.assign(numNodes, 0);
+	m_queries.resize(numNodes);
+
+	for (size_t i = 0; i < numNodes; ++i) {
+		if (!bvh.isLeaf(i)) {
+			m_parents[i + 1] = static_cast<uint32_t>(i);
+			m_parents[bvh.rightChild(i)] = static_cast<uint32_t>(i);
+		}
+	}
+}
+
+void SceneNodes::resetSubtree(const BVH& bvh, size_t node) {
+	// rotated node covers the same objects, only nodes below it were rearranged
+	size_t end = node + bvh.subtreeSize(node);
+	for (size_t i = node + 1; i < end; ++i) {
+		m_visible[i] = 1;
+		m_lastVisited[i] = 0;
+		m_invisibleFrames[i] = 0;
+		m_nextQuery[i] = 0;
+		m_usesProxy[i] = 0;
+	}
+
+	for (size_t i = node; i < end; ++i) {
+		if (!bvh.isLeaf(i)) {
+			m_parents[i + 1] = static_cast<uint32_t>(i);
+			m_parents[bvh.rightChild(i)] = static_cast<uint32_t>(i);
+		}
 	}
-	return node;
 }
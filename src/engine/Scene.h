@@ -11,12 +11,100 @@
 #include "Renderer.h"
 #include "Query.h"
 #include "BVH.h"
+#include "WideBVH.h"
+#include "TwoLevelBVH.h"
+#include "DynamicBVH.h"
 
 #include <memory>
 #include <vector>
+#include <string>
+#include <functional>
+#include <deque>
 
 class BaseSceneObject;
-class SceneNode;
+class HlodProxy;
+
+/**
+ * Occlusion culling state of BVH nodes. Every property is stored in its own
+ * array indexed by BVH node index, so culling streams through memory instead
+ * of chasing pointers. Tree structure is read directly from BVH.
+ */
+class SceneNodes
+{
+public:
+	/// Parent index of root node
+	static const uint32_t NO_PARENT = 0xFFFFFFFF;
+
+	/// Resizes arrays for nodes of BVH, links parents and resets visibility
+	void reset(const BVH& bvh);
+
+	/// Relinks nodes below given node after BVH rotated its subtree and resets their visibility
+	void resetSubtree(const BVH& bvh, size_t node);
+
+	size_t size() const {
+		return m_parents.size();
+	}
+
+	uint32_t parent(size_t i) const {
+		return m_parents[i];
+	}
+
+	bool isVisible(size_t i) const {
+		return m_visible[i] != 0;
+	}
+
+	void setVisibility(size_t i, bool visible) {
+		m_visible[i] = visible ? 1 : 0;
+	}
+
+	uint32_t lastVisited(size_t i) const {
+		return m_lastVisited[i];
+	}
+
+	void setLastVisited(size_t i, uint32_t val) {
+		m_lastVisited[i] = val;
+	}
+
+	/// Gets number of consecutive frames in which node was found invisible, 0 for visible or unknown
+	uint32_t invisibleFrames(size_t i) const {
+		return m_invisibleFrames[i];
+	}
+
+	void setInvisibleFrames(size_t i, uint32_t frames) {
+		m_invisibleFrames[i] = frames;
+	}
+
+	/// Gets frame in which visible node is queried again, until then it is assumed visible
+	uint32_t nextQuery(size_t i) const {
+		return m_nextQuery[i];
+	}
+
+	void setNextQuery(size_t i, uint32_t frame) {
+		m_nextQuery[i] = frame;
+	}
+
+	/// Checks if node was drawn by its HLOD proxy instead of its children when it was last visited
+	bool usesProxy(size_t i) const {
+		return m_usesProxy[i] != 0;
+	}
+
+	void setUsesProxy(size_t i, bool usesProxy) {
+		m_usesProxy[i] = usesProxy ? 1 : 0;
+	}
+
+	/// Gets occlusion queries, node uses query with its index
+	gl::QueryArray& queries() {
+		return m_queries;
+	}
+private:
+	std::vector<uint32_t> m_parents;
+	std::vector<uint8_t> m_visible;
+	std::vector<uint32_t> m_lastVisited;
+	std::vector<uint32_t> m_invisibleFrames;
+	std::vector<uint32_t> m_nextQuery;
+	std::vector<uint8_t> m_usesProxy;
+	gl::QueryArray m_queries;
+};
 
 /**
  * Scene contains nodes which are renderable objects.
@@ -24,7 +112,10 @@ class SceneNode;
 class Scene
 {
 public:
-	explicit Scene(gl::Renderer* renderer) : m_renderer(renderer) {
+	explicit Scene(gl::Renderer* renderer) 
+		: m_renderer(renderer), m_tileBvh(0.0f), m_uploadBudget(DEFAULT_UPLOAD_BUDGET), 
+		m_bvhOptimizationBudget(0.0), m_bvhNeedsOptimization(false), m_hlodMinObjects(DEFAULT_HLOD_MIN_OBJECTS),
+		m_hlodMaxObjects(DEFAULT_HLOD_MAX_OBJECTS), m_instanceBvhEnabled(false) {
 	}
 
 	gl::Renderer* renderer() {
@@ -34,89 +125,249 @@ public:
 	/// Change renderer which scene is bound to.
 	void changeRenderer(gl::Renderer* renderer);
 
-	void setStaticGeometry(std::vector<std::shared_ptr<BaseSceneObject>> nodes);
+	/// Sets parameters used when BVH over static geometry is built.
+	void setBvhBuildParams(const BVH::BuildParams& params) {
+		m_bvhParams = params;
+	}
 
-	SceneNode* rootNode() {
-		return m_root.get();
+	const BVH::BuildParams& bvhBuildParams() const {
+		return m_bvhParams;
 	}
-private:
-	Scene(const Scene&);
-	Scene& operator=(Scene);
 
-	SceneNode* buildTree(size_t iBvhNode, SceneNode* parent = nullptr);
+	void setStaticGeometry(std::vector<std::shared_ptr<BaseSceneObject>> nodes);
 
-	friend class SceneNode;
+	/**
+	 * Adds object at runtime. It is kept in dynamic BVH with enlarged bounds
+	 * so it can move and be removed without rebuilding static geometry.
+	 * @throw std::runtime_error when object already is in some scene
+	 */
+	void addObject(std::shared_ptr<BaseSceneObject> object);
 
-	gl::Renderer* m_renderer;
-	std::vector<std::shared_ptr<BaseSceneObject>> m_objects;
-	std::unique_ptr<BVH> m_bvh;
-	std::unique_ptr<SceneNode> m_root;
-};
+	/**
+	 * Removes object added by addObject. Object is unregistered from renderer
+	 * and its GPU resources are released.
+	 * @throw std::runtime_error when object was not added by addObject
+	 */
+	void removeObject(BaseSceneObject* object);
 
-class SceneNode
-{
-public:
-	bool isLeaf() const {
-		return m_bvhNode->rightOffset == 0;
+	/// Tile id of tiles without objects
+	static const size_t NO_TILE = static_cast<size_t>(-1);
+
+	/// Part of streamed world with its own BVH, objects of tile cannot move
+	struct Tile
+	{
+		/// objects in order given by BVH
+		std::vector<std::shared_ptr<BaseSceneObject>> objects;
+		std::unique_ptr<BVH> bvh;
+		/// number of objects already uploaded to GPU
+		size_t numUploaded;
+		/// proxy in tile BVH, DynamicBVH::NULL_NODE until all objects are uploaded
+		uint32_t proxy;
+	};
+
+	/**
+	 * Adds tile of streamed world. Objects are uploaded to GPU gradually by update,
+	 * tile is inserted to tile BVH and drawn after all of them are uploaded.
+	 * @param bvh BVH built over objects, objects have to be in order given by build
+	 * @return tile id used to remove tile, NO_TILE when there are no objects
+	 */
+	size_t addTile(std::vector<std::shared_ptr<BaseSceneObject>> objects, std::unique_ptr<BVH> bvh);
+
+	/// Removes tile and releases GPU resources of its objects
+	void removeTile(size_t id);
+
+	/// Sets maximum number of objects of tiles uploaded to GPU in one update
+	void setUploadBudget(size_t objectsPerFrame) {
+		m_uploadBudget = objectsPerFrame;
 	}
 
-	size_t numObjects() const {
-		return m_bvhNode->numObjects;
+	/// Gets top level BVH over uploaded tiles, proxy user data are tile ids
+	const DynamicBVH& tileBvh() const {
+		return m_tileBvh;
 	}
 
-	BaseSceneObject* object(size_t i) {
-		return m_scene->m_objects[m_bvhNode->start + i].get();
+	const Tile& tile(size_t id) const {
+		return *m_tiles[id];
 	}
 
-	BoundingBox boundingBox() const {
-		return m_bvhNode->bbox;
+	/// Object as stored in scene file
+	struct StoredObject
+	{
+		glm::mat4 model;
+		glm::vec3 min;
+		/// type given by BaseSceneObject::typeId()
+		uint32_t type;
+		glm::vec3 max;
+		uint32_t reserved;
+	};
+
+	/// Creates object of stored type, model matrix is set by scene afterwards.
+	typedef std::function<std::shared_ptr<BaseSceneObject>(const StoredObject&)> ObjectFactory;
+
+	/**
+	 * Saves static geometry together with its BVH to binary file.
+	 * @throw std::runtime_error when file cannot be written
+	 */
+	void saveStaticGeometry(const std::string& path) const;
+
+	/**
+	 * Loads static geometry saved by saveStaticGeometry. File is mapped to memory
+	 * and BVH nodes are used in place so nothing has to be built.
+	 * @return false when file does not exist, is not valid scene file or its BVH
+	 * was built with different build parameters than current ones
+	 */
+	bool loadStaticGeometry(const std::string& path, const ObjectFactory& factory);
+
+	/// Called by object when its transform changes, BVH is refitted on next update.
+	void objectMoved(BaseSceneObject* object);
+
+	/**
+	 * Sets time in milliseconds which can be spent each frame by optimizing
+	 * BVH with tree rotations after objects moved. 0 disables optimization.
+	 * Compact BVH and BVH with spatial splits cannot be rotated, their budget is dropped with warning.
+	 */
+	void setBvhOptimizationBudget(double ms) {
+		m_bvhOptimizationBudget = ms;
 	}
 
-	SceneNode* leftChild() const {
-		return m_left.get();
+	/**
+	 * Per-frame update. Refits BVH and top level of enabled instance BVH around objects that moved
+	 * since last update and uploads part of waiting tile objects.
+	 */
+	void update();
+
+	/**
+	 * Sets which BVH subtrees get HLOD proxy by number of objects they reference.
+	 * Proxies are built with static geometry, 0 maximum disables them.
+	 */
+	void setHlodObjectRange(size_t minObjects, size_t maxObjects) {
+		m_hlodMinObjects = minObjects;
+		m_hlodMaxObjects = maxObjects;
 	}
 
-	SceneNode* rightChild() const {
-		return m_right.get();
+	/**
+	 * Gets merged proxy of BVH node, null when node has none. Proxies of subtrees whose
+	 * static objects move are dropped and built again in first update after they stop.
+	 */
+	HlodProxy* hlodProxy(size_t node) {
+		return m_hlodProxies.empty() ? nullptr : m_hlodProxies[node].get();
 	}
 
-	SceneNode* parent() const {
-		return m_parent;
+	/// Gets occlusion culling state of BVH nodes
+	SceneNodes& nodes() {
+		return m_nodes;
 	}
 
-	bool isVisible() const {
-		return m_visible;
+	/// Gets BVH over static geometry
+	const BVH* bvh() const {
+		return m_bvh.get();
 	}
 
-	void setVisibility(bool visible) {
-		m_visible = visible;
+	typedef WideBVH<NATIVE_WIDE_BVH_WIDTH> SceneWideBVH;
+
+	/// Gets wide BVH collapsed from BVH over static geometry, used for fast frustum culling
+	const SceneWideBVH* wideBvh() const {
+		return m_wideBvh.get();
 	}
 
-	uint32_t lastVisited() const {
-		return m_lastVisited;
+	/**
+	 * Gets static object referenced by BVH leafs at given position. Spatial splits
+	 * can reference one object from more leafs so it can be returned more times.
+	 */
+	BaseSceneObject* object(size_t i) {
+		return m_objects[m_bvh->objectIndex(i)].get();
+	}
+
+	/// Gets BVH over objects added by addObject
+	const DynamicBVH& dynamicBvh() const {
+		return m_dynamicBvh;
 	}
 
-	void setLastVisited(uint32_t val) {
-		m_lastVisited = val;
+	/// Gets object added by addObject, slot is user data of its dynamic BVH proxy
+	BaseSceneObject* dynamicObject(size_t slot) {
+		return m_dynamicObjects[slot].get();
 	}
 
-	gl::Query& query() {
-		return m_query;
+	/**
+	 * Enables two level BVH over instanced meshes of static objects. Renderer culls by scene BVH,
+	 * so instance BVH is built and kept up to date only when some user queries it.
+	 * Takes effect when static geometry is set or loaded.
+	 */
+	void setInstanceBvhEnabled(bool enabled) {
+		m_instanceBvhEnabled = enabled;
+	}
+
+	/**
+	 * Gets two level BVH over instanced meshes of static objects, empty unless enabled. Its top level
+	 * follows moving objects, bottom levels over triangles are shared by objects with same mesh.
+	 */
+	const TwoLevelBVH& instanceBvh() const {
+		return m_instanceBvh;
 	}
 private:
-	SceneNode(Scene* scene, BVH::Node* node, SceneNode* parent)
-		: m_scene(scene), m_bvhNode(node), m_parent(parent), m_visible(true), m_lastVisited(0) { }
+	Scene(const Scene&);
+	Scene& operator=(Scene);
+
+	/// Objects uploaded in one update by default, registration creates buffers on GPU
+	static const size_t DEFAULT_UPLOAD_BUDGET = 64;
+	/// Default range of object counts of subtrees with HLOD proxies
+	static const size_t DEFAULT_HLOD_MIN_OBJECTS = 16;
+	static const size_t DEFAULT_HLOD_MAX_OBJECTS = 256;
 
-	friend class Scene;
+	/// Registers objects to renderer and creates culling state of BVH nodes
+	void initStaticGeometry();
 
-	Scene* m_scene;
-	BVH::Node* m_bvhNode;
-	SceneNode* m_parent;
-	std::unique_ptr<SceneNode> m_left, m_right;
+	/// Registers waiting tile objects to renderer within upload budget
+	void uploadTiles();
 
-	bool m_visible;
-	uint32_t m_lastVisited;
-	gl::Query m_query;
+	/// Merges objects of selected BVH subtrees to proxies and registers them to renderer
+	void buildHlodProxies();
+	void releaseHlodProxies();
+	/**
+	 * Creates proxy of node when its subtree references allowed number of objects.
+	 * @return number of merged objects, 0 when node got no proxy
+	 */
+	size_t createHlodProxy(size_t node);
+	/// Releases proxy of node whose subtree changed and remembers node for rebuild
+	void invalidateHlodProxy(size_t node);
+	/// Creates proxies of nodes invalidated since last rebuild
+	void rebuildStaleHlodProxies();
+
+	gl::Renderer* m_renderer;
+	std::vector<std::shared_ptr<BaseSceneObject>> m_objects;
+	std::unique_ptr<BVH> m_bvh;
+	std::unique_ptr<SceneWideBVH> m_wideBvh;
+	TwoLevelBVH m_instanceBvh;
+	bool m_instanceBvhEnabled;
+	/// objects added by addObject, removed ones leave empty slot for reuse
+	std::vector<std::shared_ptr<BaseSceneObject>> m_dynamicObjects;
+	std::vector<size_t> m_freeDynamicSlots;
+	DynamicBVH m_dynamicBvh;
+	/// streamed tiles, removed ones leave empty slot for reuse
+	std::vector<std::unique_ptr<Tile>> m_tiles;
+	std::vector<size_t> m_freeTileSlots;
+	/// tiles whose objects are being uploaded, first one is uploaded first
+	std::deque<size_t> m_uploadQueue;
+	DynamicBVH m_tileBvh;
+	size_t m_uploadBudget;
+	BVH::BuildParams m_bvhParams;
+	std::vector<size_t> m_movedObjects;
+	double m_bvhOptimizationBudget;
+	bool m_bvhNeedsOptimization;
+	/// nodes rotated by last optimization step
+	std::vector<size_t> m_rotatedNodes;
+	SceneNodes m_nodes;
+	size_t m_hlodMinObjects;
+	size_t m_hlodMaxObjects;
+	/// proxy of each BVH node, null for nodes without proxy
+	std::vector<std::shared_ptr<HlodProxy>> m_hlodProxies;
+	/// nodes waiting for rebuild of their proxy, flag of each node tells if it is in list
+	std::vector<size_t> m_staleHlodNodes;
+	std::vector<uint8_t> m_hlodStale;
+	/// scratch of proxy creation
+	std::vector<size_t> m_hlodStack;
+	std::vector<size_t> m_hlodIndices;
+	std::vector<BaseSceneObject*> m_hlodObjects;
 };
 
 #endif // !SCENE_H
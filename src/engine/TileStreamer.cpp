@@ -0,0 +1,178 @@
+/**
+ * @file TileStreamer.cpp
+ *
+ * @author Jan Duek <xdusek17@stud.fit.vutbr.cz>
+ * @date 2013
+ */
+
+#include "TileStreamer.h"
+#include "Scene.h"
+#include "BaseSceneObject.h"
+#include "Logging.h"
+
+#include <algorithm>
+#include <cmath>
+
+TileStreamer::TileStreamer(Scene* scene, float tileSize, TileLoader loader)
+	: m_scene(scene), m_tileSize(tileSize), m_loader(std::move(loader)), m_loadRadius(2.0f * tileSize),
+	m_unloadRadius(3.0f * tileSize), m_numResident(0), m_quit(false) {
+
+	// tiles are small, one thread is enough and it leaves cores to rendering
+	m_params.method = BVH::SplitMethod::BinnedSAH;
+	m_params.numThreads = 1;
+
+	m_thread = std::thread(&TileStreamer::worker, this);
+}
+
+TileStreamer::~TileStreamer() {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_quit = true;
+	}
+	m_condition.notify_all();
+	m_thread.join();
+
+	for (auto& tile : m_tiles) {
+		if (tile.second.resident)
+			m_scene->removeTile(tile.second.sceneTile);
+	}
+}
+
+void TileStreamer::setRadius(float loadRadius, float unloadRadius) {
+	m_loadRadius = loadRadius;
+	m_unloadRadius = std::max(loadRadius, unloadRadius);
+}
+
+void TileStreamer::setBuildParams(const BVH::BuildParams& params) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_params = params;
+}
+
+void TileStreamer::update(const glm::vec3& cameraPosition) {
+	std::vector<LoadedTile> loaded;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		loaded.swap(m_loaded);
+	}
+
+	// hand loaded tiles to scene unless camera went away meanwhile, tile cancelled during
+	// its load and requested again is loaded twice and only first result is used
+	for (auto& tile : loaded) {
+		auto it = m_tiles.find(tile.key);
+		if (it == m_tiles.end() || it->second.resident)
+			continue;
+
+		if (tileDistance(tile.key, cameraPosition) > m_unloadRadius) {
+			m_tiles.erase(it);
+			continue;
+		}
+
+		it->second.sceneTile = m_scene->addTile(std::move(tile.objects), std::move(tile.bvh));
+		it->second.resident = true;
+		m_numResident++;
+	}
+
+	// evict distant tiles, pending ones are just forgotten and their result is dropped
+	bool cancelled = false;
+	for (auto it = m_tiles.begin(); it != m_tiles.end(); ) {
+		if (tileDistance(it->first, cameraPosition) <= m_unloadRadius) {
+			++it;
+			continue;
+		}
+
+		if (it->second.resident) {
+			m_scene->removeTile(it->second.sceneTile);
+			m_numResident--;
+		} else {
+			cancelled = true;
+		}
+		it = m_tiles.erase(it);
+	}
+
+	// request missing tiles in load radius
+	int cx = static_cast<int>(std::floor(cameraPosition.x / m_tileSize));
+	int cy = static_cast<int>(std::floor(cameraPosition.y / m_tileSize));
+	int r = static_cast<int>(std::ceil(m_loadRadius / m_tileSize));
+	std::vector<uint64_t> requested;
+	for (int y = cy - r; y <= cy + r; ++y) {
+		for (int x = cx - r; x <= cx + r; ++x) {
+			uint64_t key = tileKey(x, y);
+			if (m_tiles.count(key) == 0 && tileDistance(key, cameraPosition) <= m_loadRadius) {
+				TileEntry entry = { false, Scene::NO_TILE };
+				m_tiles.insert(std::make_pair(key, entry));
+				requested.push_back(key);
+			}
+		}
+	}
+
+	if (requested.empty() && !cancelled)
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (cancelled) {
+			m_requests.erase(std::remove_if(m_requests.begin(), m_requests.end(), [this] (uint64_t key) {
+				return m_tiles.count(key) == 0;
+			}), m_requests.end());
+		}
+
+		// nearest tiles are loaded first
+		m_requests.insert(m_requests.end(), requested.begin(), requested.end());
+		std::sort(m_requests.begin(), m_requests.end(), [this, &cameraPosition] (uint64_t a, uint64_t b) {
+			return tileDistance(a, cameraPosition) < tileDistance(b, cameraPosition);
+		});
+	}
+	m_condition.notify_one();
+}
+
+void TileStreamer::worker() {
+	for (;;) {
+		uint64_t key;
+		BVH::BuildParams params;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_condition.wait(lock, [this] { return m_quit || !m_requests.empty(); });
+			if (m_quit)
+				return;
+
+			key = m_requests.front();
+			m_requests.pop_front();
+			params = m_params;
+		}
+
+		LoadedTile tile;
+		tile.key = key;
+		try {
+			int x, y;
+			tileCoords(key, x, y);
+			tile.objects = m_loader(x, y);
+			if (!tile.objects.empty())
+				tile.bvh = std::unique_ptr<BVH>(BVH::build(tile.objects.begin(), tile.objects.end(), params));
+		} catch (std::exception& e) {
+			// tile stays empty so it is not requested again and again
+			LOG(ERROR) << "TileStreamer::worker loading tile failed: " << e.what();
+			tile.objects.clear();
+			tile.bvh = nullptr;
+		}
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_loaded.push_back(std::move(tile));
+	}
+}
+
+uint64_t TileStreamer::tileKey(int x, int y) {
+	return (static_cast<uint64_t>(static_cast<uint32_t>(x)) << 32) | static_cast<uint32_t>(y);
+}
+
+void TileStreamer::tileCoords(uint64_t key, int& x, int& y) {
+	x = static_cast<int32_t>(static_cast<uint32_t>(key >> 32));
+	y = static_cast<int32_t>(static_cast<uint32_t>(key));
+}
+
+float TileStreamer::tileDistance(uint64_t key, const glm::vec3& p) const {
+	int x, y;
+	tileCoords(key, x, y);
+	float dx = (x + 0.5f) * m_tileSize - p.x;
+	float dy = (y + 0.5f) * m_tileSize - p.y;
+	return std::sqrt(dx * dx + dy * dy);
+}
@@ -0,0 +1,124 @@
+/**
+ * @file TileStreamer.h
+ *
+ * @author Jan Duek <xdusek17@stud.fit.vutbr.cz>
+ * @date 2013
+ */
+
+#ifndef TILE_STREAMER_H
+#define TILE_STREAMER_H
+
+#include "BVH.h"
+
+#include <glm/glm.hpp>
+
+#include <memory>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+
+class Scene;
+class BaseSceneObject;
+
+/**
+ * Streams world divided to square tiles in xy plane around camera. Objects of tile
+ * are created and BVH over them is built on background thread, scene then uploads
+ * them to GPU gradually. Tiles far from camera are evicted from scene.
+ */
+class TileStreamer
+{
+public:
+	/**
+	 * Creates objects of tile with given coordinates. It is called from background
+	 * thread so it must not use OpenGL nor scene.
+	 */
+	typedef std::function<std::vector<std::shared_ptr<BaseSceneObject>>(int x, int y)> TileLoader;
+
+	/**
+	 * Starts background thread loading tiles.
+	 * @param tileSize edge length of tile, tile x, y covers [x * tileSize, (x + 1) * tileSize)
+	 */
+	TileStreamer(Scene* scene, float tileSize, TileLoader loader);
+	/// Stops background thread and removes streamed tiles from scene
+	~TileStreamer();
+
+	/**
+	 * Sets distances of tile centers from camera. Tiles nearer than load radius are
+	 * loaded and tiles farther than unload radius are evicted, unload radius should be
+	 * greater so tiles at border are not loaded over and over again.
+	 */
+	void setRadius(float loadRadius, float unloadRadius);
+
+	/// Sets parameters of BVHs built over tiles
+	void setBuildParams(const BVH::BuildParams& params);
+
+	/**
+	 * Requests tiles around camera, hands loaded tiles to scene and evicts distant ones.
+	 * Call it every frame before Scene::update, it never waits for background thread.
+	 */
+	void update(const glm::vec3& cameraPosition);
+
+	/// Gets number of tiles handed to scene
+	size_t numResidentTiles() const {
+		return m_numResident;
+	}
+
+	/// Gets number of tiles waiting for load or being loaded
+	size_t numPendingTiles() const {
+		return m_tiles.size() - m_numResident;
+	}
+private:
+	TileStreamer(const TileStreamer&);
+	TileStreamer& operator=(TileStreamer);
+
+	struct LoadedTile
+	{
+		uint64_t key;
+		std::vector<std::shared_ptr<BaseSceneObject>> objects;
+		std::unique_ptr<BVH> bvh;
+	};
+
+	/// State of tile known to main thread
+	struct TileEntry
+	{
+		bool resident;
+		/// id of tile in scene
+		size_t sceneTile;
+	};
+
+	static uint64_t tileKey(int x, int y);
+	static void tileCoords(uint64_t key, int& x, int& y);
+	/// Distance of tile center from point in xy plane
+	float tileDistance(uint64_t key, const glm::vec3& p) const;
+
+	/// Loads requested tiles until streamer is destroyed
+	void worker();
+
+	Scene* m_scene;
+	float m_tileSize;
+	TileLoader m_loader;
+	float m_loadRadius;
+	float m_unloadRadius;
+	/// requested and resident tiles, used only by main thread
+	std::unordered_map<uint64_t, TileEntry> m_tiles;
+	size_t m_numResident;
+
+	// shared with background thread
+	std::mutex m_mutex;
+	std::condition_variable m_condition;
+	BVH::BuildParams m_params;
+	/// tiles waiting for load, nearest first
+	std::deque<uint64_t> m_requests;
+	std::vector<LoadedTile> m_loaded;
+	bool m_quit;
+
+	/// started last so everything it uses is initialized
+	std::thread m_thread;
+};
+
+#endif // !TILE_STREAMER_H
@@ -0,0 +1,192 @@
+/**
+ * @file TwoLevelBVH.cpp
+ *
+ * @author Jan Duek <xdusek17@stud.fit.vutbr.cz>
+ * @date 2013
+ */
+
+#include "TwoLevelBVH.h"
+
+#include <glm/gtc/swizzle.hpp>
+
+#include <algorithm>
+#include <stdexcept>
+
+/// Top level is rebuilt instead of refitted when more than this fraction of instances moved
+const float REBUILD_MOVED_FRACTION = 0.25f;
+
+static BVH::BuildParams defaultTopParams() {
+	BVH::BuildParams params;
+	params.method = BVH::SplitMethod::BinnedSAH;
+	params.leafSize = 2;
+	return params;
+}
+
+static BVH::BuildParams defaultBottomParams() {
+	BVH::BuildParams params;
+	params.method = BVH::SplitMethod::BinnedSAH;
+	params.leafSize = 4;
+	params.layout = BVH::NodeLayout::Compact;
+	return params;
+}
+
+bool MeshBVH::isSupported(const Mesh& mesh) {
+	if (!mesh.isValid())
+		return false;
+	if (mesh.primitiveType() != PrimitiveType::TriangleList && mesh.primitiveType() != PrimitiveType::TriangleStrip)
+		return false;
+
+	const VertexElement& position = mesh.vertexLayout()[0];
+	return position.type == VertexElementType::Float && position.numComponents >= 3;
+}
+
+MeshBVH::MeshBVH(const Mesh& mesh, const BVH::BuildParams& params) {
+	if (!isSupported(mesh))
+		throw std::runtime_error("MeshBVH::MeshBVH mesh has to be triangle list or strip with float positions");
+
+	std::vector<glm::vec3> positions = mesh.positions();
+	size_t numVertices = mesh.isIndexed() ? mesh.indices().size() : positions.size();
+	bool strip = mesh.primitiveType() == PrimitiveType::TriangleStrip;
+
+	size_t numTriangles;
+	if (strip)
+		numTriangles = numVertices >= 3 ? numVertices - 2 : 0;
+	else
+		numTriangles = numVertices / 3;
+	if (numTriangles == 0)
+		throw std::runtime_error("MeshBVH::MeshBVH mesh has no triangles");
+
+	PrimitiveArrays primitives(numTriangles);
+	for (size_t t = 0; t < numTriangles; ++t) {
+		size_t first = strip ? t : t * 3;
+		BoundingBox bbox;
+		for (size_t j = 0; j < 3; ++j) {
+			size_t vertex = mesh.isIndexed() ? mesh.indices()[first + j] : first + j;
+			if (vertex >= positions.size())
+				throw std::runtime_error("MeshBVH::MeshBVH index out of range");
+
+			if (j == 0)
+				bbox = BoundingBox(positions[vertex]);
+			else
+				bbox.expandToInclude(positions[vertex]);
+		}
+		primitives.set(t, bbox);
+	}
+
+	m_bvh = std::unique_ptr<BVH>(BVH::build(primitives, params, m_triangles));
+}
+
+TwoLevelBVH::TwoLevelBVH(const BVH::BuildParams& topParams, const BVH::BuildParams& bottomParams)
+	: m_topParams(topParams), m_bottomParams(bottomParams), m_needsRebuild(false) {
+}
+
+TwoLevelBVH::TwoLevelBVH()
+	: m_topParams(defaultTopParams()), m_bottomParams(defaultBottomParams()), m_needsRebuild(false) {
+}
+
+size_t TwoLevelBVH::addInstance(const Mesh& mesh, const glm::mat4& transform) {
+	auto& bottomLevel = m_meshes[&mesh];
+	if (!bottomLevel) {
+		try {
+			bottomLevel = std::unique_ptr<MeshBVH>(new MeshBVH(mesh, m_bottomParams));
+		} catch (...) {
+			m_meshes.erase(&mesh);
+			throw;
+		}
+	}
+
+	Instance instance;
+	instance.transform = transform;
+	instance.mesh = bottomLevel.get();
+	instance.bbox = transformBoundingBox(bottomLevel->boundingBox(), transform);
+	m_instances.push_back(instance);
+
+	// instances could reallocate so leaf pointers are invalid until rebuild
+	m_needsRebuild = true;
+	return m_instances.size() - 1;
+}
+
+void TwoLevelBVH::setTransform(size_t instance, const glm::mat4& transform) {
+	Instance& inst = m_instances[instance];
+	inst.transform = transform;
+	inst.bbox = transformBoundingBox(inst.mesh->boundingBox(), transform);
+
+	if (!m_needsRebuild)
+		m_moved.push_back(m_positions[instance]);
+}
+
+void TwoLevelBVH::clear() {
+	m_instances.clear();
+	m_meshes.clear();
+	m_topLevel = nullptr;
+	m_order.clear();
+	m_positions.clear();
+	m_leafInstances.clear();
+	m_moved.clear();
+	m_needsRebuild = false;
+}
+
+void TwoLevelBVH::update() {
+	// instance moved several times since last update counts once
+	std::sort(m_moved.begin(), m_moved.end());
+	m_moved.erase(std::unique(m_moved.begin(), m_moved.end()), m_moved.end());
+
+	if (m_needsRebuild || m_moved.size() > m_instances.size() * REBUILD_MOVED_FRACTION) {
+		rebuild();
+	} else if (!m_moved.empty()) {
+		m_topLevel->refit(m_leafInstances.begin(), m_moved);
+		m_moved.clear();
+	}
+}
+
+void TwoLevelBVH::rebuild() {
+	m_moved.clear();
+	m_needsRebuild = false;
+	if (m_instances.empty()) {
+		m_topLevel = nullptr;
+		return;
+	}
+
+	// top level needs only bounds of instances, triangles are never touched
+	PrimitiveArrays primitives(m_instances.size());
+	for (size_t i = 0; i < m_instances.size(); ++i)
+		primitives.set(i, m_instances[i].bbox, m_instances[i].centroid());
+	m_topLevel = std::unique_ptr<BVH>(BVH::build(primitives, m_topParams, m_order));
+
+	m_positions.resize(m_instances.size());
+	m_leafInstances.resize(m_instances.size());
+	for (size_t i = 0; i < m_order.size(); ++i) {
+		m_positions[m_order[i]] = i;
+		m_leafInstances[i] = &m_instances[m_order[i]];
+	}
+}
+
+size_t TwoLevelBVH::topLevelMemorySize() const {
+	size_t size = m_instances.size() * sizeof(Instance);
+	size += (m_order.size() + m_positions.size()) * sizeof(size_t) + m_leafInstances.size() * sizeof(const Instance*);
+	if (m_topLevel)
+		size += m_topLevel->nodesMemorySize();
+	return size;
+}
+
+size_t TwoLevelBVH::bottomLevelsMemorySize() const {
+	size_t size = 0;
+	for (const auto& mesh : m_meshes)
+		size += mesh.second->memorySize();
+	return size;
+}
+
+BoundingBox TwoLevelBVH::transformBoundingBox(const BoundingBox& bbox, const glm::mat4& m) {
+	BoundingBox result;
+	for (int i = 0; i < 8; ++i) {
+		glm::vec3 corner((i & 1) ? bbox.max().x : bbox.min().x,
+			(i & 2) ? bbox.max().y : bbox.min().y,
+			(i & 4) ? bbox.max().z : bbox.min().z);
+		glm::vec3 p = glm::swizzle<glm::X, glm::Y, glm::Z>(m * glm::vec4(corner, 1.0f));
+		if (i == 0)
+			result = BoundingBox(p);
+		else
+			result.expandToInclude(p);
+	}
+	return result;
+}
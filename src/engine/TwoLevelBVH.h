@@ -0,0 +1,192 @@
+/**
+ * @file TwoLevelBVH.h
+ *
+ * @author Jan Duek <xdusek17@stud.fit.vutbr.cz>
+ * @date 2013
+ */
+
+#ifndef TWO_LEVEL_BVH_H
+#define TWO_LEVEL_BVH_H
+
+#include "BVH.h"
+#include "Mesh.h"
+#include "Frustum.h"
+
+#include <glm/glm.hpp>
+
+#include <memory>
+#include <vector>
+#include <unordered_map>
+
+/**
+ * Bottom level of two level BVH. BVH over triangles of single mesh
+ * in its local space, it is built once and shared by all instances of mesh.
+ */
+class MeshBVH
+{
+public:
+	/**
+	 * Builds BVH over triangles of mesh.
+	 * @throw std::runtime_error when mesh is not supported
+	 */
+	explicit MeshBVH(const Mesh& mesh, const BVH::BuildParams& params);
+
+	/// Returns true if mesh is triangle list or strip with float positions
+	static bool isSupported(const Mesh& mesh);
+
+	const BVH& bvh() const {
+		return *m_bvh;
+	}
+
+	/// Gets index of triangle of mesh at given object position in leafs
+	size_t triangle(size_t i) const {
+		return m_triangles[m_bvh->objectIndex(i)];
+	}
+
+	size_t numTriangles() const {
+		return m_triangles.size();
+	}
+
+	/// Gets bounding box of whole mesh in its local space
+	BoundingBox boundingBox() const {
+		return m_bvh->boundingBox(0);
+	}
+
+	size_t memorySize() const {
+		return m_bvh->nodesMemorySize() + m_triangles.size() * sizeof(size_t);
+	}
+private:
+	std::unique_ptr<BVH> m_bvh;
+	std::vector<size_t> m_triangles;
+};
+
+/**
+ * Two level BVH over instanced meshes. Bottom levels are built once per mesh,
+ * top level is built over instances which are transforms referencing bottom levels.
+ * Moving instance changes only its bounds so top level is refitted or rebuilt
+ * cheaply without touching any triangles.
+ */
+class TwoLevelBVH
+{
+public:
+	struct Instance
+	{
+		glm::mat4 transform;
+		const MeshBVH* mesh;
+		/// bounds of transformed mesh in world space
+		BoundingBox bbox;
+
+		const BoundingBox& boundingBox() const {
+			return bbox;
+		}
+
+		glm::vec3 centroid() const {
+			return bbox.center();
+		}
+	};
+
+	/**
+	 * @param topParams parameters of top level built over instances
+	 * @param bottomParams parameters of bottom levels built over triangles of meshes
+	 */
+	TwoLevelBVH(const BVH::BuildParams& topParams, const BVH::BuildParams& bottomParams);
+	TwoLevelBVH();
+
+	/**
+	 * Adds instance of mesh, bottom level of mesh is built when it is instanced
+	 * for the first time. Mesh has to outlive this BVH. Top level is rebuilt on next update.
+	 * @return index of instance
+	 * @throw std::runtime_error when mesh is not supported by MeshBVH
+	 */
+	size_t addInstance(const Mesh& mesh, const glm::mat4& transform);
+
+	/// Moves instance, top level is updated on next update
+	void setTransform(size_t instance, const glm::mat4& transform);
+
+	/// Removes all instances and bottom levels
+	void clear();
+
+	/**
+	 * Brings top level up to date. Top level is rebuilt when instances were added
+	 * or large part of them moved, otherwise it is refitted around moved instances.
+	 */
+	void update();
+
+	/// Rebuilds top level over all instances
+	void rebuild();
+
+	/**
+	 * Finds instances intersecting frustum.
+	 * @param visitor functor called as visitor(instanceIndex) for each visible instance,
+	 * top level built with spatial splits can report one instance more times
+	 */
+	template <class Visitor>
+	void cullFrustum(const Frustum& frustum, Visitor visitor) const;
+
+	/// Gets top level BVH or nullptr when there are no instances
+	const BVH* topLevel() const {
+		return m_topLevel.get();
+	}
+
+	/// Gets index of instance at given object position in top level leafs
+	size_t instanceIndex(size_t i) const {
+		return m_order[m_topLevel->objectIndex(i)];
+	}
+
+	const Instance& instance(size_t i) const {
+		return m_instances[i];
+	}
+
+	size_t numInstances() const {
+		return m_instances.size();
+	}
+
+	/// Gets number of different meshes which have bottom level
+	size_t numMeshes() const {
+		return m_meshes.size();
+	}
+
+	/// Gets memory taken by top level and instances
+	size_t topLevelMemorySize() const;
+
+	/// Gets memory taken by all bottom levels
+	size_t bottomLevelsMemorySize() const;
+private:
+	TwoLevelBVH(const TwoLevelBVH&);
+	TwoLevelBVH& operator=(TwoLevelBVH);
+
+	static BoundingBox transformBoundingBox(const BoundingBox& bbox, const glm::mat4& m);
+
+	BVH::BuildParams m_topParams;
+	BVH::BuildParams m_bottomParams;
+	std::vector<Instance> m_instances;
+	std::unordered_map<const Mesh*, std::unique_ptr<MeshBVH>> m_meshes;
+	std::unique_ptr<BVH> m_topLevel;
+	/// index of instance for each object position of top level
+	std::vector<size_t> m_order;
+	/// object position of top level for each instance
+	std::vector<size_t> m_positions;
+	/// instances in order of top level objects, refit reads their bounds
+	std::vector<const Instance*> m_leafInstances;
+	/// object positions of instances moved since last update
+	std::vector<size_t> m_moved;
+	bool m_needsRebuild;
+};
+
+template <class Visitor>
+void TwoLevelBVH::cullFrustum(const Frustum& frustum, Visitor visitor) const {
+	if (!m_topLevel)
+		return;
+
+	const BVH& bvh = *m_topLevel;
+	bvh.traverse([&](size_t node) {
+		return frustum.boundingBoxIntersetion(bvh.boundingBox(node)) != Frustum::Intersection::None;
+	}, [&](size_t node) {
+		size_t start = bvh.firstObject(node);
+		size_t end = start + bvh.numObjects(node);
+		for (size_t i = start; i < end; ++i)
+			visitor(instanceIndex(i));
+	});
+}
+
+#endif // !TWO_LEVEL_BVH_H
@@ -0,0 +1,259 @@
+/**
+ * @file WideBVH.cpp
+ *
+ * @author Jan Duek <xdusek17@stud.fit.vutbr.cz>
+ * @date 2013
+ */
+
+#include "WideBVH.h"
+
+#include <limits>
+#include <stdexcept>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define WIDE_BVH_SSE
+#include <xmmintrin.h>
+#endif
+
+#ifdef __AVX__
+#define WIDE_BVH_AVX
+#include <immintrin.h>
+#endif
+
+/// Bounds of children, min x, y, z followed by max x, y, z
+typedef const float* ChildBounds[6];
+
+#ifdef WIDE_BVH_SSE
+/// Classifies 4 children starting at offset
+static unsigned classifySse(const ChildBounds& bounds, int offset, const Frustum& frustum, unsigned& partial) {
+	__m128 outside = _mm_setzero_ps();
+	__m128 intersecting = _mm_setzero_ps();
+	__m128 zero = _mm_setzero_ps();
+
+	for (int i = 0; i < Frustum::NUM_PLANES; ++i) {
+		const glm::vec4& plane = frustum.plane(i).coefficients();
+
+		// positive vertex lies farthest along plane normal, negative the opposite
+		__m128 dp = _mm_setzero_ps();
+		__m128 dn = dp;
+		for (int axis = 0; axis < 3; ++axis) {
+			__m128 n = _mm_set1_ps(plane[axis]);
+			__m128 lo = _mm_load_ps(bounds[axis] + offset);
+			__m128 hi = _mm_load_ps(bounds[axis + 3] + offset);
+			if (plane[axis] >= 0.0f) {
+				dp = _mm_add_ps(dp, _mm_mul_ps(n, hi));
+				dn = _mm_add_ps(dn, _mm_mul_ps(n, lo));
+			} else {
+				dp = _mm_add_ps(dp, _mm_mul_ps(n, lo));
+				dn = _mm_add_ps(dn, _mm_mul_ps(n, hi));
+			}
+		}
+		// add distance last so results match Frustum::boundingBoxIntersetion
+		dp = _mm_add_ps(dp, _mm_set1_ps(plane.w));
+		dn = _mm_add_ps(dn, _mm_set1_ps(plane.w));
+
+		outside = _mm_or_ps(outside, _mm_cmplt_ps(dp, zero));
+		intersecting = _mm_or_ps(intersecting, _mm_cmplt_ps(dn, zero));
+	}
+
+	unsigned visible = ~static_cast<unsigned>(_mm_movemask_ps(outside)) & 0xF;
+	partial = static_cast<unsigned>(_mm_movemask_ps(intersecting)) & visible;
+	return visible;
+}
+#endif
+
+#ifdef WIDE_BVH_AVX
+/// Classifies 8 children
+static unsigned classifyAvx(const ChildBounds& bounds, const Frustum& frustum, unsigned& partial) {
+	__m256 outside = _mm256_setzero_ps();
+	__m256 intersecting = _mm256_setzero_ps();
+	__m256 zero = _mm256_setzero_ps();
+
+	for (int i = 0; i < Frustum::NUM_PLANES; ++i) {
+		const glm::vec4& plane = frustum.plane(i).coefficients();
+
+		__m256 dp = _mm256_setzero_ps();
+		__m256 dn = dp;
+		for (int axis = 0; axis < 3; ++axis) {
+			__m256 n = _mm256_set1_ps(plane[axis]);
+			__m256 lo = _mm256_load_ps(bounds[axis]);
+			__m256 hi = _mm256_load_ps(bounds[axis + 3]);
+			if (plane[axis] >= 0.0f) {
+				dp = _mm256_add_ps(dp, _mm256_mul_ps(n, hi));
+				dn = _mm256_add_ps(dn, _mm256_mul_ps(n, lo));
+			} else {
+				dp = _mm256_add_ps(dp, _mm256_mul_ps(n, lo));
+				dn = _mm256_add_ps(dn, _mm256_mul_ps(n, hi));
+			}
+		}
+		// add distance last so results match Frustum::boundingBoxIntersetion
+		dp = _mm256_add_ps(dp, _mm256_set1_ps(plane.w));
+		dn = _mm256_add_ps(dn, _mm256_set1_ps(plane.w));
+
+		outside = _mm256_or_ps(outside, _mm256_cmp_ps(dp, zero, _CMP_LT_OQ));
+		intersecting = _mm256_or_ps(intersecting, _mm256_cmp_ps(dn, zero, _CMP_LT_OQ));
+	}
+
+	unsigned visible = ~static_cast<unsigned>(_mm256_movemask_ps(outside)) & 0xFF;
+	partial = static_cast<unsigned>(_mm256_movemask_ps(intersecting)) & visible;
+	return visible;
+}
+#endif
+
+#ifndef WIDE_BVH_SSE
+/// Classifies children one by one, used when SIMD is not available
+static unsigned classifyScalar(const ChildBounds& bounds, int width, const Frustum& frustum, unsigned& partial) {
+	unsigned visible = 0;
+	partial = 0;
+	for (int child = 0; child < width; ++child) {
+		bool outside = false, intersecting = false;
+		for (int i = 0; i < Frustum::NUM_PLANES && !outside; ++i) {
+			const glm::vec4& plane = frustum.plane(i).coefficients();
+			float dp = 0.0f, dn = 0.0f;
+			for (int axis = 0; axis < 3; ++axis) {
+				float lo = bounds[axis][child], hi = bounds[axis + 3][child];
+				dp += plane[axis] * (plane[axis] >= 0.0f ? hi : lo);
+				dn += plane[axis] * (plane[axis] >= 0.0f ? lo : hi);
+			}
+			dp += plane.w;
+			dn += plane.w;
+			outside = dp < 0.0f;
+			intersecting = intersecting || dn < 0.0f;
+		}
+
+		if (!outside) {
+			visible |= 1u << child;
+			if (intersecting)
+				partial |= 1u << child;
+		}
+	}
+	return visible;
+}
+#endif
+
+template <class Node>
+static void setSlotBounds(Node& node, int i, const BoundingBox& bbox) {
+	node.minX[i] = bbox.min().x;
+	node.minY[i] = bbox.min().y;
+	node.minZ[i] = bbox.min().z;
+	node.maxX[i] = bbox.max().x;
+	node.maxY[i] = bbox.max().y;
+	node.maxZ[i] = bbox.max().z;
+}
+
+/// Empty slots get inverted boxes which are always outside of frustum
+template <class Node>
+static void setEmptySlot(Node& node, int i, uint32_t emptySlot) {
+	node.minX[i] = node.minY[i] = node.minZ[i] = std::numeric_limits<float>::max();
+	node.maxX[i] = node.maxY[i] = node.maxZ[i] = -std::numeric_limits<float>::max();
+	node.child[i] = 0;
+	node.count[i] = emptySlot;
+}
+
+template <int Width>
+unsigned WideBVH<Width>::classify(const Node& node, const Frustum& frustum, unsigned& partial) {
+	ChildBounds bounds = { node.minX, node.minY, node.minZ, node.maxX, node.maxY, node.maxZ };
+
+#if defined(WIDE_BVH_AVX)
+	if (Width == 8)
+		return classifyAvx(bounds, frustum, partial);
+#endif
+
+#if defined(WIDE_BVH_SSE)
+	unsigned visible = 0;
+	partial = 0;
+	for (int i = 0; i < Width; i += 4) {
+		unsigned groupPartial;
+		visible |= classifySse(bounds, i, frustum, groupPartial) << i;
+		partial |= groupPartial << i;
+	}
+	return visible;
+#else
+	return classifyScalar(bounds, Width, frustum, partial);
+#endif
+}
+
+template <int Width>
+WideBVH<Width>::WideBVH(const BVH& bvh) : m_maxDepth(0) {
+	if (bvh.numNodes() > std::numeric_limits<uint32_t>::max())
+		throw std::runtime_error("WideBVH::WideBVH BVH is too big");
+
+	if (bvh.isLeaf(0)) {
+		// single leaf has to be child of root
+		Node root;
+		for (int i = 1; i < Width; ++i)
+			setEmptySlot(root, i, EMPTY_SLOT);
+
+		setSlotBounds(root, 0, bvh.boundingBox(0));
+		root.child[0] = static_cast<uint32_t>(bvh.firstObject(0));
+		root.count[0] = static_cast<uint32_t>(bvh.numObjects(0));
+		m_nodes.push_back(root);
+		m_maxDepth = 1;
+	} else {
+		collapse(bvh, 0, 1);
+	}
+
+	m_stack.reserve(m_maxDepth * (Width - 1) + 1);
+}
+
+template <int Width>
+uint32_t WideBVH<Width>::collapse(const BVH& bvh, size_t index, size_t depth) {
+	if (depth > m_maxDepth)
+		m_maxDepth = depth;
+
+	// open interior child with largest surface until node is full
+	size_t children[Width];
+	int numChildren = 2;
+	children[0] = index + 1;
+	children[1] = bvh.rightChild(index);
+	while (numChildren < Width) {
+		int best = -1;
+		float bestArea = -1.0f;
+		for (int i = 0; i < numChildren; ++i) {
+			if (bvh.isLeaf(children[i]))
+				continue;
+
+			float area = bvh.boundingBox(children[i]).surfaceArea();
+			if (area > bestArea) {
+				best = i;
+				bestArea = area;
+			}
+		}
+
+		if (best == -1)
+			break;
+
+		size_t opened = children[best];
+		children[best] = opened + 1;
+		children[numChildren++] = bvh.rightChild(opened);
+	}
+
+	uint32_t nodeIndex = static_cast<uint32_t>(m_nodes.size());
+	m_nodes.push_back(Node());
+
+	for (int i = 0; i < Width; ++i) {
+		Node& node = m_nodes[nodeIndex];
+		if (i >= numChildren) {
+			setEmptySlot(node, i, EMPTY_SLOT);
+			continue;
+		}
+
+		size_t child = children[i];
+		setSlotBounds(node, i, bvh.boundingBox(child));
+
+		if (bvh.isLeaf(child)) {
+			node.child[i] = static_cast<uint32_t>(bvh.firstObject(child));
+			node.count[i] = static_cast<uint32_t>(bvh.numObjects(child));
+		} else {
+			// collapsing child can reallocate nodes so do not hold reference
+			uint32_t childIndex = collapse(bvh, child, depth + 1);
+			m_nodes[nodeIndex].child[i] = childIndex;
+			m_nodes[nodeIndex].count[i] = 0;
+		}
+	}
+
+	return nodeIndex;
+}
+
+template class WideBVH<4>;
+template class WideBVH<8>;
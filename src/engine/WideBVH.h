@@ -0,0 +1,132 @@
+/**
+ * @file WideBVH.h
+ *
+ * @author Jan Duek <xdusek17@stud.fit.vutbr.cz>
+ * @date 2013
+ */
+
+#ifndef WIDE_BVH_H
+#define WIDE_BVH_H
+
+#include "BVH.h"
+#include "Frustum.h"
+#include "AlignedAllocator.h"
+
+#include <vector>
+#include <cstdint>
+
+/// Width of wide BVH which fits to widest available SIMD register
+#ifdef __AVX__
+const int NATIVE_WIDE_BVH_WIDTH = 8;
+#else
+const int NATIVE_WIDE_BVH_WIDTH = 4;
+#endif
+
+/**
+ * BVH with Width children per node collapsed from binary BVH.
+ * Bounding boxes of all children are stored in SoA form so frustum
+ * test classifies all of them at once using SIMD instructions.
+ * @tparam Width 4 or 8
+ */
+template <int Width>
+class WideBVH
+{
+	static_assert(Width == 4 || Width == 8, "WideBVH supports only width 4 and 8");
+public:
+	/// Marks unused child slot, used slots are always at the beginning
+	static const uint32_t EMPTY_SLOT = 0xFFFFFFFF;
+
+	struct ALIGNED(32) Node
+	{
+		float minX[Width];
+		float minY[Width];
+		float minZ[Width];
+		float maxX[Width];
+		float maxY[Width];
+		float maxZ[Width];
+		/// index of child node or first object of leaf child
+		uint32_t child[Width];
+		/// number of objects of leaf child, 0 for interior child
+		uint32_t count[Width];
+	};
+
+	typedef std::vector<Node, AlignedAllocator<Node, 32>> NodeArray;
+
+	/// Collapses binary BVH, it can have any node layout
+	explicit WideBVH(const BVH& bvh);
+
+	/**
+	 * Finds leafs intersecting frustum.
+	 * @param visitor functor called as visitor(firstObject, numObjects) for each visible leaf
+	 */
+	template <class Visitor>
+	void cullFrustum(const Frustum& frustum, Visitor visitor) const;
+
+	/**
+	 * Tests all children of node against frustum.
+	 * @param partial receives mask of children only partialy inside frustum
+	 * @return mask of children intersecting frustum
+	 */
+	static unsigned classify(const Node& node, const Frustum& frustum, unsigned& partial);
+
+	const NodeArray& nodes() const {
+		return m_nodes;
+	}
+
+	size_t memorySize() const {
+		return m_nodes.size() * sizeof(Node);
+	}
+private:
+	struct StackEntry
+	{
+		uint32_t node;
+		/// node is whole inside frustum so its children does not have to be tested
+		bool inside;
+	};
+
+	/// Creates wide node from binary interior node, returns its index
+	uint32_t collapse(const BVH& bvh, size_t index, size_t depth);
+
+	NodeArray m_nodes;
+	size_t m_maxDepth;
+	/// traversal stack, reserved for maximal depth so traversal does not allocate
+	mutable std::vector<StackEntry> m_stack;
+};
+
+template <int Width>
+template <class Visitor>
+void WideBVH<Width>::cullFrustum(const Frustum& frustum, Visitor visitor) const {
+	StackEntry root = { 0, false };
+	m_stack.clear();
+	m_stack.push_back(root);
+
+	while (!m_stack.empty()) {
+		StackEntry entry = m_stack.back();
+		m_stack.pop_back();
+		const Node& node = m_nodes[entry.node];
+
+		unsigned visible, partial;
+		if (entry.inside) {
+			visible = 0;
+			for (int i = 0; i < Width && node.count[i] != EMPTY_SLOT; ++i)
+				visible |= 1u << i;
+			partial = 0;
+		} else {
+			visible = classify(node, frustum, partial);
+		}
+
+		for (int i = 0; i < Width; ++i) {
+			if ((visible & (1u << i)) == 0)
+				continue;
+
+			if (node.count[i] == 0) {
+				StackEntry child = { node.child[i], (partial & (1u << i)) == 0 };
+				m_stack.push_back(child);
+			} else {
+				visitor(static_cast<size_t>(node.child[i]), static_cast<size_t>(node.count[i]));
+			}
+		}
+	}
+}
+
+#endif // !WIDE_BVH_H
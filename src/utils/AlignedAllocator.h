@@ -0,0 +1,109 @@
+/**
+ * @file AlignedAllocator.h
+ *
+ * @author Jan Duek <xdusek17@stud.fit.vutbr.cz>
+ * @date 2013
+ */
+
+#ifndef ALIGNED_ALLOCATOR_H
+#define ALIGNED_ALLOCATOR_H
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+/// Aligns type declared after this macro to n bytes
+#ifdef _MSC_VER
+#define ALIGNED(n) __declspec(align(n))
+#else
+#define ALIGNED(n) __attribute__((aligned(n)))
+#endif
+
+/**
+ * Allocator returning memory aligned to given boundary.
+ * Use it with containers of types with greater alignment than new guarantees.
+ * @tparam Alignment power of two
+ */
+template <typename T, size_t Alignment>
+class AlignedAllocator
+{
+public:
+	typedef T value_type;
+	typedef T* pointer;
+	typedef const T* const_pointer;
+	typedef T& reference;
+	typedef const T& const_reference;
+	typedef size_t size_type;
+	typedef ptrdiff_t difference_type;
+
+	template <typename U>
+	struct rebind
+	{
+		typedef AlignedAllocator<U, Alignment> other;
+	};
+
+	AlignedAllocator() { }
+
+	template <typename U>
+	AlignedAllocator(const AlignedAllocator<U, Alignment>&) { }
+
+	pointer allocate(size_type n, const void* = nullptr) {
+		if (n == 0)
+			return nullptr;
+
+		void* ptr;
+#ifdef _WIN32
+		ptr = _aligned_malloc(n * sizeof(T), Alignment);
+#else
+		if (posix_memalign(&ptr, Alignment, n * sizeof(T)) != 0)
+			ptr = nullptr;
+#endif
+		if (ptr == nullptr)
+			throw std::bad_alloc();
+		return static_cast<pointer>(ptr);
+	}
+
+	void deallocate(pointer p, size_type) {
+#ifdef _WIN32
+		_aligned_free(p);
+#else
+		free(p);
+#endif
+	}
+
+	void construct(pointer p, const T& value) {
+		new (p) T(value);
+	}
+
+	void destroy(pointer p) {
+		p->~T();
+	}
+
+	size_type max_size() const {
+		return static_cast<size_type>(-1) / sizeof(T);
+	}
+
+	pointer address(reference x) const {
+		return &x;
+	}
+
+	const_pointer address(const_reference x) const {
+		return &x;
+	}
+
+	template <typename U>
+	bool operator==(const AlignedAllocator<U, Alignment>&) const {
+		return true;
+	}
+
+	template <typename U>
+	bool operator!=(const AlignedAllocator<U, Alignment>&) const {
+		return false;
+	}
+};
+
+#endif // ALIGNED_ALLOCATOR_H
@@ -9,29 +9,12 @@
 
 #include <algorithm>
 
-BoundingBox::BoundingBox(const glm::vec3& min, const glm::vec3& max) 
-	: m_min(min), m_max(max), m_extent(max - min) { }
-
-BoundingBox::BoundingBox(const glm::vec3& point) 
-	: m_min(point), m_max(point), m_extent(m_max - m_min) { }
-
-void BoundingBox::expandToInclude(const glm::vec3& point) {
-	m_min = glm::min(m_min, point);
-	m_max = glm::max(m_max, point);
-	m_extent = m_max - m_min;
-}
-
-void BoundingBox::expandToInclude(const BoundingBox& bbox) {
-	m_min = glm::min(m_min, bbox.m_min);
-	m_max = glm::max(m_max, bbox.m_max);
-	m_extent = m_max - m_min;
-}
-
 int BoundingBox::maxDimension() const {
+	glm::vec3 extent = m_max - m_min;
 	int result = 0;
-	if (m_extent.y > m_extent.x)
+	if (extent.y > extent.x)
 		result = 1;
-	if (m_extent.z > m_extent.y)
+	if (extent.z > extent[result])
 		result = 2;
 	return result;
 }
@@ -51,3 +34,10 @@ float BoundingBox::sqrDistance(const glm::vec3& p) const {
 	}
 	return dist;
 }
+
+float BoundingBox::overlapVolume(const BoundingBox& bbox) const {
+	glm::vec3 extent = glm::min(m_max, bbox.m_max) - glm::max(m_min, bbox.m_min);
+	if (extent.x <= 0.0f || extent.y <= 0.0f || extent.z <= 0.0f)
+		return 0.0f;
+	return extent.x * extent.y * extent.z;
+}
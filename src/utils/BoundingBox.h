@@ -20,9 +20,9 @@ public:
 	/// Creates bounding box representing point in (0, 0, 0).
 	BoundingBox() { }
 	/// Creates bounding box representing point.
-	BoundingBox(const glm::vec3& point);
+	BoundingBox(const glm::vec3& point) : m_min(point), m_max(point) { }
 	/// Creates bounding box from min and max points.
-	BoundingBox(const glm::vec3& min, const glm::vec3& max);
+	BoundingBox(const glm::vec3& min, const glm::vec3& max) : m_min(min), m_max(max) { }
 
 	/// Gets minimum point
 	const glm::vec3& min() const {
@@ -50,17 +50,38 @@ public:
 
 	float sqrDistance(const glm::vec3& p) const;
 
+	/// Gets surface area of bounding box
+	float surfaceArea() const {
+		glm::vec3 extent = m_max - m_min;
+		return 2.0f * (extent.x * extent.y + extent.x * extent.z + extent.y * extent.z);
+	}
+
+	/// Gets volume of bounding box
+	float volume() const {
+		glm::vec3 extent = m_max - m_min;
+		return extent.x * extent.y * extent.z;
+	}
+
+	/// Gets volume of intersection with another bounding box, 0 when they does not intersect
+	float overlapVolume(const BoundingBox& bbox) const;
+
 	/// Enlarges bounding box to include given point
-	void expandToInclude(const glm::vec3& point);
+	void expandToInclude(const glm::vec3& point) {
+		m_min = glm::min(m_min, point);
+		m_max = glm::max(m_max, point);
+	}
+
 	/// Enlarges bounding box to include another bounding box
-	void expandToInclude(const BoundingBox& bbox);
+	void expandToInclude(const BoundingBox& bbox) {
+		m_min = glm::min(m_min, bbox.m_min);
+		m_max = glm::max(m_max, bbox.m_max);
+	}
 
 	/// Gets index of dimension where bbox has maximum size
 	int maxDimension() const;
 private:
 	glm::vec3 m_min;
 	glm::vec3 m_max;
-	glm::vec3 m_extent;
 };
 
 #endif // BOUNDING_BOX_H
@@ -21,6 +21,11 @@ Frustum::Frustum(const glm::mat4& vp) {
 	m_planes[FAR] = Plane::fromCoeficients(-m[2] + m[3]);
 }
 
+void Frustum::removeNearPlane() {
+	// every point is in front of plane with zero normal and positive distance
+	m_planes[NEAR] = Plane(0.0f, 0.0f, 0.0f, 1.0f);
+}
+
 glm::vec3 getBBoxPositiveVertex(const BoundingBox& bbox, const glm::vec3& normal) {
 	glm::vec3 result = bbox.min();
 	if (normal.x >= 0)
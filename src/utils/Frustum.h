@@ -23,6 +23,15 @@ public:
 	Frustum(const glm::mat4& vp);
 
 	Intersection boundingBoxIntersetion(const BoundingBox& bbox) const;
+
+	/// Makes frustum unbounded towards its near plane, shadow casters in front of light projection are kept
+	void removeNearPlane();
+
+	static const int NUM_PLANES = 6;
+
+	const Plane& plane(int i) const {
+		return m_planes[i];
+	}
 private:
 	Plane m_planes[6];
 };
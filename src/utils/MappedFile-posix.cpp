@@ -0,0 +1,56 @@
+/**
+ * @file MappedFile-posix.cpp
+ *
+ * @brief POSIX only file for MappedFile.h
+ *
+ * @author Jan Duek <xdusek17@stud.fit.vutbr.cz>
+ * @date 2013
+ */
+
+#include "MappedFile.h"
+#include "Exception.h"
+
+#ifdef _WIN32
+#error "This file is not for Win32!"
+#endif
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(const std::string& path) : m_data(nullptr), m_size(0) {
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd == -1)
+		throw SystemException(("Unable to open " + path).c_str());
+
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		int errnum = errno;
+		close(fd);
+		throw SystemException(("Unable to stat " + path).c_str(), errnum);
+	}
+
+	m_size = static_cast<size_t>(st.st_size);
+	if (m_size > 0) {
+		void* ptr = mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		if (ptr == MAP_FAILED) {
+			int errnum = errno;
+			close(fd);
+			throw SystemException(("Unable to map " + path).c_str(), errnum);
+		}
+		m_data = static_cast<char*>(ptr);
+	}
+
+	// mapping stays valid after descriptor is closed
+	close(fd);
+}
+
+MappedFile::~MappedFile() {
+	if (m_data)
+		munmap(m_data, m_size);
+}
+
+bool MappedFile::exists(const std::string& path) {
+	return access(path.c_str(), R_OK) == 0;
+}
@@ -0,0 +1,61 @@
+/**
+ * @file MappedFile-win32.cpp
+ *
+ * @brief Win32 only file for MappedFile.h
+ *
+ * @author Jan Duek <xdusek17@stud.fit.vutbr.cz>
+ * @date 2013
+ */
+
+#include "MappedFile.h"
+#include "Exception.h"
+
+#ifndef _WIN32
+#error "This file is for Win32 only!"
+#endif
+
+MappedFile::MappedFile(const std::string& path) 
+	: m_data(nullptr), m_size(0), m_file(INVALID_HANDLE_VALUE), m_mapping(nullptr) {
+	m_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, 
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (m_file == INVALID_HANDLE_VALUE)
+		throw Win32Exception(("Unable to open " + path).c_str());
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(m_file, &size)) {
+		DWORD error = GetLastError();
+		CloseHandle(m_file);
+		throw Win32Exception(("Unable to get size of " + path).c_str(), error);
+	}
+
+	m_size = static_cast<size_t>(size.QuadPart);
+	if (m_size > 0) {
+		// PAGE_WRITECOPY with FILE_MAP_COPY gives private copy on write pages
+		m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+		if (!m_mapping) {
+			DWORD error = GetLastError();
+			CloseHandle(m_file);
+			throw Win32Exception(("Unable to map " + path).c_str(), error);
+		}
+
+		m_data = static_cast<char*>(MapViewOfFile(m_mapping, FILE_MAP_COPY, 0, 0, 0));
+		if (!m_data) {
+			DWORD error = GetLastError();
+			CloseHandle(m_mapping);
+			CloseHandle(m_file);
+			throw Win32Exception(("Unable to map view of " + path).c_str(), error);
+		}
+	}
+}
+
+MappedFile::~MappedFile() {
+	if (m_data)
+		UnmapViewOfFile(m_data);
+	if (m_mapping)
+		CloseHandle(m_mapping);
+	CloseHandle(m_file);
+}
+
+bool MappedFile::exists(const std::string& path) {
+	return GetFileAttributesA(path.c_str()) != INVALID_FILE_ATTRIBUTES;
+}
@@ -0,0 +1,55 @@
+/**
+ * @file MappedFile.h
+ *
+ * @author Jan Duek <xdusek17@stud.fit.vutbr.cz>
+ * @date 2013
+ */
+
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <string>
+#include <cstddef>
+
+/**
+ * File mapped to memory.
+ * Mapping is copy on write, so data can be modified in place 
+ * without changing the file.
+ */
+class MappedFile
+{
+public:
+	/**
+	 * Maps whole file to memory.
+	 * @throw SystemException or Win32Exception when file cannot be mapped
+	 */
+	explicit MappedFile(const std::string& path);
+	~MappedFile();
+
+	char* data() {
+		return m_data;
+	}
+
+	const char* data() const {
+		return m_data;
+	}
+
+	size_t size() const {
+		return m_size;
+	}
+
+	/// Checks if file exists and can be opened for reading
+	static bool exists(const std::string& path);
+private:
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+
+	char* m_data;
+	size_t m_size;
+#ifdef _WIN32
+	void* m_file;
+	void* m_mapping;
+#endif
+};
+
+#endif // MAPPED_FILE_H
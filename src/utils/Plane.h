@@ -57,6 +57,11 @@ public:
 	glm::vec3 normal() const {
 		return glm::swizzle<glm::X, glm::Y, glm::Z>(m_coefs);
 	}
+
+	/// Gets coefficients A, B, C, D of plane equation
+	const glm::vec4& coefficients() const {
+		return m_coefs;
+	}
 private:
 	glm::vec4 m_coefs;
 };
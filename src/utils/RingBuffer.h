@@ -0,0 +1,90 @@
+/**
+ * @file RingBuffer.h
+ *
+ * @author Jan Duek <xdusek17@stud.fit.vutbr.cz>
+ * @date 2013
+ */
+
+#ifndef RING_BUFFER_H
+#define RING_BUFFER_H
+
+#include <vector>
+#include <cstddef>
+#include <cassert>
+
+/**
+ * FIFO queue stored in circular buffer.
+ * Unlike std::queue it does not allocate once buffer is big enough,
+ * so it can be reused every frame without touching heap.
+ */
+template <typename T>
+class RingBuffer
+{
+public:
+	typedef T value_type;
+	typedef size_t size_type;
+
+	/// @param capacity initial capacity, rounded up to power of two
+	explicit RingBuffer(size_type capacity = 64) : m_head(0), m_size(0) {
+		size_type n = 1;
+		while (n < capacity)
+			n <<= 1;
+		m_data.resize(n);
+	}
+
+	bool empty() const {
+		return m_size == 0;
+	}
+
+	size_type size() const {
+		return m_size;
+	}
+
+	size_type capacity() const {
+		return m_data.size();
+	}
+
+	value_type& front() {
+		assert(m_size > 0);
+		return m_data[m_head];
+	}
+
+	const value_type& front() const {
+		assert(m_size > 0);
+		return m_data[m_head];
+	}
+
+	void push(const value_type& value) {
+		if (m_size == m_data.size())
+			grow();
+		m_data[(m_head + m_size) & (m_data.size() - 1)] = value;
+		m_size++;
+	}
+
+	void pop() {
+		assert(m_size > 0);
+		m_head = (m_head + 1) & (m_data.size() - 1);
+		m_size--;
+	}
+
+	/// Removes all items, capacity is kept
+	void clear() {
+		m_head = 0;
+		m_size = 0;
+	}
+private:
+	/// Doubles capacity and moves items to the beginning
+	void grow() {
+		std::vector<T> data(m_data.size() * 2);
+		for (size_type i = 0; i < m_size; ++i)
+			data[i] = m_data[(m_head + i) & (m_data.size() - 1)];
+		m_data.swap(data);
+		m_head = 0;
+	}
+
+	std::vector<T> m_data;
+	size_type m_head;
+	size_type m_size;
+};
+
+#endif // RING_BUFFER_H